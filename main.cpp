@@ -14,20 +14,74 @@
 #include <cassert>
 #include <fstream>
 #include <ctime>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cstdio>
+#include <unordered_set>
+#include <atomic>
+#include <cctype>
+#include <iterator>
+#include <random>
+#include <memory>
+#include <climits>
+#include <map>
+#include <functional>
+#include <deque>
+#include <condition_variable>
+#include <future>
+#include <array>
+#include <type_traits>
+#include <string_view>
+#include <tuple>
+#include <filesystem>
+#include <utility>
+#include <shared_mutex>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 // ========== Logger ==========
 // Provides timestamped info and error logs
 class Logger {
 public:
     static void info(const std::string& msg) {
+        if (quiet_) return;
         std::cout << timestamp() << " [INFO] " << msg << "\n";
     }
 
     static void error(const std::string& msg) {
+        if (error_sink_) {
+            error_sink_->push_back(msg);
+            return;
+        }
         std::cerr << timestamp() << " [ERROR] " << msg << "\n";
     }
 
+    // Suppresses info logs (errors are always printed), e.g. for benchmarks
+    static void set_quiet(bool quiet) { quiet_ = quiet; }
+    static bool quiet() { return quiet_; }
+
+    // While set, errors logged by this thread are appended to sink instead
+    // of printed
+    static void set_error_sink(std::vector<std::string>* sink) { error_sink_ = sink; }
+    static std::vector<std::string>* error_sink() { return error_sink_; }
+
 private:
+    static inline std::atomic<bool> quiet_{false};
+    static inline thread_local std::vector<std::string>* error_sink_ = nullptr;
+
     static std::string timestamp() {
         auto now = std::chrono::system_clock::now();
         auto time = std::chrono::system_clock::to_time_t(now);
@@ -38,17 +92,133 @@ private:
 };
 
 // ========== Utility ==========
-// Escapes quotes and backslashes for JSON strings
-std::string escape(const std::string& s) {
-    std::string out;
+// Wraps s in double quotes, escaping quotes, backslashes and any byte that
+// is not printable ASCII. split_args() reverses this exactly.
+std::string quote(const std::string& s) {
+    static const char* hex = "0123456789abcdef";
+    std::string out = "\"";
     for (char c : s) {
-        if (c == '\"') out += "\\\"";
+        unsigned char u = static_cast<unsigned char>(c);
+        if (c == '"') out += "\\\"";
         else if (c == '\\') out += "\\\\";
-        else out += c;
+        else if (c == '\n') out += "\\n";
+        else if (c == '\t') out += "\\t";
+        else if (c == '\r') out += "\\r";
+        else if (u < 0x20 || u >= 0x7f) {
+            out += "\\x";
+            out += hex[u >> 4];
+            out += hex[u & 15];
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+    return out;
+}
+
+// Prints plain text as-is and anything else (spaces at the ends, quotes,
+// control or non-ASCII bytes, empty) in quoted form, so output is unambiguous
+std::string format_value(const std::string& s) {
+    bool plain = !s.empty() && s.front() != ' ' && s.back() != ' ';
+    for (char c : s) {
+        unsigned char u = static_cast<unsigned char>(c);
+        if (u < 0x20 || u >= 0x7f || c == '"' || c == '\'' || c == '\\') plain = false;
+    }
+    return plain ? s : quote(s);
+}
+
+// format_value() limited to roughly the first 64 bytes, for log lines
+std::string preview(const std::string& s) {
+    if (s.size() <= 80) return format_value(s);
+    return format_value(s.substr(0, 64)) + "... (" + std::to_string(s.size()) + " bytes)";
+}
+
+// Splits a command line into arguments. Supports bare words, "double quoted"
+// strings with \" \\ \n \t \r \0 and \xNN escapes, and 'single quoted'
+// literal strings. Returns nullopt on an unterminated quote or bad escape.
+std::optional<std::vector<std::string>> split_args(const std::string& line) {
+    auto hex_value = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+
+    std::vector<std::string> args;
+    size_t i = 0;
+    while (true) {
+        while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i]))) ++i;
+        if (i >= line.size()) return args;
+
+        std::string arg;
+        while (i < line.size() && !std::isspace(static_cast<unsigned char>(line[i]))) {
+            char c = line[i];
+            if (c == '"') {
+                ++i;
+                while (true) {
+                    if (i >= line.size()) return std::nullopt;
+                    char q = line[i++];
+                    if (q == '"') break;
+                    if (q != '\\') {
+                        arg += q;
+                        continue;
+                    }
+                    if (i >= line.size()) return std::nullopt;
+                    char e = line[i++];
+                    switch (e) {
+                        case 'n': arg += '\n'; break;
+                        case 't': arg += '\t'; break;
+                        case 'r': arg += '\r'; break;
+                        case '0': arg += '\0'; break;
+                        case 'x': {
+                            int hi = i < line.size() ? hex_value(line[i]) : -1;
+                            int lo = i + 1 < line.size() ? hex_value(line[i + 1]) : -1;
+                            if (hi < 0 || lo < 0) return std::nullopt;
+                            arg += static_cast<char>(hi * 16 + lo);
+                            i += 2;
+                            break;
+                        }
+                        default: arg += e; break;
+                    }
+                }
+            } else if (c == '\'') {
+                size_t end = line.find('\'', i + 1);
+                if (end == std::string::npos) return std::nullopt;
+                arg += line.substr(i + 1, end - i - 1);
+                i = end + 1;
+            } else {
+                arg += c;
+                ++i;
+            }
+        }
+        args.push_back(std::move(arg));
+    }
+}
+
+// Joins args[from..] with single spaces
+std::string join_args(const std::vector<std::string>& args, size_t from) {
+    std::string out;
+    for (size_t i = from; i < args.size(); ++i) {
+        if (i > from) out += ' ';
+        out += args[i];
     }
     return out;
 }
 
+// Parses a whole string as a signed 64-bit integer
+std::optional<long long> parse_int(const std::string& s) {
+    if (s.empty()) return std::nullopt;
+    size_t used = 0;
+    long long n = 0;
+    try {
+        n = std::stoll(s, &used);
+    } catch (...) {
+        return std::nullopt;
+    }
+    if (used != s.size()) return std::nullopt;
+    return n;
+}
+
 // ========== Utilities ==========
 // Trims whitespace from both ends of a string
 std::string trim(const std::string& str) {
@@ -58,185 +228,9812 @@ std::string trim(const std::string& str) {
     return str.substr(first, last - first + 1);
 }
 
+// Matches one pattern element at p (?, a [class], an escaped or plain
+// byte) against c and moves p past it
+bool glob_match_one(std::string_view pattern, size_t& p, char c) {
+    char first = pattern[p++];
+    if (first == '?') return true;
+    if (first == '\\' && p < pattern.size()) return pattern[p++] == c;
+    if (first != '[') return first == c;
 
-// ========== KeyValueStore ==========
-// Provides thread-safe key-value storage
-class KeyValueStore {
-public:
-    void set(const std::string& key, const std::string& value) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        store_[key] = value;
-        Logger::info("Set: {" + key + ": " + value + "}");
+    size_t end = p;
+    if (end < pattern.size() && pattern[end] == '^') ++end;
+    if (end < pattern.size() && pattern[end] == ']') ++end; // a leading ] is literal
+    while (end < pattern.size() && pattern[end] != ']') end += pattern[end] == '\\' ? 2 : 1;
+    if (end >= pattern.size()) return first == c; // unterminated: a literal [
+    bool negate = pattern[p] == '^';
+    size_t i = p + (negate ? 1 : 0);
+    bool found = false;
+    while (i < end) {
+        char lo = pattern[i] == '\\' && i + 1 < end ? pattern[++i] : pattern[i];
+        char hi = lo;
+        if (i + 2 < end && pattern[i + 1] == '-') {
+            hi = pattern[i + 2] == '\\' && i + 3 < end ? pattern[i + 3] : pattern[i + 2];
+            i += pattern[i + 2] == '\\' ? 3 : 2;
+            if (lo > hi) std::swap(lo, hi);
+        }
+        found |= static_cast<unsigned char>(c) >= static_cast<unsigned char>(lo) &&
+                 static_cast<unsigned char>(c) <= static_cast<unsigned char>(hi);
+        ++i;
     }
+    p = end + 1;
+    return found != negate;
+}
 
-    std::optional<std::string> get(const std::string& key) const {
-        std::lock_guard<std::mutex> lock(mutex_);
-        auto it = store_.find(key);
-        if (it != store_.end()) {
-            return it->second;
+// Redis-style glob: * matches any run, ? any byte, [abc] [a-z] [^x] a byte
+// from a set, and \ escapes the next character
+bool glob_match(std::string_view pattern, std::string_view text) {
+    size_t p = 0, t = 0, star = std::string_view::npos, star_t = 0;
+    while (t < text.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            star = ++p;
+            star_t = t;
+            continue;
         }
-        return std::nullopt;
+        size_t next = p;
+        if (p < pattern.size() && glob_match_one(pattern, next, text[t])) {
+            p = next;
+            ++t;
+            continue;
+        }
+        if (star == std::string_view::npos) return false;
+        p = star; // let the last * take one more byte
+        t = ++star_t;
     }
+    while (p < pattern.size() && pattern[p] == '*') ++p;
+    return p == pattern.size();
+}
 
-    void remove(const std::string& key) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        store_.erase(key);
-        Logger::info("Removed key: " + key);
+// 64-bit MurmurHash64A. Used wherever we need well-mixed bits from a string
+// (HyperLogLog register selection, Bloom filter probes).
+uint64_t hash64(const std::string& data, uint64_t seed = 0) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const size_t len = data.size();
+    const char* p = data.data();
+
+    uint64_t h = seed ^ (len * m);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t k;
+        std::memcpy(&k, p + i, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    size_t rem = len - i;
+    if (rem > 0) {
+        for (size_t j = rem; j-- > 0;) {
+            h ^= static_cast<uint64_t>(static_cast<unsigned char>(p[i + j])) << (8 * j);
+        }
+        h *= m;
     }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
 
-    void print_all() const {
-        std::lock_guard<std::mutex> lock(mutex_);
-        std::cout << "\n[STORE DUMP]\n";
-        for (const auto& [key, value] : store_) {
-            std::cout << "- " << key << ": " << value << "\n";
+// ========== Key hashing ==========
+
+// Hash used to place keys in the main table. Fast is wyhash with a random
+// per-process seed; SipHash is SipHash-2-4 with a random per-process key, for
+// stores whose keys come from untrusted clients; Std is std::hash, unseeded.
+enum class HashKind { Fast, SipHash, Std };
+
+const char* hash_kind_name(HashKind kind) {
+    switch (kind) {
+        case HashKind::Fast: return "fast";
+        case HashKind::SipHash: return "siphash";
+        case HashKind::Std: return "std";
+    }
+    return "?";
+}
+
+std::optional<HashKind> parse_hash_kind(const std::string& name) {
+    if (name == "fast" || name == "wyhash") return HashKind::Fast;
+    if (name == "siphash" || name == "sip") return HashKind::SipHash;
+    if (name == "std") return HashKind::Std;
+    return std::nullopt;
+}
+
+struct HashSeeds {
+    uint64_t fast = 0;
+    uint64_t sip[2] = {0, 0};
+};
+
+// Drawn once per process, so bucket placement can't be precomputed offline
+const HashSeeds& process_hash_seeds() {
+    static const HashSeeds seeds = [] {
+        std::random_device rd;
+        auto draw = [&rd] { return (static_cast<uint64_t>(rd()) << 32) ^ rd(); };
+        HashSeeds s;
+        s.fast = draw();
+        s.sip[0] = draw();
+        s.sip[1] = draw();
+        return s;
+    }();
+    return seeds;
+}
+
+namespace wy {
+constexpr uint64_t kSecret[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+                                 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL};
+
+inline void mum(uint64_t& a, uint64_t& b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = static_cast<__uint128_t>(a) * b;
+    a = static_cast<uint64_t>(r);
+    b = static_cast<uint64_t>(r >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32, la = static_cast<uint32_t>(a), lb = static_cast<uint32_t>(b);
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    a = lo;
+    b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+inline uint64_t mix(uint64_t a, uint64_t b) {
+    mum(a, b);
+    return a ^ b;
+}
+
+inline uint64_t r8(const unsigned char* p) {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;
+}
+
+inline uint64_t r4(const unsigned char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint64_t r3(const unsigned char* p, size_t k) {
+    return (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[k >> 1]) << 8) | p[k - 1];
+}
+}  // namespace wy
+
+// wyhash (final4 layout): a couple of 64x64->128 multiplies per 16 bytes.
+// Takes the seed already passed through wyhash_prepare_seed().
+uint64_t wyhash_prepared(const char* data, size_t len, uint64_t seed) {
+    using namespace wy;
+    const auto* p = reinterpret_cast<const unsigned char*>(data);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (r4(p) << 32) | r4(p + ((len >> 3) << 2));
+            b = (r4(p + len - 4) << 32) | r4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = r3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
         }
-        std::cout << std::endl;
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = mix(r8(p) ^ kSecret[1], r8(p + 8) ^ seed);
+                see1 = mix(r8(p + 16) ^ kSecret[2], r8(p + 24) ^ see1);
+                see2 = mix(r8(p + 32) ^ kSecret[3], r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = mix(r8(p) ^ kSecret[1], r8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = r8(p + i - 16);
+        b = r8(p + i - 8);
     }
+    a ^= kSecret[1];
+    b ^= seed;
+    mum(a, b);
+    return mix(a ^ kSecret[0] ^ len, b ^ kSecret[1]);
+}
 
-    bool exists(const std::string& key) const {
-        std::lock_guard<std::mutex> lock(mutex_);
-        return store_.find(key) != store_.end();
+inline uint64_t wyhash_prepare_seed(uint64_t seed) { return seed ^ wy::mix(seed ^ wy::kSecret[0], wy::kSecret[1]); }
+
+uint64_t wyhash(const char* data, size_t len, uint64_t seed) {
+    return wyhash_prepared(data, len, wyhash_prepare_seed(seed));
+}
+
+// SipHash-2-4 with a 128-bit key (k0, k1)
+uint64_t siphash24(const char* data, size_t len, uint64_t k0, uint64_t k1) {
+    auto rotl = [](uint64_t x, int b) { return (x << b) | (x >> (64 - b)); };
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    auto round = [&] {
+        v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+        v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+    };
+    const auto* p = reinterpret_cast<const unsigned char*>(data);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t m = 0;
+        for (int j = 7; j >= 0; --j) m = (m << 8) | p[i + j];
+        v3 ^= m;
+        round();
+        round();
+        v0 ^= m;
     }
+    uint64_t last = static_cast<uint64_t>(len) << 56;
+    for (size_t j = 0; i + j < len; ++j) last |= static_cast<uint64_t>(p[i + j]) << (8 * j);
+    v3 ^= last;
+    round();
+    round();
+    v0 ^= last;
+    v2 ^= 0xff;
+    for (int r = 0; r < 4; ++r) round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
 
-    void clear() {
-        std::lock_guard<std::mutex> lock(mutex_);
-        store_.clear();
-        Logger::info("Store cleared");
+// Hash of key under kind, computed from the bytes. Fast and SipHash are
+// seeded per process: for in-memory placement only, never persisted.
+uint64_t hash_key(HashKind kind, const std::string& key) {
+    switch (kind) {
+        case HashKind::Fast: {
+            static const uint64_t seed = wyhash_prepare_seed(process_hash_seeds().fast);
+            return wyhash_prepared(key.data(), key.size(), seed);
+        }
+        case HashKind::SipHash: {
+            const HashSeeds& s = process_hash_seeds();
+            return siphash24(key.data(), key.size(), s.sip[0], s.sip[1]);
+        }
+        case HashKind::Std:
+            break;
     }
+    return std::hash<std::string>{}(key);
+}
 
-    void save_to_file(const std::string& filename) const {
-        std::lock_guard<std::mutex> lock(mutex_);
-        std::ofstream ofs(filename);
-        if (!ofs) {
-            Logger::error("Could not open file for writing: " + filename);
-            return;
+// A key with its hashes computed once, for callers that use the same key
+// over and over. fast() places it in the concurrent backends and picks its
+// version shard and near cache slot; table_hash() places it in a table of
+// kind(). Valid for the life of the process.
+class KeyHandle {
+public:
+    explicit KeyHandle(std::string key, HashKind kind = HashKind::Fast)
+        : key_(std::move(key)),
+          kind_(kind),
+          fast_(hash_key(HashKind::Fast, key_)),
+          table_(kind == HashKind::Fast ? fast_ : hash_key(kind, key_)) {}
+
+    const std::string& key() const { return key_; }
+    HashKind kind() const { return kind_; }
+    uint64_t fast() const { return fast_; }
+    uint64_t table_hash() const { return table_; }
+
+    // While a Scope is alive, hashing this handle's own key string on this
+    // thread returns the stored hashes. Copies of the key hash normally.
+    class Scope {
+    public:
+        explicit Scope(const KeyHandle& handle) : previous_(current_) { current_ = &handle; }
+        ~Scope() { current_ = previous_; }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        const KeyHandle* previous_;
+    };
+
+    // The handle in scope whose key is this very string object, if any
+    static const KeyHandle* hinted(const std::string& key) {
+        const KeyHandle* h = current_;
+        return h && &h->key_ == &key ? h : nullptr;
+    }
+
+private:
+    inline static thread_local const KeyHandle* current_ = nullptr;
+
+    std::string key_;
+    HashKind kind_;
+    uint64_t fast_;
+    uint64_t table_;
+};
+
+inline uint64_t fast_hash(const std::string& key) {
+    if (const KeyHandle* h = KeyHandle::hinted(key)) return h->fast();
+    return hash_key(HashKind::Fast, key);
+}
+
+// Hasher for key tables; the kind travels with the table so it can be
+// switched by rehashing into a new one
+struct KeyHash {
+    HashKind kind = HashKind::Fast;
+
+    size_t operator()(const std::string& key) const {
+        const KeyHandle* h = KeyHandle::hinted(key);
+        return static_cast<size_t>(h && h->kind() == kind ? h->table_hash() : hash_key(kind, key));
+    }
+};
+
+// Event counter for hot paths shared by many threads: each thread adds to
+// one of several cache lines, and reads sum them
+class StripedCounter {
+public:
+    static constexpr size_t kStripes = 16;
+
+    void add(uint64_t n = 1) { stripes_[stripe()].value.fetch_add(n, std::memory_order_relaxed); }
+
+    uint64_t load() const {
+        uint64_t sum = 0;
+        for (const auto& s : stripes_) sum += s.value.load(std::memory_order_relaxed);
+        return sum;
+    }
+
+private:
+    struct alignas(64) Stripe {
+        std::atomic<uint64_t> value{0};
+    };
+
+    static size_t stripe() {
+        static thread_local const size_t index = std::hash<std::thread::id>()(std::this_thread::get_id()) % kStripes;
+        return index;
+    }
+
+    std::array<Stripe, kStripes> stripes_;
+};
+
+// ========== HyperLogLog ==========
+// Estimates the number of distinct elements in a set using 16384 registers
+// (standard error ~0.81%). An HLL lives in an ordinary string value, so it
+// goes through get/set/save/load like any other value.
+//
+//   sparse: "HLLS" + sorted 4-char entries (3 base-32 digits of register
+//           index, 1 char of register value). Used while few registers are set.
+//   dense:  "HLLD" + one char per register. Registers are stored unpacked
+//           (one byte each) so merge is a plain byte-wise max and counting
+//           is a linear scan; both loops auto-vectorize.
+//
+// All register chars are offset by '#' so they stay printable and never need
+// escaping in the save file.
+class HyperLogLog {
+public:
+    static constexpr int kPrecision = 14;
+    static constexpr size_t kRegisters = size_t(1) << kPrecision;
+    static constexpr int kMaxRank = 64 - kPrecision + 1;
+    static constexpr size_t kHeaderSize = 4;
+    static constexpr size_t kSparseEntry = 4;
+    // Above this many sparse entries the dense encoding is smaller to scan
+    static constexpr size_t kSparseMaxEntries = 1024;
+
+    static std::string create() { return "HLLS"; }
+
+    // Checks the whole encoding, not just the header: any client can set a
+    // string that starts with "HLLS", and the register and index chars are
+    // used as array indexes
+    static bool is_hll(const std::string& s) {
+        if (s.compare(0, kHeaderSize, "HLLS") == 0) {
+            if ((s.size() - kHeaderSize) % kSparseEntry != 0) return false;
+            size_t previous = 0;
+            for (size_t pos = kHeaderSize; pos < s.size(); pos += kSparseEntry) {
+                for (size_t i = 0; i < 3; ++i) {
+                    if (s[pos + i] < kBase || s[pos + i] > kBase + 31) return false;
+                }
+                const size_t index = decode_index(s, pos);
+                if (index >= kRegisters || (pos > kHeaderSize && index <= previous)) return false;
+                if (s[pos + 3] <= kBase || s[pos + 3] > kBase + kMaxRank) return false;
+                previous = index;
+            }
+            return true;
         }
+        if (s.compare(0, kHeaderSize, "HLLD") != 0 || s.size() != kHeaderSize + kRegisters) return false;
+        return std::all_of(s.begin() + kHeaderSize, s.end(), [](char c) { return c >= kBase && c <= kBase + kMaxRank; });
+    }
 
-        ofs << "{\n";
-        size_t count = 0;
-        for (auto it = store_.begin(); it != store_.end(); ++it, ++count) {
-            ofs << "  \"" << escape(it->first) << "\": \"" << escape(it->second) << "\"";
-            if (std::next(it) != store_.end()) ofs << ",";
-            ofs << "\n";
+    static bool is_dense(const std::string& s) { return s.compare(0, kHeaderSize, "HLLD") == 0; }
+
+    // Adds one element; returns true if any register changed
+    static bool add(std::string& hll, const std::string& element) {
+        uint64_t h = hash64(element);
+        size_t index = h & (kRegisters - 1);
+        uint64_t w = h >> kPrecision;
+        int rank = 1;
+        while (rank < kMaxRank && (w & 1) == 0) {
+            ++rank;
+            w >>= 1;
         }
-        ofs << "}\n";
+        return is_dense(hll) ? set_dense(hll, index, rank) : set_sparse(hll, index, rank);
+    }
 
-        Logger::info("Data saved to " + filename);
+    static uint64_t count(const std::string& hll) {
+        std::vector<uint32_t> histogram(kMaxRank + 1, 0);
+        if (is_dense(hll)) {
+            const char* regs = hll.data() + kHeaderSize;
+            for (size_t i = 0; i < kRegisters; ++i) ++histogram[regs[i] - kBase];
+        } else {
+            size_t entries = (hll.size() - kHeaderSize) / kSparseEntry;
+            histogram[0] = static_cast<uint32_t>(kRegisters - entries);
+            for (size_t e = 0; e < entries; ++e) {
+                ++histogram[hll[kHeaderSize + e * kSparseEntry + 3] - kBase];
+            }
+        }
+        return estimate(histogram);
     }
 
-    void load_from_file(const std::string& filename) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        std::ifstream ifs(filename);
-        if (!ifs) {
-            Logger::error("Could not open file: " + filename);
+    // Converts any encoding to dense
+    static std::string to_dense(const std::string& hll) {
+        if (is_dense(hll)) return hll;
+        std::string dense = "HLLD" + std::string(kRegisters, kBase);
+        size_t entries = (hll.size() - kHeaderSize) / kSparseEntry;
+        for (size_t e = 0; e < entries; ++e) {
+            size_t pos = kHeaderSize + e * kSparseEntry;
+            dense[kHeaderSize + decode_index(hll, pos)] = hll[pos + 3];
+        }
+        return dense;
+    }
+
+    // dest must be dense; takes the register-wise max with src
+    static void merge_into(std::string& dest, const std::string& src) {
+        if (!is_dense(src)) {
+            std::string dense = to_dense(src);
+            merge_into(dest, dense);
             return;
         }
+        char* d = &dest[kHeaderSize];
+        const char* s = src.data() + kHeaderSize;
+        for (size_t i = 0; i < kRegisters; ++i) d[i] = std::max(d[i], s[i]);
+    }
+
+private:
+    static constexpr char kBase = '#';
+
+    static size_t decode_index(const std::string& s, size_t pos) {
+        return (size_t(s[pos] - kBase) << 10) | (size_t(s[pos + 1] - kBase) << 5) | size_t(s[pos + 2] - kBase);
+    }
 
-        store_.clear(); // Optional
+    static bool set_dense(std::string& hll, size_t index, int rank) {
+        char& reg = hll[kHeaderSize + index];
+        if (reg - kBase >= rank) return false;
+        reg = static_cast<char>(kBase + rank);
+        return true;
+    }
 
-        std::string line;
-        while (std::getline(ifs, line)) {
-            line = trim(line);
-            if (line.empty() || line == "{" || line == "}") continue;
+    static bool set_sparse(std::string& hll, size_t index, int rank) {
+        // Binary search over the fixed-width, index-sorted entries
+        size_t lo = 0, hi = (hll.size() - kHeaderSize) / kSparseEntry;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (decode_index(hll, kHeaderSize + mid * kSparseEntry) < index) lo = mid + 1;
+            else hi = mid;
+        }
+        size_t pos = kHeaderSize + lo * kSparseEntry;
+        if (pos < hll.size() && decode_index(hll, pos) == index) {
+            if (hll[pos + 3] - kBase >= rank) return false;
+            hll[pos + 3] = static_cast<char>(kBase + rank);
+            return true;
+        }
+        char entry[kSparseEntry] = {
+            static_cast<char>(kBase + ((index >> 10) & 31)),
+            static_cast<char>(kBase + ((index >> 5) & 31)),
+            static_cast<char>(kBase + (index & 31)),
+            static_cast<char>(kBase + rank),
+        };
+        hll.insert(pos, entry, kSparseEntry);
+        if ((hll.size() - kHeaderSize) / kSparseEntry > kSparseMaxEntries) hll = to_dense(hll);
+        return true;
+    }
 
-            auto colon = line.find(':');
-            if (colon == std::string::npos) continue;
+    static uint64_t estimate(const std::vector<uint32_t>& histogram) {
+        const double m = static_cast<double>(kRegisters);
+        double sum = 0.0;
+        for (int r = 0; r <= kMaxRank; ++r) sum += histogram[r] * std::ldexp(1.0, -r);
+        double alpha = 0.7213 / (1.0 + 1.079 / m);
+        double e = alpha * m * m / sum;
+        // Small-range correction: linear counting while registers are empty
+        if (e <= 2.5 * m && histogram[0] > 0) e = m * std::log(m / histogram[0]);
+        return static_cast<uint64_t>(e + 0.5);
+    }
+};
 
-            std::string key = trim(line.substr(0, colon));
-            std::string value = trim(line.substr(colon + 1));
+// ========== Bloom Filter ==========
+// Scalable Bloom filter (Almeida et al.): a chain of layers where each new
+// layer has twice the capacity and half the false-positive rate of the
+// previous one, so the total error stays under ~2x the initial rate no
+// matter how many items are added. Stored as a printable string:
+//
+//   "SBF1" + layers, each: 10-digit capacity, 10-digit count, 2-digit hash
+//   count, 10-digit bit count, then the bits at 4 per char ('@' + nibble).
+class ScalableBloomFilter {
+public:
+    static constexpr size_t kInitialCapacity = 1024;
+    static constexpr double kErrorRate = 0.01;
+    static constexpr double kTightening = 0.5;
 
-            // Remove surrounding quotes and optional comma
-            if (!key.empty() && key.front() == '"') key = key.substr(1);
-            if (!key.empty() && key.back() == '"') key.pop_back();
-            if (!value.empty() && value.front() == '"') value = value.substr(1);
-            if (!value.empty() && value.back() == ',') value.pop_back();
-            if (!value.empty() && value.back() == '"') value.pop_back();
+    static std::string create() {
+        std::string s = "SBF1";
+        append_layer(s, kInitialCapacity, kErrorRate);
+        return s;
+    }
 
-            store_[key] = value;
+    // Checks every layer header and that its bits are all present: values
+    // come from clients and snapshot files, and the header numbers are used
+    // as divisors, offsets and growth sizes
+    static bool is_bloom(const std::string& s) {
+        if (s.compare(0, 4, "SBF1") != 0 || s.size() == 4) return false;
+        size_t layers = 0;
+        for (size_t pos = 4; pos < s.size(); ++layers) {
+            if (layers == kMaxLayers || s.size() - pos < kLayerHeader) return false;
+            for (size_t i = 0; i < kLayerHeader; ++i) {
+                if (!std::isdigit(static_cast<unsigned char>(s[pos + i]))) return false;
+            }
+            Layer layer = read_layer(s, pos);
+            // A layer always has more bits than capacity, which bounds the
+            // next layer add() creates by the size of this one
+            if (layer.capacity == 0 || layer.count > layer.capacity || layer.hashes == 0 || layer.bits < layer.capacity) {
+                return false;
+            }
+            if (s.size() - layer.bits_pos < layer.bit_chars()) return false;
+            pos = layer.bits_pos + layer.bit_chars();
+            for (size_t i = layer.bits_pos; i < pos; ++i) {
+                if (s[i] < '@' || s[i] > '@' + 15) return false;
+            }
         }
+        return true;
+    }
 
-        Logger::info("Data loaded from " + filename);
+    static bool contains(const std::string& bf, const std::string& item) {
+        uint64_t h1 = hash64(item), h2 = hash64(item, 0x9e3779b97f4a7c15ULL) | 1;
+        for (size_t pos = 4; pos < bf.size();) {
+            Layer layer = read_layer(bf, pos);
+            if (test_layer(bf, layer, h1, h2)) return true;
+            pos = layer.bits_pos + layer.bit_chars();
+        }
+        return false;
+    }
+
+    // Returns true if the item was newly added, false if it (probably) was present
+    static bool add(std::string& bf, const std::string& item) {
+        if (contains(bf, item)) return false;
+        uint64_t h1 = hash64(item), h2 = hash64(item, 0x9e3779b97f4a7c15ULL) | 1;
+
+        size_t pos = 4, layer_start = 4, index = 0;
+        Layer layer{};
+        while (pos < bf.size()) {
+            layer_start = pos;
+            layer = read_layer(bf, pos);
+            pos = layer.bits_pos + layer.bit_chars();
+            ++index;
+        }
+        if (layer.count >= layer.capacity) {
+            layer_start = bf.size();
+            append_layer(bf, layer.capacity * 2, kErrorRate * std::pow(kTightening, double(index)));
+            pos = layer_start;
+            layer = read_layer(bf, pos);
+        }
+        for (uint32_t i = 0; i < layer.hashes; ++i) {
+            uint64_t bit = (h1 + i * h2) % layer.bits;
+            char& c = bf[layer.bits_pos + bit / 4];
+            c = static_cast<char>('@' + ((c - '@') | (1 << (bit % 4))));
+        }
+        write_number(bf, layer_start + 10, 10, layer.count + 1);
+        return true;
+    }
+
+    // Total number of items added across all layers
+    static uint64_t size(const std::string& bf) {
+        uint64_t total = 0;
+        for (size_t pos = 4; pos < bf.size();) {
+            Layer layer = read_layer(bf, pos);
+            total += layer.count;
+            pos = layer.bits_pos + layer.bit_chars();
+        }
+        return total;
     }
 
 private:
-    mutable std::mutex mutex_;
-    std::unordered_map<std::string, std::string> store_;
+    static constexpr size_t kLayerHeader = 32;
+    // Far more than doubling from kInitialCapacity can reach, and few enough
+    // that the tightened error rate keeps the hash count to two digits
+    static constexpr size_t kMaxLayers = 40;
+
+    struct Layer {
+        uint64_t capacity;
+        uint64_t count;
+        uint32_t hashes;
+        uint64_t bits;
+        size_t bits_pos;
+        size_t bit_chars() const { return static_cast<size_t>((bits + 3) / 4); }
+    };
+
+    static void append_layer(std::string& s, uint64_t capacity, double error) {
+        const double ln2 = std::log(2.0);
+        uint64_t bits = static_cast<uint64_t>(std::ceil(-double(capacity) * std::log(error) / (ln2 * ln2)));
+        uint32_t hashes = static_cast<uint32_t>(std::ceil(ln2 * double(bits) / double(capacity)));
+        size_t start = s.size();
+        s.append(kLayerHeader, '0');
+        write_number(s, start, 10, capacity);
+        write_number(s, start + 10, 10, 0);
+        write_number(s, start + 20, 2, hashes);
+        write_number(s, start + 22, 10, bits);
+        s.append(static_cast<size_t>((bits + 3) / 4), '@');
+    }
+
+    static Layer read_layer(const std::string& s, size_t pos) {
+        Layer layer;
+        layer.capacity = read_number(s, pos, 10);
+        layer.count = read_number(s, pos + 10, 10);
+        layer.hashes = static_cast<uint32_t>(read_number(s, pos + 20, 2));
+        layer.bits = read_number(s, pos + 22, 10);
+        layer.bits_pos = pos + kLayerHeader;
+        return layer;
+    }
+
+    static bool test_layer(const std::string& bf, const Layer& layer, uint64_t h1, uint64_t h2) {
+        for (uint32_t i = 0; i < layer.hashes; ++i) {
+            uint64_t bit = (h1 + i * h2) % layer.bits;
+            if (((bf[layer.bits_pos + bit / 4] - '@') & (1 << (bit % 4))) == 0) return false;
+        }
+        return true;
+    }
+
+    static uint64_t read_number(const std::string& s, size_t pos, size_t width) {
+        uint64_t n = 0;
+        for (size_t i = 0; i < width; ++i) n = n * 10 + uint64_t(s[pos + i] - '0');
+        return n;
+    }
+
+    static void write_number(std::string& s, size_t pos, size_t width, uint64_t n) {
+        for (size_t i = width; i-- > 0;) {
+            s[pos + i] = static_cast<char>('0' + n % 10);
+            n /= 10;
+        }
+    }
 };
 
 
-// ========== CLI ==========
-// Runs interactive prompt and handles commands
-void run_cli(KeyValueStore& kv) {
-    std::string input;
-    while (true) {
-        std::cout << ">> ";
-        std::getline(std::cin, input);
-        std::istringstream iss(input);
-        std::string cmd, key, value;
-
-        iss >> cmd;
-        if (cmd == "exit") break;
-
-        if (cmd == "set") {
-            iss >> key;
-            std::getline(iss, value);
-            value = trim(value);
-            if (key.empty() || value.empty()) {
-                Logger::error("Usage: set <key> <value>");
-                continue;
-            }
-            kv.set(key, value);
-        } else if (cmd == "get") {
-            iss >> key;
-            if (auto val = kv.get(key)) {
-                std::cout << key << " = " << *val << "\n";
-            } else {
-                std::cout << "Key not found\n";
-            }
-        } else if (cmd == "remove") {
-            iss >> key;
-            kv.remove(key);
-        } else if (cmd == "list") {
-            kv.print_all();
-        } else if (cmd == "clear") {
-            kv.clear();
-        } else if (cmd == "save") {
-            iss >> key;
-            kv.save_to_file(key);
-        } else if (cmd == "load") {
-            iss >> key;
-            kv.load_from_file(key);
+// ========== JSON ==========
+// Parses a JSON string starting at the opening quote s[i]; on success
+// appends the unescaped text to out and leaves i after the closing quote.
+bool parse_json_string(const std::string& s, size_t& i, std::string& out) {
+    ++i; // opening quote
+    while (i < s.size() && s[i] != '"') {
+        if (s[i] == '\\' && i + 1 < s.size()) {
+            char c = s[++i];
+            out += c == 'n' ? '\n' : c == 't' ? '\t' : c == 'r' ? '\r' : c;
         } else {
-            Logger::error("Unknown command: " + cmd);
-            std::cout << "Available commands: set, get, remove, list, clear, save <file>, load <file>, exit\n";
+            out += s[i];
         }
+        ++i;
     }
+    if (i >= s.size()) return false;
+    ++i; // closing quote
+    return true;
 }
 
-// ========== Tests ==========
-void run_tests() {
-    KeyValueStore kv;
-    kv.set("username", "abhishek");
-    kv.set("lang", "C++17");
-    assert(kv.get("username").value() == "abhishek");
-    assert(kv.exists("lang"));
-    kv.remove("lang");
-    assert(!kv.exists("lang"));
-    kv.clear();
-    assert(!kv.exists("username"));
-    Logger::info("All tests passed");
+// Returns the value of a top-level field of a JSON object, or nullopt if the
+// text is not an object or has no such field. String values are unescaped;
+// numbers, booleans, null, and nested objects/arrays are returned as raw text.
+std::optional<std::string> json_field(const std::string& json, const std::string& field) {
+    size_t i = 0;
+    auto skip_ws = [&] { while (i < json.size() && std::isspace(static_cast<unsigned char>(json[i]))) ++i; };
+    auto parse_string = [&](std::string& out) { return parse_json_string(json, i, out); };
+
+    skip_ws();
+    if (i >= json.size() || json[i] != '{') return std::nullopt;
+    ++i;
+    while (true) {
+        skip_ws();
+        if (i >= json.size() || json[i] != '"') return std::nullopt;
+        std::string name;
+        if (!parse_string(name)) return std::nullopt;
+        skip_ws();
+        if (i >= json.size() || json[i] != ':') return std::nullopt;
+        ++i;
+        skip_ws();
+        if (i >= json.size()) return std::nullopt;
+
+        std::string value;
+        if (json[i] == '"') {
+            if (!parse_string(value)) return std::nullopt;
+        } else {
+            // Scalar or nested container: scan to the next top-level ',' or '}'
+            size_t start = i;
+            int depth = 0;
+            bool in_string = false;
+            for (; i < json.size(); ++i) {
+                char c = json[i];
+                if (in_string) {
+                    if (c == '\\') ++i;
+                    else if (c == '"') in_string = false;
+                } else if (c == '"') {
+                    in_string = true;
+                } else if (c == '{' || c == '[') {
+                    ++depth;
+                } else if (c == '}' || c == ']') {
+                    if (depth == 0) break;
+                    --depth;
+                } else if (c == ',' && depth == 0) {
+                    break;
+                }
+            }
+            value = trim(json.substr(start, i - start));
+        }
+        if (name == field) return value;
+
+        skip_ws();
+        if (i < json.size() && json[i] == ',') {
+            ++i;
+            continue;
+        }
+        return std::nullopt;
+    }
 }
 
-// ========== Main ==========
-int main() {
-    Logger::info("Running self-tests...");
-    run_tests();
+// ========== Value ==========
+// A stored value. Values under kRopeThreshold live inline in one string.
+// Larger ones are kept as a rope: a list of immutable, reference-counted
+// chunks. Appends add chunks, range reads binary-search the chunk offsets,
+// and readers can take the chunk list itself (a zero-copy scatter list), so
+// none of these copy the whole value.
+using Chunk = std::shared_ptr<const std::string>;
 
-    Logger::info("Welcome to the Key-Value CLI Store");
-    Logger::info("Type 'exit' to quit");
+class Value {
+public:
+    static constexpr size_t kRopeThreshold = 1 << 20;
+    static constexpr size_t kChunkSize = 64 * 1024;
+
+    Value() = default;
+    Value(std::string s) {
+        if (s.size() >= kRopeThreshold) push_chunk(std::make_shared<const std::string>(std::move(s)));
+        else inline_ = std::move(s);
+    }
+    Value(const char* s) : Value(std::string(s)) {}
+
+    static Value from_chunks(const std::vector<Chunk>& chunks) {
+        Value v;
+        size_t total = 0;
+        for (const auto& c : chunks) total += c->size();
+        if (total < kRopeThreshold) {
+            v.inline_.reserve(total);
+            for (const auto& c : chunks) v.inline_ += *c;
+        } else {
+            for (const auto& c : chunks) {
+                if (!c->empty()) v.push_chunk(c);
+            }
+        }
+        return v;
+    }
+
+    size_t size() const { return chunks_.empty() ? inline_.size() : ends_.back(); }
+    bool is_rope() const { return !chunks_.empty(); }
+
+    // Last-access tick, maintained by the owning store for LRU eviction
+    mutable uint64_t last_access = 0;
+
+    // The inline string, or nullptr for ropes. Typed values (HLL, Bloom)
+    // are always inline and are updated in place through this.
+    std::string* inline_string() { return is_rope() ? nullptr : &inline_; }
+    const std::string* inline_string() const { return is_rope() ? nullptr : &inline_; }
+
+    // Full copy of the value
+    std::string str() const {
+        if (!is_rope()) return inline_;
+        std::string out;
+        out.reserve(size());
+        for (const auto& c : chunks_) out += *c;
+        return out;
+    }
+
+    // Bytes [start, start + len), clamped to the value
+    std::string range(size_t start, size_t len) const {
+        size_t total = size();
+        if (start >= total) return "";
+        len = std::min(len, total - start);
+        if (!is_rope()) return inline_.substr(start, len);
+
+        std::string out;
+        out.reserve(len);
+        size_t i = std::upper_bound(ends_.begin(), ends_.end(), start) - ends_.begin();
+        while (out.size() < len) {
+            size_t chunk_start = i == 0 ? 0 : ends_[i - 1];
+            size_t offset = start + out.size() - chunk_start;
+            out.append(*chunks_[i], offset, std::min(chunks_[i]->size() - offset, len - out.size()));
+            ++i;
+        }
+        return out;
+    }
+
+    // Scatter list of the value's bytes. Shares the rope's chunks; inline
+    // values (always small) are copied into a single chunk.
+    std::vector<Chunk> chunks() const {
+        if (is_rope()) return chunks_;
+        if (inline_.empty()) return {};
+        return {std::make_shared<const std::string>(inline_)};
+    }
+
+    void append(const std::string& data) {
+        if (data.empty()) return;
+        if (!is_rope()) {
+            if (inline_.size() + data.size() < kRopeThreshold) {
+                inline_ += data;
+                return;
+            }
+            if (!inline_.empty()) push_chunk(std::make_shared<const std::string>(std::move(inline_)));
+            inline_.clear();
+        }
+        // Top up a small tail chunk rather than adding many tiny ones; this
+        // copies at most kChunkSize bytes
+        if (!chunks_.empty() && chunks_.back()->size() + data.size() <= kChunkSize) {
+            auto merged = std::make_shared<std::string>(*chunks_.back());
+            merged->append(data);
+            chunks_.back() = std::move(merged);
+            ends_.back() += data.size();
+            return;
+        }
+        push_chunk(std::make_shared<const std::string>(data));
+    }
+
+private:
+    void push_chunk(Chunk c) {
+        size_t end = (ends_.empty() ? 0 : ends_.back()) + c->size();
+        chunks_.push_back(std::move(c));
+        ends_.push_back(end);
+    }
+
+    std::string inline_;
+    std::vector<Chunk> chunks_;
+    std::vector<size_t> ends_; // cumulative end offset of each chunk
+};
+
+// ========== Streaming ==========
+// Builds a value from a sequence of writes without holding the store lock
+// and installs it atomically on commit(); until then readers see the old
+// value. Small writes are coalesced into kChunkSize chunks, large writes
+// become chunks as-is.
+class KeyValueStore;
+
+class ValueWriter {
+public:
+    ValueWriter(KeyValueStore& kv, std::string key) : kv_(&kv), key_(std::move(key)) {}
+
+    void write(std::string data) {
+        if (pending_.empty() && data.size() >= Value::kChunkSize) {
+            chunks_.push_back(std::make_shared<const std::string>(std::move(data)));
+            return;
+        }
+        pending_ += data;
+        if (pending_.size() >= Value::kChunkSize) flush();
+    }
 
-    KeyValueStore store;
-    run_cli(store);
+    // Installs the written bytes as the key's value; returns false if the
+    // writer was already committed or aborted, or the store refused the write
+    bool commit();
+
+    void abort() {
+        chunks_.clear();
+        pending_.clear();
+        kv_ = nullptr;
+    }
+
+    size_t bytes_written() const {
+        size_t total = pending_.size();
+        for (const auto& c : chunks_) total += c->size();
+        return total;
+    }
+
+private:
+    void flush() {
+        if (pending_.empty()) return;
+        chunks_.push_back(std::make_shared<const std::string>(std::move(pending_)));
+        pending_.clear();
+    }
+
+    KeyValueStore* kv_;
+    std::string key_;
+    std::vector<Chunk> chunks_;
+    std::string pending_;
+};
+
+// Reads a value snapshot chunk by chunk. The chunks are shared with the
+// store, so later writes to the key do not affect an open reader.
+class ValueReader {
+public:
+    explicit ValueReader(std::vector<Chunk> chunks) : chunks_(std::move(chunks)) {}
+
+    // Zero-copy view of the whole value
+    const std::vector<Chunk>& chunks() const { return chunks_; }
+
+    size_t size() const {
+        size_t total = 0;
+        for (const auto& c : chunks_) total += c->size();
+        return total;
+    }
+
+    // Returns up to max_bytes of the next bytes; empty at the end
+    std::string read(size_t max_bytes) {
+        std::string out;
+        while (out.size() < max_bytes && index_ < chunks_.size()) {
+            const std::string& c = *chunks_[index_];
+            size_t take = std::min(c.size() - offset_, max_bytes - out.size());
+            out.append(c, offset_, take);
+            offset_ += take;
+            if (offset_ == c.size()) {
+                ++index_;
+                offset_ = 0;
+            }
+        }
+        return out;
+    }
+
+private:
+    std::vector<Chunk> chunks_;
+    size_t index_ = 0;
+    size_t offset_ = 0;
+};
+
+// ========== Snapshot format ==========
+// Binary-safe, length-prefixed:
+//   KVSTORE 1\n
+//   <key length> <value length>\n<key bytes><value bytes>\n     (per entry)
+// Keys and values are written raw, so any byte sequence round-trips.
+const std::string kSnapshotMagic = "KVSTORE 1\n";
+
+// Writes filename through write(os) into a temporary file that is then
+// renamed into place, so a crash never leaves a half-written file and a
+// mapped table image being replaced stays intact
+bool write_file_atomically(const std::string& filename, const std::function<void(std::ostream&)>& write) {
+    const std::string tmp = filename + ".tmp";
+    std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+    if (!ofs) {
+        Logger::error("Could not open file for writing: " + tmp);
+        return false;
+    }
+    write(ofs);
+    ofs.close();
+    if (!ofs || std::rename(tmp.c_str(), filename.c_str()) != 0) {
+        Logger::error("Could not write file: " + filename);
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+void write_record(std::ostream& os, const std::string& key, const std::string& value) {
+    os << key.size() << ' ' << value.size() << '\n';
+    os.write(key.data(), static_cast<std::streamsize>(key.size()));
+    os.write(value.data(), static_cast<std::streamsize>(value.size()));
+    os << '\n';
+}
+
+void write_record(std::ostream& os, const std::string& key, const Value& value) {
+    os << key.size() << ' ' << value.size() << '\n';
+    os.write(key.data(), static_cast<std::streamsize>(key.size()));
+    if (const std::string* s = value.inline_string()) {
+        os.write(s->data(), static_cast<std::streamsize>(s->size()));
+    } else {
+        for (const auto& c : value.chunks()) os.write(c->data(), static_cast<std::streamsize>(c->size()));
+    }
+    os << '\n';
+}
+
+// Reads "<n> <m>\n" at pos; false if malformed
+bool read_lengths(const std::string& data, size_t& pos, size_t& first, size_t& second) {
+    size_t eol = data.find('\n', pos);
+    if (eol == std::string::npos) return false;
+    std::istringstream header(data.substr(pos, eol - pos));
+    if (!(header >> first >> second)) return false;
+    pos = eol + 1;
+    return true;
+}
+
+// Reads one record at pos into key/value; false if malformed or truncated
+bool read_record(const std::string& data, size_t& pos, std::string& key, std::string& value) {
+    size_t key_len, value_len;
+    if (!read_lengths(data, pos, key_len, value_len)) return false;
+    if (key_len > data.size() - pos || value_len > data.size() - pos - key_len) return false;
+    key.assign(data, pos, key_len);
+    value.assign(data, pos + key_len, value_len);
+    pos += key_len + value_len;
+    if (pos >= data.size() || data[pos] != '\n') return false;
+    ++pos;
+    return true;
+}
+
+// Files holding several namespaces start with kNamespacedSnapshotMagic and
+// contain, per namespace, "ns <name length> <entry count>\n<name>\n"
+// followed by that many entries in the format above.
+const std::string kNamespacedSnapshotMagic = "KVSTORE 2\n";
+
+bool parse_namespaced_snapshot(const std::string& data,
+                               std::map<std::string, std::unordered_map<std::string, Value>>& out) {
+    size_t pos = kNamespacedSnapshotMagic.size();
+    std::string key, value;
+    while (pos < data.size()) {
+        if (data.compare(pos, 3, "ns ") != 0) return false;
+        pos += 3;
+        size_t name_len, count;
+        if (!read_lengths(data, pos, name_len, count)) return false;
+        if (name_len >= data.size() - pos || data[pos + name_len] != '\n') return false;
+        auto& entries = out[data.substr(pos, name_len)];
+        pos += name_len + 1;
+        for (size_t i = 0; i < count; ++i) {
+            if (!read_record(data, pos, key, value)) return false;
+            entries[key] = std::move(value);
+        }
+    }
+    return true;
+}
+
+bool parse_snapshot(const std::string& data, std::unordered_map<std::string, Value>& out) {
+    size_t pos = kSnapshotMagic.size();
+    std::string key, value;
+    while (pos < data.size()) {
+        if (!read_record(data, pos, key, value)) return false;
+        out[key] = std::move(value);
+    }
+    return true;
+}
+
+// Reads the older one-entry-per-line JSON format ({"key": "value", ...})
+bool parse_legacy_json(const std::string& data, std::unordered_map<std::string, Value>& out) {
+    std::istringstream lines(data);
+    std::string line;
+    while (std::getline(lines, line)) {
+        line = trim(line);
+        if (line.empty() || line == "{" || line == "}") continue;
+
+        size_t i = 0;
+        std::string key, value;
+        if (line[0] != '"' || !parse_json_string(line, i, key)) return false;
+        while (i < line.size() && line[i] == ' ') ++i;
+        if (i >= line.size() || line[i] != ':') return false;
+        ++i;
+        while (i < line.size() && line[i] == ' ') ++i;
+        if (i < line.size() && line[i] == '"') {
+            if (!parse_json_string(line, i, value)) return false;
+        } else {
+            value = line.substr(i);
+            if (!value.empty() && value.back() == ',') value.pop_back();
+        }
+        out[key] = value;
+    }
+    return true;
+}
+
+// ========== Table images ==========
+// A table image is a hash table laid out in a file so it can be mapped and
+// queried in place. Records are linked by offsets rather than pointers, so
+// the file works wherever it is mapped; opening one costs a validation pass
+// over the file (i.e. page-in) instead of re-inserting every key.
+//   header   ImageHeader
+//   buckets  uint64_t[bucket_count]: offset + 1 of the bucket's first record, 0 = empty
+//   arena    per record: ImageRecord, key bytes, value bytes, zero padding to 8 bytes
+// Everything is in host byte order; byte_order rejects images from hosts
+// that differ.
+
+struct ImageHeader {
+    char magic[8];
+    uint64_t byte_order;
+    uint64_t bucket_count; // a power of two
+    uint64_t entries;
+    uint64_t arena_bytes;
+    uint64_t payload_bytes; // sum of key and value sizes
+    uint64_t checksum;      // of buckets and arena
+};
+
+struct ImageRecord {
+    uint64_t next; // offset + 1 of the next record in the bucket (always an earlier one), 0 = end
+    uint64_t hash; // hash64 of the key
+    uint64_t key_size;
+    uint64_t value_size;
+};
+
+constexpr char kImageMagic[8] = {'K', 'V', 'I', 'M', 'A', 'G', 'E', '1'};
+constexpr uint64_t kImageByteOrder = 0x0102030405060708ULL;
+
+// Word-at-a-time checksum that can be fed pieces of any size
+class ImageChecksum {
+public:
+    void update(const char* data, size_t size) {
+        while (size > 0 && pending_size_ > 0) {
+            pending_[pending_size_++] = *data++;
+            --size;
+            if (pending_size_ == 8) mix_pending();
+        }
+        for (; size >= 8; data += 8, size -= 8) {
+            uint64_t word;
+            std::memcpy(&word, data, 8);
+            mix(word);
+        }
+        while (size > 0) {
+            pending_[pending_size_++] = *data++;
+            --size;
+        }
+    }
+
+    uint64_t value() const {
+        ImageChecksum copy = *this;
+        if (copy.pending_size_ > 0) {
+            std::memset(copy.pending_ + copy.pending_size_, 0, 8 - copy.pending_size_);
+            copy.mix_pending();
+        }
+        return copy.hash_;
+    }
+
+private:
+    void mix(uint64_t word) {
+        hash_ = (hash_ ^ (word * 0x9E3779B97F4A7C15ULL)) * 0xBF58476D1CE4E5B9ULL;
+        hash_ ^= hash_ >> 29;
+    }
+
+    void mix_pending() {
+        uint64_t word;
+        std::memcpy(&word, pending_, 8);
+        mix(word);
+        pending_size_ = 0;
+    }
+
+    uint64_t hash_ = 0x243F6A8885A308D3ULL;
+    char pending_[8] = {};
+    size_t pending_size_ = 0;
+};
+
+// Read-only view of a whole file: mapped where mmap is available, read
+// into memory otherwise
+class MappedFile {
+public:
+    static std::unique_ptr<MappedFile> open(const std::string& path) {
+        std::unique_ptr<MappedFile> file(new MappedFile());
+#ifdef __linux__
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return nullptr;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return nullptr;
+        }
+        file->size_ = static_cast<size_t>(st.st_size);
+        if (file->size_ > 0) {
+            void* p = mmap(nullptr, file->size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                return nullptr;
+            }
+            file->data_ = static_cast<const char*>(p);
+            file->mapped_ = true;
+        }
+        ::close(fd); // the mapping keeps the file alive
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in) return nullptr;
+        file->buffer_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        file->data_ = file->buffer_.data();
+        file->size_ = file->buffer_.size();
+#endif
+        return file;
+    }
+
+    ~MappedFile() {
+#ifdef __linux__
+        if (mapped_) munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    MappedFile() = default;
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::string buffer_;
+};
+
+class TableImage {
+public:
+    // Maps and validates an image; nullptr (with an error logged) if the
+    // file is missing, damaged or from a host with another byte order
+    static std::unique_ptr<TableImage> open(const std::string& path) {
+        auto file = MappedFile::open(path);
+        if (!file) {
+            Logger::error("Could not open image: " + path);
+            return nullptr;
+        }
+        std::unique_ptr<TableImage> image(new TableImage(std::move(file)));
+        if (!image->validate()) {
+            Logger::error("Corrupt or incompatible image: " + path);
+            return nullptr;
+        }
+        return image;
+    }
+
+    // Writes entries as an image. for_each(fn) must call fn(key, value) for
+    // the same `entries` entries in the same order each time; it is called
+    // twice. The file is replaced atomically, so an image that is currently
+    // mapped can be overwritten safely.
+    template <typename ForEach>
+    static bool write(const std::string& path, size_t entries, ForEach&& for_each) {
+        uint64_t bucket_count = 1;
+        while (bucket_count < entries) bucket_count <<= 1;
+
+        // Pass 1: place records and chain them into buckets
+        std::vector<uint64_t> buckets(bucket_count, 0);
+        std::vector<uint64_t> next;
+        next.reserve(entries);
+        uint64_t arena_bytes = 0, payload_bytes = 0;
+        for_each([&](const std::string& key, const Value& value) {
+            uint64_t& head = buckets[hash64(key) & (bucket_count - 1)];
+            next.push_back(head);
+            head = arena_bytes + 1;
+            arena_bytes += record_bytes(key.size(), value.size());
+            payload_bytes += key.size() + value.size();
+        });
+        if (next.size() != entries) return false;
+
+        return write_file_atomically(path, [&](std::ostream& out) {
+            ImageHeader header{};
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header)); // rewritten at the end
+            ImageChecksum checksum;
+            auto emit = [&](const char* data, size_t size) {
+                checksum.update(data, size);
+                out.write(data, static_cast<std::streamsize>(size));
+            };
+            emit(reinterpret_cast<const char*>(buckets.data()), buckets.size() * sizeof(uint64_t));
+
+            // Pass 2: the records themselves, large values chunk by chunk
+            size_t i = 0;
+            static const char zeros[8] = {};
+            for_each([&](const std::string& key, const Value& value) {
+                ImageRecord record{next[i++], hash64(key), key.size(), value.size()};
+                emit(reinterpret_cast<const char*>(&record), sizeof(record));
+                emit(key.data(), key.size());
+                if (const std::string* s = value.inline_string()) emit(s->data(), s->size());
+                else for (const auto& chunk : value.chunks()) emit(chunk->data(), chunk->size());
+                size_t unpadded = sizeof(record) + key.size() + value.size();
+                emit(zeros, record_bytes(key.size(), value.size()) - unpadded);
+            });
+
+            std::memcpy(header.magic, kImageMagic, sizeof(header.magic));
+            header.byte_order = kImageByteOrder;
+            header.bucket_count = bucket_count;
+            header.entries = entries;
+            header.arena_bytes = arena_bytes;
+            header.payload_bytes = payload_bytes;
+            header.checksum = checksum.value();
+            out.seekp(0);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        });
+    }
+
+    std::optional<std::string_view> find(const std::string& key) const {
+        const uint64_t h = hash64(key);
+        for (uint64_t link = bucket(h & (header_.bucket_count - 1)); link != 0;) {
+            ImageRecord record = record_at(link - 1);
+            const char* bytes = arena_ + link - 1 + sizeof(ImageRecord);
+            if (record.hash == h && record.key_size == key.size() && std::memcmp(bytes, key.data(), key.size()) == 0) {
+                return std::string_view(bytes + record.key_size, record.value_size);
+            }
+            link = record.next;
+        }
+        return std::nullopt;
+    }
+
+    // Calls fn(key, value) with views into the image, in file order
+    template <typename F>
+    void for_each(F&& fn) const {
+        for_each_from(0, SIZE_MAX, fn);
+    }
+
+    // Same walk in steps: visits at most limit records from offset (0 = the
+    // first) and returns the offset to go on from, end_offset() once done
+    template <typename F>
+    uint64_t for_each_from(uint64_t offset, size_t limit, F&& fn) const {
+        for (; offset < header_.arena_bytes && limit > 0; --limit) {
+            ImageRecord record = record_at(offset);
+            const char* bytes = arena_ + offset + sizeof(ImageRecord);
+            fn(std::string_view(bytes, record.key_size), std::string_view(bytes + record.key_size, record.value_size));
+            offset += record_bytes(record.key_size, record.value_size);
+        }
+        return offset;
+    }
+
+    uint64_t end_offset() const { return header_.arena_bytes; }
+
+    size_t size() const { return header_.entries; }
+    uint64_t payload_bytes() const { return header_.payload_bytes; }
+    size_t file_bytes() const { return file_->size(); }
+
+private:
+    explicit TableImage(std::unique_ptr<MappedFile> file) : file_(std::move(file)) {}
+
+    static uint64_t record_bytes(uint64_t key_size, uint64_t value_size) {
+        return (sizeof(ImageRecord) + key_size + value_size + 7) & ~uint64_t{7};
+    }
+
+    uint64_t bucket(uint64_t i) const {
+        uint64_t link;
+        std::memcpy(&link, buckets_ + i * sizeof(uint64_t), sizeof(link));
+        return link;
+    }
+
+    ImageRecord record_at(uint64_t offset) const {
+        ImageRecord record;
+        std::memcpy(&record, arena_ + offset, sizeof(record));
+        return record;
+    }
+
+    // Checks the header, the checksum and that every link lands on the
+    // start of a record, so lookups can trust the file from then on
+    bool validate() {
+        const char* data = file_->data();
+        const size_t size = file_->size();
+        if (size < sizeof(ImageHeader)) return false;
+        std::memcpy(&header_, data, sizeof(header_));
+        if (std::memcmp(header_.magic, kImageMagic, sizeof(kImageMagic)) != 0) return false;
+        if (header_.byte_order != kImageByteOrder) return false;
+        const uint64_t n = header_.bucket_count;
+        if (n == 0 || (n & (n - 1)) != 0 || n > (size - sizeof(ImageHeader)) / sizeof(uint64_t)) return false;
+        buckets_ = data + sizeof(ImageHeader);
+        arena_ = buckets_ + n * sizeof(uint64_t);
+        if (header_.arena_bytes != size - sizeof(ImageHeader) - n * sizeof(uint64_t)) return false;
+
+        ImageChecksum checksum;
+        checksum.update(buckets_, size - sizeof(ImageHeader));
+        if (checksum.value() != header_.checksum) return false;
+
+        std::vector<bool> starts(header_.arena_bytes / 8 + 1, false);
+        auto is_start = [&](uint64_t link) {
+            return link == 0 || (link - 1 < header_.arena_bytes && (link - 1) % 8 == 0 && starts[(link - 1) / 8]);
+        };
+        uint64_t entries = 0, payload = 0;
+        for (uint64_t offset = 0; offset < header_.arena_bytes; ++entries) {
+            if (header_.arena_bytes - offset < sizeof(ImageRecord)) return false;
+            ImageRecord record = record_at(offset);
+            uint64_t room = header_.arena_bytes - offset - sizeof(ImageRecord);
+            if (record.key_size > room || record.value_size > room - record.key_size) return false;
+            if (record.next != 0 && (record.next - 1 >= offset || !is_start(record.next))) return false;
+            starts[offset / 8] = true;
+            payload += record.key_size + record.value_size;
+            offset += record_bytes(record.key_size, record.value_size);
+        }
+        if (entries != header_.entries || payload != header_.payload_bytes) return false;
+        for (uint64_t i = 0; i < n; ++i) {
+            if (!is_start(bucket(i))) return false;
+        }
+        return true;
+    }
+
+    std::unique_ptr<MappedFile> file_;
+    ImageHeader header_{};
+    const char* buckets_ = nullptr;
+    const char* arena_ = nullptr;
+};
+
+// ========== Secondary Index ==========
+// Maps an indexed term to the set of keys whose value produces that term.
+// The term is either the full value (empty field) or a top-level field of a
+// JSON object value; values without that field are simply not indexed.
+class SecondaryIndex {
+public:
+    explicit SecondaryIndex(std::string field) : field_(std::move(field)) {}
+
+    const std::string& field() const { return field_; }
+
+    void insert(const std::string& key, const Value& value) {
+        if (auto term = term_for(value)) postings_[*term].insert(key);
+    }
+
+    void erase(const std::string& key, const Value& value) {
+        auto term = term_for(value);
+        if (!term) return;
+        auto it = postings_.find(*term);
+        if (it == postings_.end()) return;
+        it->second.erase(key);
+        if (it->second.empty()) postings_.erase(it);
+    }
+
+    std::vector<std::string> query(const std::string& term) const {
+        std::vector<std::string> keys;
+        auto it = postings_.find(term);
+        if (it != postings_.end()) keys.assign(it->second.begin(), it->second.end());
+        std::sort(keys.begin(), keys.end());
+        return keys;
+    }
+
+    void clear() { postings_.clear(); }
+
+private:
+    std::optional<std::string> term_for(const Value& value) const {
+        const std::string* text = value.inline_string();
+        std::string flat;
+        if (!text) {
+            flat = value.str();
+            text = &flat;
+        }
+        if (field_.empty()) return *text;
+        return json_field(*text, field_);
+    }
+
+    std::string field_;
+    std::unordered_map<std::string, std::unordered_set<std::string>> postings_;
+};
+
+// ========== Scripting ==========
+// Scripts are small postfix (stack) programs that run atomically against the
+// store. Source is compiled once into bytecode and cached by its hash.
+//
+//   literals:  42  -7  "text"  'text'      $1 $2 ... (script arguments)
+//   store:     key get      -> value or nil       key value set  -> (nothing)
+//              key incr     -> new value          key n incrby   -> new value
+//              key del      -> 1/0                key exists     -> 1/0
+//   math:      + - * / %    (integers)            concat
+//   compare:   == != (bytes)  < > <= >= (integers)  not and or
+//   stack:     dup drop swap over
+//   control:   cond if ... [else ...] then    return    msg error
+//
+// The result is the top of the stack when the script ends. nil, "" and "0"
+// are false. A failed script (error, bad types, or exceeding the
+// instruction budget) undoes all of its writes.
+//
+// Example, move n units from $1 to $2 if the balance allows:
+//   $1 get $3 < if "insufficient funds" error then
+//   $1 0 $3 - incrby drop $2 $3 incrby
+enum class OpCode {
+    Push, Arg, Get, Set, IncrBy, Del, Exists,
+    Add, Sub, Mul, Div, Mod, Concat,
+    Eq, Ne, Lt, Gt, Le, Ge, Not, And, Or,
+    Dup, Drop, Swap, Over,
+    JumpIfFalse, Jump, Return, Error,
+};
+
+struct Instruction {
+    OpCode op;
+    size_t operand = 0;  // jump target or argument index
+    std::string literal; // for Push
+};
+
+struct Script {
+    std::string id; // hex hash of the source
+    std::vector<Instruction> code;
+};
+
+struct ScriptResult {
+    bool ok = true;
+    std::optional<std::string> value; // nullopt means nil
+    std::string error;
+    size_t instructions = 0;
+};
+
+std::string script_id(const std::string& source) {
+    std::ostringstream oss;
+    oss << std::hex << std::setw(16) << std::setfill('0') << hash64(source);
+    return oss.str();
+}
+
+// Compiles source to bytecode; on failure returns nullopt and sets error
+std::optional<Script> compile_script(const std::string& source, std::string& error) {
+    static const std::unordered_map<std::string, OpCode> words = {
+        {"get", OpCode::Get}, {"set", OpCode::Set}, {"incrby", OpCode::IncrBy}, {"del", OpCode::Del},
+        {"exists", OpCode::Exists}, {"+", OpCode::Add}, {"-", OpCode::Sub}, {"*", OpCode::Mul},
+        {"/", OpCode::Div}, {"%", OpCode::Mod}, {"concat", OpCode::Concat}, {"==", OpCode::Eq},
+        {"!=", OpCode::Ne}, {"<", OpCode::Lt}, {">", OpCode::Gt}, {"<=", OpCode::Le}, {">=", OpCode::Ge},
+        {"not", OpCode::Not}, {"and", OpCode::And}, {"or", OpCode::Or}, {"dup", OpCode::Dup},
+        {"drop", OpCode::Drop}, {"swap", OpCode::Swap}, {"over", OpCode::Over},
+        {"return", OpCode::Return}, {"error", OpCode::Error},
+    };
+
+    // Tokenize; quoted tokens are always string literals
+    std::vector<std::pair<std::string, bool>> tokens; // (text, quoted)
+    for (size_t i = 0; i < source.size();) {
+        char c = source[i];
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            ++i;
+        } else if (c == '"' || c == '\'') {
+            size_t end = source.find(c, i + 1);
+            if (end == std::string::npos) {
+                error = "unterminated string";
+                return std::nullopt;
+            }
+            tokens.emplace_back(source.substr(i + 1, end - i - 1), true);
+            i = end + 1;
+        } else {
+            size_t end = i;
+            while (end < source.size() && !std::isspace(static_cast<unsigned char>(source[end]))) ++end;
+            tokens.emplace_back(source.substr(i, end - i), false);
+            i = end;
+        }
+    }
+
+    Script script;
+    script.id = script_id(source);
+    std::vector<size_t> open_ifs; // indexes of pending JumpIfFalse / Jump instructions
+    for (const auto& [tok, quoted] : tokens) {
+        Instruction ins{OpCode::Push, 0, ""};
+        if (quoted) {
+            ins.literal = tok;
+        } else if (tok.size() > 1 && tok[0] == '$' && std::all_of(tok.begin() + 1, tok.end(), [](char d) {
+                       return std::isdigit(static_cast<unsigned char>(d));
+                   })) {
+            ins.op = OpCode::Arg;
+            auto index = parse_int(tok.substr(1));
+            if (!index) {
+                error = "argument index out of range";
+                return std::nullopt;
+            }
+            ins.operand = static_cast<size_t>(*index);
+            if (ins.operand == 0) {
+                error = "arguments start at $1";
+                return std::nullopt;
+            }
+        } else if (tok == "incr") {
+            script.code.push_back({OpCode::Push, 0, "1"});
+            ins.op = OpCode::IncrBy;
+        } else if (tok == "if") {
+            ins.op = OpCode::JumpIfFalse;
+            open_ifs.push_back(script.code.size());
+        } else if (tok == "else") {
+            if (open_ifs.empty() || script.code[open_ifs.back()].op != OpCode::JumpIfFalse) {
+                error = "'else' without 'if'";
+                return std::nullopt;
+            }
+            ins.op = OpCode::Jump;
+            script.code[open_ifs.back()].operand = script.code.size() + 1;
+            open_ifs.back() = script.code.size();
+        } else if (tok == "then") {
+            if (open_ifs.empty()) {
+                error = "'then' without 'if'";
+                return std::nullopt;
+            }
+            script.code[open_ifs.back()].operand = script.code.size();
+            open_ifs.pop_back();
+            continue;
+        } else if (auto w = words.find(tok); w != words.end()) {
+            ins.op = w->second;
+        } else if (!tok.empty() && (std::isdigit(static_cast<unsigned char>(tok[0])) ||
+                                    (tok[0] == '-' && tok.size() > 1 &&
+                                     std::isdigit(static_cast<unsigned char>(tok[1]))))) {
+            ins.literal = tok;
+        } else {
+            error = "unknown word: " + tok;
+            return std::nullopt;
+        }
+        script.code.push_back(std::move(ins));
+    }
+    if (!open_ifs.empty()) {
+        error = "'if' without 'then'";
+        return std::nullopt;
+    }
+    return script;
+}
+
+// Executes a compiled script against Store, which must provide
+// get/set/incrby/del/exists for the duration of one atomic run.
+template <typename Store>
+ScriptResult run_script(const Script& script, const std::vector<std::string>& args, Store& store,
+                        size_t budget) {
+    using Item = std::optional<std::string>;
+    ScriptResult result;
+    std::vector<Item> stack;
+    auto fail = [&](const std::string& msg) {
+        result.ok = false;
+        result.error = msg;
+        return result;
+    };
+    auto to_int = [](const Item& item, long long& out) {
+        if (!item) return false;
+        auto n = parse_int(*item);
+        if (n) out = *n;
+        return n.has_value();
+    };
+    auto truthy = [](const Item& item) { return item && !item->empty() && *item != "0"; };
+    auto boolean = [](bool b) -> Item { return std::string(b ? "1" : "0"); };
+
+    size_t pc = 0;
+    while (pc < script.code.size()) {
+        if (++result.instructions > budget) return fail("instruction budget exceeded");
+        const Instruction& ins = script.code[pc++];
+
+        // Stack effect: how many items this opcode pops
+        size_t pops = 0;
+        switch (ins.op) {
+            case OpCode::Push: case OpCode::Arg: case OpCode::Jump: case OpCode::Return: pops = 0; break;
+            case OpCode::Get: case OpCode::Del: case OpCode::Exists: case OpCode::Not: case OpCode::Dup:
+            case OpCode::Drop: case OpCode::JumpIfFalse: case OpCode::Error: pops = 1; break;
+            default: pops = 2; break;
+        }
+        if (stack.size() < pops) return fail("stack underflow");
+        Item b = pops >= 1 ? stack.back() : Item();
+        Item a = pops >= 2 ? stack[stack.size() - 2] : Item();
+        if (ins.op != OpCode::Dup && ins.op != OpCode::Over) stack.resize(stack.size() - pops);
+
+        long long x = 0, y = 0;
+        switch (ins.op) {
+            case OpCode::Push: stack.push_back(ins.literal); break;
+            case OpCode::Arg:
+                if (ins.operand > args.size()) return fail("missing argument $" + std::to_string(ins.operand));
+                stack.push_back(args[ins.operand - 1]);
+                break;
+            case OpCode::Get:
+                if (!b) return fail("key is nil");
+                stack.push_back(store.get(*b));
+                break;
+            case OpCode::Set:
+                if (!a || !b) return fail("set with nil key or value");
+                store.set(*a, *b);
+                break;
+            case OpCode::IncrBy: {
+                if (!a || !to_int(b, y)) return fail("incrby needs a key and an integer");
+                auto n = store.incrby(*a, y);
+                if (!n) return fail("value is not an integer or out of range");
+                stack.push_back(std::to_string(*n));
+                break;
+            }
+            case OpCode::Del:
+                if (!b) return fail("key is nil");
+                stack.push_back(boolean(store.del(*b)));
+                break;
+            case OpCode::Exists:
+                if (!b) return fail("key is nil");
+                stack.push_back(boolean(store.exists(*b)));
+                break;
+            case OpCode::Add: case OpCode::Sub: case OpCode::Mul: case OpCode::Div: case OpCode::Mod:
+            case OpCode::Lt: case OpCode::Gt: case OpCode::Le: case OpCode::Ge:
+                if (!to_int(a, x) || !to_int(b, y)) return fail("expected integers");
+                if ((ins.op == OpCode::Div || ins.op == OpCode::Mod) && (y == 0 || (y == -1 && x == LLONG_MIN))) {
+                    return fail("division by zero or overflow");
+                }
+                switch (ins.op) {
+                    case OpCode::Add:
+                    case OpCode::Sub:
+                    case OpCode::Mul: {
+                        long long r = 0;
+                        bool overflow = ins.op == OpCode::Add   ? __builtin_add_overflow(x, y, &r)
+                                        : ins.op == OpCode::Sub ? __builtin_sub_overflow(x, y, &r)
+                                                                : __builtin_mul_overflow(x, y, &r);
+                        if (overflow) return fail("integer overflow");
+                        stack.push_back(std::to_string(r));
+                        break;
+                    }
+                    case OpCode::Div: stack.push_back(std::to_string(x / y)); break;
+                    case OpCode::Mod: stack.push_back(std::to_string(x % y)); break;
+                    case OpCode::Lt: stack.push_back(boolean(x < y)); break;
+                    case OpCode::Gt: stack.push_back(boolean(x > y)); break;
+                    case OpCode::Le: stack.push_back(boolean(x <= y)); break;
+                    default: stack.push_back(boolean(x >= y)); break;
+                }
+                break;
+            case OpCode::Concat: stack.push_back(a.value_or("") + b.value_or("")); break;
+            case OpCode::Eq: stack.push_back(boolean(a == b)); break;
+            case OpCode::Ne: stack.push_back(boolean(a != b)); break;
+            case OpCode::Not: stack.push_back(boolean(!truthy(b))); break;
+            case OpCode::And: stack.push_back(boolean(truthy(a) && truthy(b))); break;
+            case OpCode::Or: stack.push_back(boolean(truthy(a) || truthy(b))); break;
+            case OpCode::Dup: stack.push_back(b); break;
+            case OpCode::Drop: break;
+            case OpCode::Swap: stack.push_back(b); stack.push_back(a); break;
+            case OpCode::Over: stack.push_back(a); break;
+            case OpCode::JumpIfFalse: if (!truthy(b)) pc = ins.operand; break;
+            case OpCode::Jump: pc = ins.operand; break;
+            case OpCode::Return: pc = script.code.size(); break;
+            case OpCode::Error: return fail(b.value_or("error"));
+        }
+    }
+    if (!stack.empty()) result.value = stack.back();
+    return result;
+}
+
+// ========== Epoch-based reclamation ==========
+// Lets lock-free readers walk shared nodes while writers unlink them. A
+// thread pins the current epoch while it may hold pointers to shared nodes.
+// Unlinked nodes are retired together with the epoch at retirement and freed
+// once the global epoch is two past it, which can only happen after every
+// thread pinned at that time has unpinned (or passed a quiescent point).
+//
+// Pinning costs one store and one fence on a thread-local record. Advancing
+// the epoch scans every record, so it is amortized: a thread only tries
+// after every kScanInterval retirements, or when asked via reclaim().
+class EpochReclaimer {
+public:
+    // One reclamation domain per process. Never destroyed, because threads
+    // may still retire memory while static objects are being torn down.
+    static EpochReclaimer& instance() {
+        static EpochReclaimer* reclaimer = new EpochReclaimer();
+        return *reclaimer;
+    }
+
+    // Pins the calling thread for its lifetime; guards nest
+    class Guard {
+    public:
+        explicit Guard(EpochReclaimer& r) : r_(r) { r_.enter(); }
+        ~Guard() { r_.exit(); }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+    private:
+        EpochReclaimer& r_;
+    };
+
+    struct Stats {
+        uint64_t epoch = 0;
+        uint64_t retired = 0;
+        uint64_t freed = 0;
+        size_t threads = 0; // records currently owned by a live thread
+    };
+
+    // Frees p with deleter once no pinned thread can still reference it
+    void retire(void* p, void (*deleter)(void*)) {
+        ThreadRecord* rec = local();
+        rec->limbo.push_back({p, deleter, global_epoch_.load(std::memory_order_acquire)});
+        rec->retired.fetch_add(1, std::memory_order_relaxed);
+        if (++rec->retires_since_scan >= kScanInterval) scan(rec);
+    }
+
+    template <typename T>
+    void retire(T* p) {
+        retire(p, [](void* q) { delete static_cast<T*>(q); });
+    }
+
+    template <typename T>
+    void retire_array(T* p) {
+        retire(p, [](void* q) { delete[] static_cast<T*>(q); });
+    }
+
+    // Quiescent point for long-running tasks that stay pinned: the caller
+    // promises it holds no shared pointers obtained before this call, so its
+    // announcement moves to the current epoch and stops holding back frees.
+    // Outside a guard it just reclaims.
+    void quiescent() {
+        ThreadRecord* rec = local();
+        if (rec->depth > 0) announce(rec);
+        scan(rec);
+    }
+
+    // Tries to advance the epoch and frees whatever has become safe
+    void reclaim() { scan(local()); }
+
+    // Blocks until everything the calling thread retired so far is freed.
+    // Must not be called inside a guard, or it would wait on itself.
+    void synchronize() {
+        ThreadRecord* rec = local();
+        while (true) {
+            scan(rec);
+            if (rec->limbo.empty()) return;
+            std::this_thread::yield();
+        }
+    }
+
+    Stats stats() const {
+        Stats out;
+        out.epoch = global_epoch_.load();
+        for (ThreadRecord* r = records_.load(std::memory_order_acquire); r; r = r->next) {
+            out.retired += r->retired.load(std::memory_order_relaxed);
+            out.freed += r->freed.load(std::memory_order_relaxed);
+            if (r->in_use.load(std::memory_order_relaxed)) ++out.threads;
+        }
+        return out;
+    }
+
+private:
+    static constexpr size_t kScanInterval = 64;
+
+    struct Retired {
+        void* ptr;
+        void (*deleter)(void*);
+        uint64_t epoch;
+    };
+
+    // Per-thread state. Records are never freed, only handed to new threads.
+    struct alignas(64) ThreadRecord {
+        std::atomic<uint64_t> state{0}; // (announced epoch << 1) | pinned
+        std::atomic<bool> in_use{true};
+        std::atomic<uint64_t> retired{0};
+        std::atomic<uint64_t> freed{0};
+        ThreadRecord* next = nullptr;
+        unsigned depth = 0;
+        size_t retires_since_scan = 0;
+        std::vector<Retired> limbo; // oldest first
+    };
+
+    // Gives the calling thread's record back when the thread exits
+    struct LocalHandle {
+        ThreadRecord* rec = nullptr;
+        ~LocalHandle() {
+            if (rec) EpochReclaimer::instance().release(rec);
+        }
+    };
+
+    ThreadRecord* local() {
+        thread_local LocalHandle handle;
+        if (!handle.rec) handle.rec = acquire();
+        return handle.rec;
+    }
+
+    ThreadRecord* acquire() {
+        for (ThreadRecord* r = records_.load(std::memory_order_acquire); r; r = r->next) {
+            bool expected = false;
+            if (r->in_use.compare_exchange_strong(expected, true)) return r;
+        }
+        auto* r = new ThreadRecord();
+        r->next = records_.load(std::memory_order_relaxed);
+        while (!records_.compare_exchange_weak(r->next, r)) {
+        }
+        return r;
+    }
+
+    void release(ThreadRecord* rec) {
+        if (!rec->limbo.empty()) {
+            std::lock_guard<std::mutex> lock(orphans_mutex_);
+            orphans_.insert(orphans_.end(), rec->limbo.begin(), rec->limbo.end());
+            rec->limbo.clear();
+        }
+        rec->depth = 0;
+        rec->state.store(0, std::memory_order_release);
+        rec->in_use.store(false, std::memory_order_release);
+    }
+
+    void announce(ThreadRecord* rec) {
+        rec->state.store((global_epoch_.load(std::memory_order_relaxed) << 1) | 1, std::memory_order_relaxed);
+        // The announcement must be visible before we read any shared pointer
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void enter() {
+        ThreadRecord* rec = local();
+        if (rec->depth++ == 0) announce(rec);
+    }
+
+    void exit() {
+        ThreadRecord* rec = local();
+        if (--rec->depth == 0) rec->state.store(0, std::memory_order_release);
+    }
+
+    // Advances the global epoch if every pinned thread has seen the current one
+    void try_advance() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t epoch = global_epoch_.load(std::memory_order_acquire);
+        for (ThreadRecord* r = records_.load(std::memory_order_acquire); r; r = r->next) {
+            uint64_t s = r->state.load(std::memory_order_acquire);
+            if ((s & 1) && (s >> 1) != epoch) return;
+        }
+        global_epoch_.compare_exchange_strong(epoch, epoch + 1);
+    }
+
+    // Detaches the expired prefix of list. Deleters may retire more memory
+    // (and so scan again), so they run only after the batch is detached and
+    // any lock on list is released.
+    static std::vector<Retired> take_expired(std::vector<Retired>& list, uint64_t epoch) {
+        size_t n = 0;
+        while (n < list.size() && list[n].epoch + 2 <= epoch) ++n;
+        std::vector<Retired> expired(list.begin(), list.begin() + static_cast<std::ptrdiff_t>(n));
+        list.erase(list.begin(), list.begin() + static_cast<std::ptrdiff_t>(n));
+        return expired;
+    }
+
+    static size_t free_all(const std::vector<Retired>& expired) {
+        for (const auto& item : expired) item.deleter(item.ptr);
+        return expired.size();
+    }
+
+    void scan(ThreadRecord* rec) {
+        rec->retires_since_scan = 0;
+        try_advance();
+        uint64_t epoch = global_epoch_.load(std::memory_order_acquire);
+        size_t freed = free_all(take_expired(rec->limbo, epoch));
+        std::vector<Retired> orphans;
+        {
+            std::unique_lock<std::mutex> lock(orphans_mutex_, std::try_to_lock);
+            if (lock.owns_lock() && !orphans_.empty()) {
+                std::stable_sort(orphans_.begin(), orphans_.end(),
+                                 [](const Retired& a, const Retired& b) { return a.epoch < b.epoch; });
+                orphans = take_expired(orphans_, epoch);
+            }
+        }
+        freed += free_all(orphans);
+        rec->freed.fetch_add(freed, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> global_epoch_{1};
+    std::atomic<ThreadRecord*> records_{nullptr};
+    std::mutex orphans_mutex_;
+    std::vector<Retired> orphans_; // left behind by exited threads
+};
+
+// ========== Concurrent tables ==========
+// Backends a KeyValueStore can use instead of its mutex-protected hash map.
+// Every method may be called from any number of threads without locking.
+
+// Where a walk in steps (ConcurrentTable::walk_step) goes on; each backend
+// uses the fields it needs
+struct TableCursor {
+    std::string key;       // last key visited
+    uint64_t position = 0; // next bucket, or the last node's list position
+    uint64_t moves = 0;    // table changes when the pass started
+    int passes = 0;
+    bool started = false;
+    bool done = false;
+};
+
+class ConcurrentTable {
+public:
+    virtual ~ConcurrentTable() = default;
+
+    virtual const char* name() const = 0;
+    virtual std::optional<Value> find(const std::string& key) const = 0;
+    virtual bool contains(const std::string& key) const = 0;
+    // Returns true if the key was newly inserted
+    virtual bool insert_or_assign(const std::string& key, Value value) = 0;
+    virtual bool erase(const std::string& key) = 0;
+    // Atomically replaces the value with fn(current), where current is
+    // nullptr if the key is absent. fn may run more than once under
+    // contention, and returns nullopt to leave the value unchanged.
+    virtual bool update(const std::string& key, const std::function<std::optional<Value>(const Value*)>& fn) = 0;
+    virtual void clear() = 0;
+    virtual size_t size() const = 0;
+    // Weakly consistent walk: entries not modified during it are seen once
+    virtual void for_each(const std::function<void(const std::string&, const Value&)>& fn) const = 0;
+    // Same walk over the keys starting with prefix; returns how many entries
+    // were looked at. Unordered tables have to look at all of them.
+    virtual size_t for_each_prefix(const std::string& prefix,
+                                   const std::function<void(const std::string&, const Value&)>& fn) const {
+        size_t scanned = 0;
+        for_each([&](const std::string& key, const Value& value) {
+            ++scanned;
+            if (key.compare(0, prefix.size(), prefix) == 0) fn(key, value);
+        });
+        return scanned;
+    }
+    // The same walk in steps, for background jobs that yield in between:
+    // looks at about limit entries from cursor on and moves cursor past
+    // them, setting cursor.done at the end. Entries not modified during the
+    // whole walk are seen at least once (on the cuckoo table, unless busy
+    // writers keep displacing them). Returns how many were looked at.
+    virtual size_t walk_step(const std::string& prefix, TableCursor& cursor, size_t limit,
+                             const std::function<void(const std::string&, const Value&)>& fn) const = 0;
+};
+
+// Lock-free hash map using split-ordered lists (Shalev & Shavit, 2006).
+// All entries live in one lock-free sorted linked list (Harris/Michael),
+// ordered by the bit-reversed hash. Each bucket is a shortcut into that
+// list through a sentinel node, so doubling the bucket count never moves an
+// entry: a new bucket just splits its parent's run with a new sentinel.
+// Deletion is two-phase: a remover first swaps the value pointer to null
+// (the linearization point), then marks the node's next pointer and
+// unlinks it. Bucket shortcuts live in fixed-size segments reached through
+// a directory that is copied to a larger one as the table grows. Unlinked
+// nodes, replaced values, outgrown directories and cleared tables are all
+// freed through EpochReclaimer.
+class LockFreeHashMap : public ConcurrentTable {
+public:
+    LockFreeHashMap() : table_(new Table()) {}
+    ~LockFreeHashMap() override { delete table_.load(); }
+
+    LockFreeHashMap(const LockFreeHashMap&) = delete;
+    LockFreeHashMap& operator=(const LockFreeHashMap&) = delete;
+
+    const char* name() const override { return "lockfree"; }
+
+    std::optional<Value> find(const std::string& key) const override {
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        Position pos;
+        if (!locate(table_.load(std::memory_order_acquire), key, pos)) return std::nullopt;
+        Value* v = pos.curr->value.load(std::memory_order_acquire);
+        if (!v) return std::nullopt;
+        return *v;
+    }
+
+    bool contains(const std::string& key) const override {
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        Position pos;
+        return locate(table_.load(std::memory_order_acquire), key, pos) &&
+               pos.curr->value.load(std::memory_order_acquire) != nullptr;
+    }
+
+    bool insert_or_assign(const std::string& key, Value value) override {
+        Value* fresh = new Value(std::move(value));
+        return update_with(key, [&](const Value*) { return fresh; }, [](Value*) {});
+    }
+
+    bool erase(const std::string& key) override {
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        Table* t = table_.load(std::memory_order_acquire);
+        Position pos;
+        while (locate(t, key, pos)) {
+            Value* v = pos.curr->value.load(std::memory_order_acquire);
+            if (v && !pos.curr->value.compare_exchange_strong(v, nullptr)) continue;
+            mark(pos.curr);
+            if (!v) continue; // someone else is deleting it; retry until unlinked
+            locate(t, key, pos); // unlinks the marked node
+            t->count.fetch_sub(1, std::memory_order_relaxed);
+            EpochReclaimer::instance().retire(v);
+            return true;
+        }
+        return false;
+    }
+
+    bool update(const std::string& key, const std::function<std::optional<Value>(const Value*)>& fn) override {
+        bool changed = false;
+        update_with(
+            key,
+            [&](const Value* current) -> Value* {
+                auto next = fn(current);
+                changed = next.has_value();
+                return next ? new Value(std::move(*next)) : nullptr;
+            },
+            [](Value* unused) { delete unused; });
+        return changed;
+    }
+
+    // Swaps in an empty table; the old one is freed once no reader can see it
+    void clear() override {
+        Table* old = table_.exchange(new Table(), std::memory_order_acq_rel);
+        EpochReclaimer::instance().retire(old);
+    }
+
+    size_t size() const override { return table_.load(std::memory_order_acquire)->count.load(); }
+
+    void for_each(const std::function<void(const std::string&, const Value&)>& fn) const override {
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        Table* t = table_.load(std::memory_order_acquire);
+        for (Node* n = ptr(t->head.next.load(std::memory_order_acquire)); n;) {
+            uintptr_t next = n->next.load(std::memory_order_acquire);
+            Value* v = n->value.load(std::memory_order_acquire);
+            if ((n->so_key & 1) && !(next & 1) && v) fn(n->key, *v);
+            n = ptr(next);
+        }
+    }
+
+    // The list order survives growth, so a step resumes right after the
+    // last node it passed (a sentinel or an entry), found through the
+    // bucket that node belongs to
+    size_t walk_step(const std::string& prefix, TableCursor& cursor, size_t limit,
+                     const std::function<void(const std::string&, const Value&)>& fn) const override {
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        Table* t = table_.load(std::memory_order_acquire);
+        Node* n = ptr(t->head.next.load(std::memory_order_acquire));
+        if (cursor.started) {
+            const size_t buckets = t->bucket_count.load(std::memory_order_acquire);
+            Position pos;
+            bool found = search(bucket_head(t, reverse_bits(cursor.position) & (buckets - 1)), cursor.position,
+                                cursor.key, pos);
+            n = found ? ptr(pos.curr->next.load(std::memory_order_acquire)) : pos.curr;
+        }
+        cursor.started = true;
+        size_t scanned = 0;
+        for (size_t visited = 0; n && visited < limit; ++visited) {
+            uintptr_t next = n->next.load(std::memory_order_acquire);
+            Value* v = n->value.load(std::memory_order_acquire);
+            cursor.position = n->so_key;
+            cursor.key = n->key;
+            if ((n->so_key & 1) && !(next & 1) && v) {
+                ++scanned;
+                if (n->key.compare(0, prefix.size(), prefix) == 0) fn(n->key, *v);
+            }
+            n = ptr(next);
+        }
+        cursor.done = n == nullptr;
+        return scanned;
+    }
+
+private:
+    static constexpr size_t kSegmentBits = 10;
+    static constexpr size_t kSegmentSize = size_t(1) << kSegmentBits;
+    static constexpr size_t kLoadFactor = 2;
+
+    struct Node {
+        Node(uint64_t so, std::string k, Value* v) : so_key(so), key(std::move(k)), value(v) {}
+        const uint64_t so_key; // bit-reversed hash: odd for entries, even for bucket sentinels
+        const std::string key;
+        std::atomic<uintptr_t> next{0}; // low bit set = this node is deleted
+        std::atomic<Value*> value;      // null = logically deleted (always null for sentinels)
+    };
+
+    using Segment = std::atomic<Node*>*;
+
+    // Segment pointers by index. Segments belong to the table, not to a
+    // directory: growing copies the pointers and retires the old array.
+    struct Directory {
+        explicit Directory(size_t n) : size(n), segments(new std::atomic<Segment>[n]) {
+            for (size_t i = 0; i < n; ++i) segments[i].store(nullptr, std::memory_order_relaxed);
+        }
+        const size_t size;
+        std::unique_ptr<std::atomic<Segment>[]> segments;
+    };
+
+    struct Table {
+        Table() : head(0, "", nullptr), directory(new Directory(1)) {
+            bucket_slot(this, 0).store(&head, std::memory_order_relaxed);
+        }
+        ~Table() {
+            for (Node* n = ptr(head.next.load()); n;) {
+                Node* next = ptr(n->next.load());
+                delete n->value.load();
+                delete n;
+                n = next;
+            }
+            Directory* dir = directory.load();
+            for (size_t i = 0; i < dir->size; ++i) delete[] dir->segments[i].load();
+            delete dir;
+        }
+        Node head; // sentinel of bucket 0
+        std::atomic<size_t> bucket_count{2};
+        std::atomic<size_t> count{0};
+        std::atomic<Directory*> directory;
+    };
+
+    struct Position {
+        std::atomic<uintptr_t>* prev = nullptr;
+        Node* curr = nullptr;
+        Node* bucket = nullptr;
+        uint64_t so_key = 0;
+    };
+
+    static Node* ptr(uintptr_t p) { return reinterpret_cast<Node*>(p & ~uintptr_t(1)); }
+    static uintptr_t bits(Node* n) { return reinterpret_cast<uintptr_t>(n); }
+    static void mark(Node* n) { n->next.fetch_or(1, std::memory_order_acq_rel); }
+
+    static uint64_t reverse_bits(uint64_t x) {
+        x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+        x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+        x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+        x = ((x >> 8) & 0x00FF00FF00FF00FFULL) | ((x & 0x00FF00FF00FF00FFULL) << 8);
+        x = ((x >> 16) & 0x0000FFFF0000FFFFULL) | ((x & 0x0000FFFF0000FFFFULL) << 16);
+        return (x >> 32) | (x << 32);
+    }
+
+    // Placed in an outgrown directory's empty entries so no segment can be
+    // installed there after its entries were copied
+    static Segment frozen() { return reinterpret_cast<Segment>(uintptr_t(1)); }
+
+    // Current directory, grown until it has an entry for segment index
+    static Directory* directory_for(Table* t, size_t index) {
+        Directory* dir = t->directory.load(std::memory_order_acquire);
+        while (dir->size <= index) {
+            auto* bigger = new Directory(std::max(dir->size * 2, index + 1));
+            for (size_t i = 0; i < dir->size; ++i) {
+                Segment s = nullptr;
+                dir->segments[i].compare_exchange_strong(s, frozen());
+                if (s != frozen()) bigger->segments[i].store(s, std::memory_order_relaxed);
+            }
+            if (t->directory.compare_exchange_strong(dir, bigger)) {
+                EpochReclaimer::instance().retire(dir);
+                dir = bigger;
+            } else {
+                delete bigger; // dir now holds the winner's directory
+            }
+        }
+        return dir;
+    }
+
+    static std::atomic<Node*>& bucket_slot(Table* t, size_t bucket) {
+        const size_t index = bucket >> kSegmentBits;
+        Segment fresh = nullptr;
+        while (true) {
+            Directory* dir = directory_for(t, index);
+            Segment s = dir->segments[index].load(std::memory_order_acquire);
+            if (!s) {
+                if (!fresh) {
+                    fresh = new std::atomic<Node*>[kSegmentSize];
+                    for (size_t i = 0; i < kSegmentSize; ++i) fresh[i].store(nullptr, std::memory_order_relaxed);
+                }
+                if (dir->segments[index].compare_exchange_strong(s, fresh)) {
+                    s = fresh;
+                    fresh = nullptr;
+                }
+            }
+            if (s == frozen()) continue; // being copied; the grower publishes the new directory next
+            delete[] fresh;
+            return s[bucket & (kSegmentSize - 1)];
+        }
+    }
+
+    // Sentinel node of a bucket, inserting it (and its parents) on first use
+    static Node* bucket_head(Table* t, size_t bucket) {
+        std::atomic<Node*>& slot = bucket_slot(t, bucket);
+        if (Node* n = slot.load(std::memory_order_acquire)) return n;
+
+        size_t parent = bucket & ~(size_t(1) << (63 - __builtin_clzll(bucket)));
+        Node* sentinel = new Node(reverse_bits(bucket), "", nullptr);
+        Position pos;
+        while (true) {
+            if (search(bucket_head(t, parent), sentinel->so_key, "", pos)) {
+                delete sentinel; // another thread inserted it first
+                sentinel = pos.curr;
+                break;
+            }
+            sentinel->next.store(bits(pos.curr), std::memory_order_relaxed);
+            uintptr_t expected = bits(pos.curr);
+            if (pos.prev->compare_exchange_strong(expected, bits(sentinel))) break;
+        }
+        slot.store(sentinel, std::memory_order_release);
+        return sentinel;
+    }
+
+    // Finds (so_key, key) in the list after start. On return pos.prev is the
+    // link to update and pos.curr the first node not before the target.
+    // Unlinks (and retires) marked nodes along the way.
+    static bool search(Node* start, uint64_t so_key, const std::string& key, Position& pos) {
+    retry:
+        pos.prev = &start->next;
+        pos.curr = ptr(pos.prev->load(std::memory_order_acquire));
+        while (pos.curr) {
+            uintptr_t next = pos.curr->next.load(std::memory_order_acquire);
+            if (next & 1) {
+                uintptr_t expected = bits(pos.curr);
+                if (!pos.prev->compare_exchange_strong(expected, next & ~uintptr_t(1))) goto retry;
+                EpochReclaimer::instance().retire(pos.curr);
+                pos.curr = ptr(next);
+                continue;
+            }
+            if (pos.curr->so_key > so_key || (pos.curr->so_key == so_key && pos.curr->key >= key)) {
+                return pos.curr->so_key == so_key && pos.curr->key == key;
+            }
+            pos.prev = &pos.curr->next;
+            pos.curr = ptr(next);
+        }
+        return false;
+    }
+
+    static bool locate(Table* t, const std::string& key, Position& pos) {
+        uint64_t h = fast_hash(key);
+        pos.bucket = bucket_head(t, h & (t->bucket_count.load(std::memory_order_acquire) - 1));
+        pos.so_key = reverse_bits(h | (uint64_t(1) << 63));
+        return search(pos.bucket, pos.so_key, key, pos);
+    }
+
+    // Shared insert/replace loop. make(current) returns the new value (or
+    // null to give up); discard frees a made value that lost a race.
+    // Returns true if a new node was inserted.
+    template <typename Make, typename Discard>
+    bool update_with(const std::string& key, Make make, Discard discard) {
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        Table* t = table_.load(std::memory_order_acquire);
+        Position pos;
+        while (true) {
+            if (locate(t, key, pos)) {
+                Value* current = pos.curr->value.load(std::memory_order_acquire);
+                if (!current) {
+                    mark(pos.curr); // help a pending delete, then retry
+                    continue;
+                }
+                Value* next = make(current);
+                if (!next) return false;
+                if (pos.curr->value.compare_exchange_strong(current, next)) {
+                    EpochReclaimer::instance().retire(current);
+                    return false;
+                }
+                discard(next);
+                continue;
+            }
+            Value* next = make(nullptr);
+            if (!next) return false;
+            Node* node = new Node(pos.so_key, key, next);
+            node->next.store(bits(pos.curr), std::memory_order_relaxed);
+            uintptr_t expected = bits(pos.curr);
+            if (pos.prev->compare_exchange_strong(expected, bits(node))) {
+                size_t count = t->count.fetch_add(1, std::memory_order_relaxed) + 1;
+                size_t buckets = t->bucket_count.load(std::memory_order_relaxed);
+                if (count > buckets * kLoadFactor) {
+                    t->bucket_count.compare_exchange_strong(buckets, buckets * 2);
+                }
+                return true;
+            }
+            delete node;
+            discard(next);
+        }
+    }
+
+    mutable std::atomic<Table*> table_;
+};
+
+// Bucketized cuckoo hash map (after MemC3 and libcuckoo). Every key has two
+// candidate buckets of four slots; a slot holds a tag byte from the key's
+// hash and a pointer to an immutable entry, so lookups compare tags for all
+// four slots at once and dereference only on a match. Writers lock the
+// stripes of the buckets they touch; each stripe's lock is also a version
+// counter, and readers take no lock at all: they read both buckets and retry
+// if either version changed. Inserts into two full buckets search
+// breadth-first for a short chain of displacements ending at a free slot,
+// so the table stays over 90% full before it has to grow.
+class CuckooHashMap : public ConcurrentTable {
+public:
+    CuckooHashMap() : table_(new Table(kInitialBuckets)) {}
+    ~CuckooHashMap() override { delete table_.load(); }
+
+    CuckooHashMap(const CuckooHashMap&) = delete;
+    CuckooHashMap& operator=(const CuckooHashMap&) = delete;
+
+    const char* name() const override { return "cuckoo"; }
+
+    std::optional<Value> find(const std::string& key) const override {
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        const Entry* e = lookup(key);
+        if (!e) return std::nullopt;
+        return e->value; // entries are immutable and pinned by the guard
+    }
+
+    bool contains(const std::string& key) const override {
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        return lookup(key) != nullptr;
+    }
+
+    bool insert_or_assign(const std::string& key, Value value) override {
+        return write(key, [&](const Value*) -> std::optional<Value> { return std::move(value); }) == Written::Inserted;
+    }
+
+    bool erase(const std::string& key) override {
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        const uint64_t h = fast_hash(key);
+        while (true) {
+            Table* t = table_.load(std::memory_order_acquire);
+            const size_t b1 = h & t->mask, b2 = alt_bucket(b1, tag_of(h), t->mask);
+            StripeLock lock(*this, b1, b2);
+            if (table_.load(std::memory_order_acquire) != t) continue;
+            auto [bucket, slot] = find_slot(t, b1, b2, tag_of(h), key);
+            if (!bucket) return false;
+            Entry* e = bucket->slots[slot].load(std::memory_order_relaxed);
+            set_tag(*bucket, slot, 0);
+            bucket->slots[slot].store(nullptr, std::memory_order_relaxed);
+            count_.fetch_sub(1, std::memory_order_relaxed);
+            EpochReclaimer::instance().retire(e);
+            return true;
+        }
+    }
+
+    bool update(const std::string& key, const std::function<std::optional<Value>(const Value*)>& fn) override {
+        return write(key, fn) != Written::Declined;
+    }
+
+    void clear() override {
+        lock_all();
+        Table* old = table_.exchange(new Table(kInitialBuckets), std::memory_order_acq_rel);
+        count_.store(0, std::memory_order_relaxed);
+        moves_.fetch_add(1, std::memory_order_release);
+        unlock_all();
+        EpochReclaimer::instance().retire(old); // frees its entries too
+    }
+
+    size_t size() const override { return count_.load(std::memory_order_relaxed); }
+
+    void for_each(const std::function<void(const std::string&, const Value&)>& fn) const override {
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        std::vector<const Entry*> entries;
+        // A displacement during the scan could hide an entry or show it
+        // twice, so rescan until none happened; then stop writers instead
+        for (int attempt = 0;; ++attempt) {
+            const bool stop_writers = attempt >= kMaxScanRetries;
+            if (stop_writers) lock_all();
+            uint64_t moves = moves_.load(std::memory_order_acquire);
+            Table* t = table_.load(std::memory_order_acquire);
+            entries.clear();
+            for (size_t b = 0; b <= t->mask; ++b) {
+                for (size_t s = 0; s < kSlotsPerBucket; ++s) {
+                    if (const Entry* e = t->buckets[b].slots[s].load(std::memory_order_acquire)) entries.push_back(e);
+                }
+            }
+            if (stop_writers) {
+                unlock_all();
+                break;
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (moves_.load(std::memory_order_relaxed) == moves) break;
+        }
+        for (const Entry* e : entries) fn(e->key, e->value);
+    }
+
+    // Walks limit / 4 buckets per step without stopping writers. A
+    // displacement or a resize during a pass could hide an entry, so
+    // passes repeat until one saw none, up to kMaxScanRetries more; with
+    // writers that busy, an entry they moved may still be missed.
+    size_t walk_step(const std::string& prefix, TableCursor& cursor, size_t limit,
+                     const std::function<void(const std::string&, const Value&)>& fn) const override {
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        if (!cursor.started) {
+            cursor.started = true;
+            cursor.moves = moves_.load(std::memory_order_acquire);
+        }
+        Table* t = table_.load(std::memory_order_acquire);
+        size_t scanned = 0;
+        for (size_t end = cursor.position + std::max<size_t>(1, limit / kSlotsPerBucket);
+             cursor.position <= t->mask && cursor.position < end; ++cursor.position) {
+            for (const auto& slot : t->buckets[cursor.position].slots) {
+                const Entry* e = slot.load(std::memory_order_acquire);
+                if (!e) continue;
+                ++scanned;
+                if (e->key.compare(0, prefix.size(), prefix) == 0) fn(e->key, e->value);
+            }
+        }
+        if (cursor.position > t->mask) {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            const uint64_t moves = moves_.load(std::memory_order_relaxed);
+            if (moves == cursor.moves || cursor.passes >= kMaxScanRetries) {
+                cursor.done = true;
+            } else {
+                cursor.position = 0;
+                cursor.moves = moves;
+                ++cursor.passes;
+            }
+        }
+        return scanned;
+    }
+
+    // Fraction of slots in use
+    double load_factor() const {
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        return static_cast<double>(size()) / ((table_.load()->mask + 1) * kSlotsPerBucket);
+    }
+
+private:
+    static constexpr size_t kSlotsPerBucket = 4;
+    static constexpr size_t kInitialBuckets = 16;
+    static constexpr size_t kStripes = 256;
+    static constexpr size_t kMaxPathNodes = 512;    // BFS frontier, about five displacements deep
+    static constexpr int kMaxDisplaceAttempts = 8; // before giving up and growing
+    static constexpr int kMaxScanRetries = 3;
+
+    struct Entry {
+        uint64_t hash;
+        std::string key;
+        Value value;
+    };
+
+    struct Bucket {
+        std::atomic<uint32_t> tags; // one byte per slot, 0 = empty
+        std::atomic<Entry*> slots[kSlotsPerBucket];
+    };
+
+    struct Table {
+        explicit Table(size_t buckets_count) : mask(buckets_count - 1), buckets(new Bucket[buckets_count]) {
+            for (size_t b = 0; b < buckets_count; ++b) {
+                buckets[b].tags.store(0, std::memory_order_relaxed);
+                for (auto& slot : buckets[b].slots) slot.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+        ~Table() {
+            if (!owns_entries) return;
+            for (size_t b = 0; b <= mask; ++b) {
+                for (auto& slot : buckets[b].slots) delete slot.load();
+            }
+        }
+        const size_t mask;
+        std::unique_ptr<Bucket[]> buckets;
+        bool owns_entries = true; // false once the entries moved to a bigger table
+    };
+
+    struct alignas(64) Stripe {
+        std::atomic<uint64_t> version{0}; // odd while a writer holds it
+    };
+
+    enum class Written { Inserted, Replaced, Declined };
+
+    // Locks the stripes of two buckets in a fixed order
+    class StripeLock {
+    public:
+        StripeLock(const CuckooHashMap& map, size_t b1, size_t b2)
+            : map_(map), first_(std::min(b1 % kStripes, b2 % kStripes)), second_(std::max(b1 % kStripes, b2 % kStripes)) {
+            map_.lock_stripe(first_);
+            if (second_ != first_) map_.lock_stripe(second_);
+        }
+        ~StripeLock() {
+            if (second_ != first_) map_.unlock_stripe(second_);
+            map_.unlock_stripe(first_);
+        }
+        StripeLock(const StripeLock&) = delete;
+        StripeLock& operator=(const StripeLock&) = delete;
+
+    private:
+        const CuckooHashMap& map_;
+        const size_t first_, second_;
+    };
+
+    static uint8_t tag_of(uint64_t h) {
+        uint8_t tag = static_cast<uint8_t>(h >> 56);
+        return tag ? tag : 1;
+    }
+
+    // The other bucket of a key, computable from either bucket and the tag,
+    // so displacement never needs the key's hash
+    static size_t alt_bucket(size_t bucket, uint8_t tag, size_t mask) {
+        return (bucket ^ (tag * 0xc6a4a7935bd1e995ULL)) & mask;
+    }
+
+    static uint8_t tag_at(uint32_t tags, size_t slot) { return static_cast<uint8_t>(tags >> (8 * slot)); }
+
+    // Writers hold the bucket's stripe
+    static void set_tag(Bucket& bucket, size_t slot, uint8_t tag) {
+        uint32_t tags = bucket.tags.load(std::memory_order_relaxed);
+        tags = (tags & ~(0xFFu << (8 * slot))) | (uint32_t(tag) << (8 * slot));
+        bucket.tags.store(tags, std::memory_order_relaxed);
+    }
+
+    // Bit 7 of each byte set where the tag matches (SWAR compare of all four
+    // slots; may flag extra slots, never misses one)
+    static uint32_t match_tags(uint32_t tags, uint8_t tag) {
+        uint32_t x = tags ^ (0x01010101u * tag);
+        return (x - 0x01010101u) & ~x & 0x80808080u;
+    }
+
+    static Entry* scan_bucket(const Bucket& bucket, uint8_t tag, const std::string& key) {
+        for (uint32_t m = match_tags(bucket.tags.load(std::memory_order_acquire), tag); m; m &= m - 1) {
+            Entry* e = bucket.slots[__builtin_ctz(m) / 8].load(std::memory_order_acquire);
+            if (e && e->key == key) return e;
+        }
+        return nullptr;
+    }
+
+    // Writers hold the stripes of both buckets
+    static std::pair<Bucket*, size_t> find_slot(Table* t, size_t b1, size_t b2, uint8_t tag, const std::string& key) {
+        for (size_t b : {b1, b2}) {
+            Bucket& bucket = t->buckets[b];
+            for (uint32_t m = match_tags(bucket.tags.load(std::memory_order_relaxed), tag); m; m &= m - 1) {
+                size_t slot = __builtin_ctz(m) / 8;
+                Entry* e = bucket.slots[slot].load(std::memory_order_relaxed);
+                if (e && e->key == key) return {&bucket, slot};
+            }
+        }
+        return {nullptr, 0};
+    }
+
+    std::atomic<uint64_t>& version(size_t bucket) const { return stripes_[bucket % kStripes].version; }
+
+    void lock_stripe(size_t stripe) const {
+        auto& v = stripes_[stripe].version;
+        uint64_t current = v.load(std::memory_order_relaxed);
+        while ((current & 1) || !v.compare_exchange_weak(current, current + 1, std::memory_order_acquire)) {
+            if (current & 1) {
+                std::this_thread::yield();
+                current = v.load(std::memory_order_relaxed);
+            }
+        }
+        // Orders the odd version before our slot writes, for readers
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void unlock_stripe(size_t stripe) const { stripes_[stripe].version.fetch_add(1, std::memory_order_release); }
+
+    void lock_all() const {
+        for (size_t s = 0; s < kStripes; ++s) lock_stripe(s);
+    }
+
+    void unlock_all() const {
+        for (size_t s = kStripes; s-- > 0;) unlock_stripe(s);
+    }
+
+    // Optimistic read: no lock, retried if a writer touched either bucket.
+    // Callers hold an epoch guard, which keeps the returned entry alive.
+    const Entry* lookup(const std::string& key) const {
+        const uint64_t h = fast_hash(key);
+        const uint8_t tag = tag_of(h);
+        while (true) {
+            Table* t = table_.load(std::memory_order_acquire);
+            const size_t b1 = h & t->mask, b2 = alt_bucket(b1, tag, t->mask);
+            const uint64_t v1 = version(b1).load(std::memory_order_acquire);
+            const uint64_t v2 = version(b2).load(std::memory_order_acquire);
+            if ((v1 | v2) & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            const Entry* e = scan_bucket(t->buckets[b1], tag, key);
+            if (!e) e = scan_bucket(t->buckets[b2], tag, key);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (version(b1).load(std::memory_order_relaxed) == v1 && version(b2).load(std::memory_order_relaxed) == v2 &&
+                table_.load(std::memory_order_acquire) == t) {
+                return e;
+            }
+        }
+    }
+
+    // Insert/replace under the stripes of the key's buckets. make(current)
+    // runs once, right before the write that uses its result.
+    template <typename Make>
+    Written write(const std::string& key, Make&& make) {
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        const uint64_t h = fast_hash(key);
+        const uint8_t tag = tag_of(h);
+        int attempts = 0;
+        while (true) {
+            Table* t = table_.load(std::memory_order_acquire);
+            const size_t b1 = h & t->mask, b2 = alt_bucket(b1, tag, t->mask);
+            {
+                StripeLock lock(*this, b1, b2);
+                if (table_.load(std::memory_order_acquire) != t) continue;
+                auto [bucket, slot] = find_slot(t, b1, b2, tag, key);
+                if (bucket) {
+                    Entry* old = bucket->slots[slot].load(std::memory_order_relaxed);
+                    std::optional<Value> next = make(&old->value);
+                    if (!next) return Written::Declined;
+                    bucket->slots[slot].store(new Entry{h, key, std::move(*next)}, std::memory_order_release);
+                    EpochReclaimer::instance().retire(old);
+                    return Written::Replaced;
+                }
+                for (size_t b : {b1, b2}) {
+                    uint32_t tags = t->buckets[b].tags.load(std::memory_order_relaxed);
+                    for (size_t s = 0; s < kSlotsPerBucket; ++s) {
+                        if (tag_at(tags, s)) continue;
+                        std::optional<Value> next = make(nullptr);
+                        if (!next) return Written::Declined;
+                        t->buckets[b].slots[s].store(new Entry{h, key, std::move(*next)}, std::memory_order_release);
+                        set_tag(t->buckets[b], s, tag);
+                        count_.fetch_add(1, std::memory_order_relaxed);
+                        return Written::Inserted;
+                    }
+                }
+            }
+            // Both buckets are full: free a slot by displacement, or grow
+            if (++attempts > kMaxDisplaceAttempts || !displace(t, b1, b2)) {
+                grow(t);
+                attempts = 0;
+            }
+        }
+    }
+
+    // Breadth-first search from b1 and b2 for the shortest chain of moves
+    // ending in a free slot, read without locks, then carried out from the
+    // free end backwards, locking and re-checking each move. Returns false
+    // if no chain exists within kMaxPathNodes.
+    bool displace(Table* t, size_t b1, size_t b2) {
+        struct PathNode {
+            size_t bucket;
+            int parent;  // index in queue, -1 for b1/b2
+            size_t slot; // slot in the parent bucket whose entry moves here
+        };
+        std::vector<PathNode> queue{{b1, -1, 0}};
+        if (b2 != b1) queue.push_back({b2, -1, 0});
+        for (size_t i = 0; i < queue.size(); ++i) {
+            uint32_t tags = t->buckets[queue[i].bucket].tags.load(std::memory_order_acquire);
+            for (size_t s = 0; s < kSlotsPerBucket; ++s) {
+                uint8_t tag = tag_at(tags, s);
+                if (tag == 0) {
+                    // Walk back to the root: path[0] is in b1/b2, path.back() is free
+                    std::vector<std::pair<size_t, size_t>> path{{queue[i].bucket, s}};
+                    for (int n = static_cast<int>(i); queue[n].parent >= 0; n = queue[n].parent) {
+                        path.emplace_back(queue[queue[n].parent].bucket, queue[n].slot);
+                    }
+                    std::reverse(path.begin(), path.end());
+                    for (size_t k = path.size() - 1; k-- > 0;) {
+                        if (!move_entry(t, path[k], path[k + 1])) break; // raced; the caller retries
+                    }
+                    return true;
+                }
+                if (queue.size() < kMaxPathNodes) {
+                    queue.push_back({alt_bucket(queue[i].bucket, tag, t->mask), static_cast<int>(i), s});
+                }
+            }
+        }
+        return false;
+    }
+
+    bool move_entry(Table* t, std::pair<size_t, size_t> from, std::pair<size_t, size_t> to) {
+        StripeLock lock(*this, from.first, to.first);
+        if (table_.load(std::memory_order_acquire) != t) return false;
+        Bucket& src = t->buckets[from.first];
+        Bucket& dst = t->buckets[to.first];
+        uint8_t tag = tag_at(src.tags.load(std::memory_order_relaxed), from.second);
+        if (!tag || alt_bucket(from.first, tag, t->mask) != to.first ||
+            tag_at(dst.tags.load(std::memory_order_relaxed), to.second)) {
+            return false;
+        }
+        dst.slots[to.second].store(src.slots[from.second].load(std::memory_order_relaxed), std::memory_order_release);
+        set_tag(dst, to.second, tag);
+        set_tag(src, from.second, 0);
+        src.slots[from.second].store(nullptr, std::memory_order_relaxed);
+        moves_.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    // Doubles the table with every stripe locked, unless another thread
+    // already replaced t
+    void grow(Table* t) {
+        lock_all();
+        if (table_.load(std::memory_order_acquire) == t) {
+            size_t buckets_count = (t->mask + 1) * 2;
+            Table* bigger = rehash(t, buckets_count);
+            while (!bigger) bigger = rehash(t, buckets_count *= 2);
+            table_.store(bigger, std::memory_order_release);
+            moves_.fetch_add(1, std::memory_order_release);
+            t->owns_entries = false;
+            EpochReclaimer::instance().retire(t);
+        }
+        unlock_all();
+    }
+
+    // Copies t's entry pointers into a new table with random-walk cuckoo
+    // inserts; nullptr if some entry found no place
+    static Table* rehash(const Table* t, size_t buckets_count) {
+        auto fresh = std::make_unique<Table>(buckets_count);
+        fresh->owns_entries = false; // until every entry is placed
+        uint64_t rng = buckets_count;
+        for (size_t b = 0; b <= t->mask; ++b) {
+            for (const auto& slot : t->buckets[b].slots) {
+                Entry* e = slot.load(std::memory_order_relaxed);
+                if (e && !place_unlocked(*fresh, e, rng)) return nullptr;
+            }
+        }
+        fresh->owns_entries = true;
+        return fresh.release();
+    }
+
+    static bool place_unlocked(Table& t, Entry* e, uint64_t& rng) {
+        size_t bucket = e->hash & t.mask;
+        for (int kicks = 0; kicks < 500; ++kicks) {
+            const uint8_t tag = tag_of(e->hash);
+            const size_t candidates[2] = {bucket, alt_bucket(bucket, tag, t.mask)};
+            for (size_t b : candidates) {
+                uint32_t tags = t.buckets[b].tags.load(std::memory_order_relaxed);
+                for (size_t s = 0; s < kSlotsPerBucket; ++s) {
+                    if (tag_at(tags, s)) continue;
+                    t.buckets[b].slots[s].store(e, std::memory_order_relaxed);
+                    set_tag(t.buckets[b], s, tag);
+                    return true;
+                }
+            }
+            // Both full: swap e with a random resident, which then goes on
+            // to its own other bucket
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            const size_t b = candidates[rng & 1];
+            const size_t s = (rng >> 1) % kSlotsPerBucket;
+            Entry* evicted = t.buckets[b].slots[s].load(std::memory_order_relaxed);
+            t.buckets[b].slots[s].store(e, std::memory_order_relaxed);
+            set_tag(t.buckets[b], s, tag);
+            e = evicted;
+            bucket = alt_bucket(b, tag_of(e->hash), t.mask);
+        }
+        return false;
+    }
+
+    mutable std::atomic<Table*> table_;
+    mutable std::unique_ptr<Stripe[]> stripes_{new Stripe[kStripes]};
+    std::atomic<size_t> count_{0};
+    std::atomic<uint64_t> moves_{0}; // displacements and table swaps, for for_each
+};
+
+// Ordered table that keeps keys front-coded: sorted blocks of up to
+// kBlockKeys keys, where each key after a block's first is stored as the
+// length it shares with the key before it plus its remaining bytes. Keys
+// like tenant:1234:user:56789:session:abc then pay for their common
+// prefix about once per block. A point lookup binary-searches the blocks'
+// first keys and decodes one block; a write re-encodes one block, which
+// splits in two when full. Guarded by a reader/writer lock rather than
+// lock-free, and walks in key order, so a prefix visits only its keys.
+class FrontCodedTable : public ConcurrentTable {
+public:
+    static constexpr size_t kBlockKeys = 32;
+
+    const char* name() const override { return "prefix"; }
+
+    std::optional<Value> find(const std::string& key) const override {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        const Value* v = find_locked(key);
+        if (!v) return std::nullopt;
+        return *v;
+    }
+
+    bool contains(const std::string& key) const override {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return find_locked(key) != nullptr;
+    }
+
+    bool insert_or_assign(const std::string& key, Value value) override {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        return write_locked(key, [&](const Value*) -> std::optional<Value> { return std::move(value); }) == 1;
+    }
+
+    bool erase(const std::string& key) override {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        if (blocks_.empty()) return false;
+        const size_t b = block_for(key);
+        Block& block = *blocks_[b];
+        std::vector<std::string> keys = decode(block);
+        auto it = std::lower_bound(keys.begin(), keys.end(), key);
+        if (it == keys.end() || *it != key) return false;
+        const size_t i = it - keys.begin();
+        keys.erase(it);
+        block.values.erase(block.values.begin() + i);
+        --size_;
+        if (keys.empty()) {
+            blocks_.erase(blocks_.begin() + b);
+            return true;
+        }
+        // Fold a sparse block into its successor so deletes don't leave
+        // long runs of near-empty blocks
+        if (keys.size() < kBlockKeys / 4 && b + 1 < blocks_.size()) {
+            Block& next = *blocks_[b + 1];
+            std::vector<std::string> next_keys = decode(next);
+            if (keys.size() + next_keys.size() <= kBlockKeys) {
+                keys.insert(keys.end(), std::make_move_iterator(next_keys.begin()),
+                            std::make_move_iterator(next_keys.end()));
+                block.values.insert(block.values.end(), std::make_move_iterator(next.values.begin()),
+                                    std::make_move_iterator(next.values.end()));
+                blocks_.erase(blocks_.begin() + b + 1);
+            }
+        }
+        encode(block, keys);
+        return true;
+    }
+
+    bool update(const std::string& key, const std::function<std::optional<Value>(const Value*)>& fn) override {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        return write_locked(key, fn) >= 0;
+    }
+
+    void clear() override {
+        std::vector<std::unique_ptr<Block>> old;
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            old.swap(blocks_);
+            size_ = 0;
+        }
+    }
+
+    size_t size() const override {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return size_;
+    }
+
+    void for_each(const std::function<void(const std::string&, const Value&)>& fn) const override {
+        walk_from("", [&](const std::string& key, const Value& value) {
+            fn(key, value);
+            return true;
+        });
+    }
+
+    size_t for_each_prefix(const std::string& prefix,
+                           const std::function<void(const std::string&, const Value&)>& fn) const override {
+        return walk_from(prefix, [&](const std::string& key, const Value& value) {
+            if (key.compare(0, prefix.size(), prefix) != 0) return false;
+            fn(key, value);
+            return true;
+        });
+    }
+
+    size_t walk_step(const std::string& prefix, TableCursor& cursor, size_t limit,
+                     const std::function<void(const std::string&, const Value&)>& fn) const override {
+        size_t seen = 0;
+        bool past_prefix = false;
+        size_t visited = walk_from(
+            cursor.started ? cursor.key : prefix,
+            [&](const std::string& key, const Value& value) {
+                if (key.compare(0, prefix.size(), prefix) != 0) {
+                    past_prefix = true;
+                    return false;
+                }
+                fn(key, value);
+                cursor.key = key;
+                return ++seen < limit;
+            },
+            !cursor.started);
+        cursor.started = true;
+        cursor.done = past_prefix || seen < limit;
+        return visited;
+    }
+
+    // Bytes held for keys: block first keys, the front-coded rest and the
+    // block directory (values not included)
+    size_t key_bytes() const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        size_t bytes = blocks_.capacity() * sizeof(std::unique_ptr<Block>);
+        for (const auto& block : blocks_) {
+            bytes += sizeof(Block) - sizeof(block->values) + block->first.capacity() + block->rest.capacity();
+        }
+        return bytes;
+    }
+
+private:
+    struct Block {
+        std::string first;         // first key, in full
+        std::string rest;          // the others: varint shared length, varint suffix length, suffix
+        std::vector<Value> values; // one per key, in key order
+    };
+
+    // Walks a block's keys in order, rebuilding each one in key
+    struct Cursor {
+        explicit Cursor(const Block& b) : block(b), key(b.first) {}
+
+        bool next() {
+            if (offset >= block.rest.size()) return false;
+            const char* p = block.rest.data() + offset;
+            const size_t shared = get_varint(p), len = get_varint(p);
+            key.resize(shared);
+            key.append(p, len);
+            offset = p + len - block.rest.data();
+            ++index;
+            return true;
+        }
+
+        const Block& block;
+        std::string key;
+        size_t index = 0;
+        size_t offset = 0;
+    };
+
+    static void put_varint(std::string& out, size_t v) {
+        while (v >= 0x80) {
+            out.push_back(static_cast<char>(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(static_cast<char>(v));
+    }
+
+    static size_t get_varint(const char*& p) {
+        size_t v = 0;
+        for (int shift = 0;; shift += 7) {
+            const auto byte = static_cast<unsigned char>(*p++);
+            v |= static_cast<size_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return v;
+        }
+    }
+
+    static std::vector<std::string> decode(const Block& block) {
+        std::vector<std::string> keys;
+        keys.reserve(block.values.size());
+        Cursor c(block);
+        do {
+            keys.push_back(c.key);
+        } while (c.next());
+        return keys;
+    }
+
+    static void encode(Block& block, const std::vector<std::string>& keys) {
+        block.first = keys.front();
+        block.rest.clear();
+        for (size_t i = 1; i < keys.size(); ++i) {
+            const std::string& prev = keys[i - 1];
+            const std::string& key = keys[i];
+            size_t shared = 0;
+            const size_t limit = std::min(prev.size(), key.size());
+            while (shared < limit && prev[shared] == key[shared]) ++shared;
+            put_varint(block.rest, shared);
+            put_varint(block.rest, key.size() - shared);
+            block.rest.append(key, shared, std::string::npos);
+        }
+        block.rest.shrink_to_fit();
+        block.first.shrink_to_fit();
+    }
+
+    // The block that holds key, or would: the last one starting at or
+    // before it, else the first
+    size_t block_for(const std::string& key) const {
+        auto it = std::upper_bound(blocks_.begin(), blocks_.end(), key,
+                                   [](const std::string& k, const std::unique_ptr<Block>& b) { return k < b->first; });
+        return it == blocks_.begin() ? 0 : it - blocks_.begin() - 1;
+    }
+
+    const Value* find_locked(const std::string& key) const {
+        if (blocks_.empty()) return nullptr;
+        const Block& block = *blocks_[block_for(key)];
+        Cursor c(block);
+        do {
+            const int cmp = c.key.compare(key);
+            if (cmp == 0) return &block.values[c.index];
+            if (cmp > 0) break;
+        } while (c.next());
+        return nullptr;
+    }
+
+    // Sets key to fn(current) unless fn declines; returns 1 if inserted, 0
+    // if replaced, -1 if declined
+    template <typename Fn>
+    int write_locked(const std::string& key, Fn&& fn) {
+        if (blocks_.empty()) {
+            auto next = fn(nullptr);
+            if (!next) return -1;
+            auto block = std::make_unique<Block>();
+            block->first = key;
+            block->values.push_back(std::move(*next));
+            blocks_.push_back(std::move(block));
+            ++size_;
+            return 1;
+        }
+        const size_t b = block_for(key);
+        Block& block = *blocks_[b];
+        if (auto* current = const_cast<Value*>(find_locked(key))) {
+            auto next = fn(current);
+            if (!next) return -1;
+            *current = std::move(*next);
+            return 0;
+        }
+        auto next = fn(nullptr);
+        if (!next) return -1;
+        std::vector<std::string> keys = decode(block);
+        const size_t i = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        keys.insert(keys.begin() + i, key);
+        if (block.values.size() == block.values.capacity()) {
+            block.values.reserve(std::min(kBlockKeys + 1, 2 * block.values.size()));
+        }
+        block.values.insert(block.values.begin() + i, std::move(*next));
+        ++size_;
+        if (keys.size() > kBlockKeys) {
+            // Split in half; the upper half becomes a new block after this one
+            const size_t half = keys.size() / 2;
+            auto upper = std::make_unique<Block>();
+            upper->values.assign(std::make_move_iterator(block.values.begin() + half),
+                                 std::make_move_iterator(block.values.end()));
+            block.values.erase(block.values.begin() + half, block.values.end());
+            block.values.shrink_to_fit();
+            encode(*upper, std::vector<std::string>(keys.begin() + half, keys.end()));
+            keys.resize(half);
+            blocks_.insert(blocks_.begin() + b + 1, std::move(upper));
+        }
+        encode(block, keys);
+        return 1;
+    }
+
+    // Visits keys from from onwards (or after it, unless inclusive) in
+    // order, copying one block's worth at a time under the lock and calling
+    // fn outside it; stops when fn returns false. Resuming after the last
+    // key seen keeps the walk correct across concurrent splits. Returns the
+    // number of keys visited.
+    size_t walk_from(std::string from, const std::function<bool(const std::string&, const Value&)>& fn,
+                     bool inclusive = true) const {
+        size_t visited = 0;
+        std::vector<std::pair<std::string, Value>> batch;
+        while (true) {
+            batch.clear();
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex_);
+                for (size_t b = blocks_.empty() ? 0 : block_for(from); b < blocks_.size() && batch.empty(); ++b) {
+                    Cursor c(*blocks_[b]);
+                    do {
+                        const int cmp = c.key.compare(from);
+                        if (cmp > 0 || (cmp == 0 && inclusive)) batch.emplace_back(c.key, c.block.values[c.index]);
+                    } while (c.next());
+                }
+            }
+            if (batch.empty()) return visited;
+            for (const auto& [key, value] : batch) {
+                ++visited;
+                if (!fn(key, value)) return visited;
+            }
+            from = std::move(batch.back().first);
+            inclusive = false;
+        }
+    }
+
+    mutable std::shared_mutex mutex_;
+    std::vector<std::unique_ptr<Block>> blocks_; // ordered by first key
+    size_t size_ = 0;
+};
+
+// ========== NUMA ==========
+// Topology and placement helpers. These use sysfs and raw syscalls rather
+// than libnuma, so the build needs no extra library; on other platforms
+// every machine looks like one node and placement calls are no-ops.
+struct NumaNode {
+    int id = 0;
+    std::vector<int> cpus;
+};
+
+// Parses kernel CPU/node lists such as "0-3,8,10-11"
+std::vector<int> parse_id_list(const std::string& list) {
+    std::vector<int> out;
+    std::istringstream in(list);
+    for (std::string part; std::getline(in, part, ',');) {
+        part = trim(part);
+        if (part.empty()) continue;
+        size_t dash = part.find('-');
+        auto first = parse_int(part.substr(0, dash));
+        auto last = dash == std::string::npos ? first : parse_int(part.substr(dash + 1));
+        if (!first || !last || *first < 0 || *last < *first) return {};
+        for (long long id = *first; id <= *last; ++id) out.push_back(static_cast<int>(id));
+    }
+    return out;
+}
+
+struct NumaTopology {
+    std::vector<NumaNode> nodes;
+    bool simulated = false; // nodes are a split of real CPUs, not memory domains
+
+    static NumaTopology detect() {
+        NumaTopology topology;
+        std::ifstream online("/sys/devices/system/node/online");
+        std::string list;
+        if (online && std::getline(online, list)) {
+            for (int id : parse_id_list(list)) {
+                std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+                std::string cpus;
+                if (!cpulist || !std::getline(cpulist, cpus)) continue;
+                NumaNode node{id, parse_id_list(cpus)};
+                if (!node.cpus.empty()) topology.nodes.push_back(std::move(node));
+            }
+        }
+        if (topology.nodes.empty()) {
+            NumaNode node;
+            for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) {
+                node.cpus.push_back(static_cast<int>(cpu));
+            }
+            topology.nodes.push_back(std::move(node));
+        }
+        return topology;
+    }
+
+    // Deals the real CPUs out to n pretend nodes, to exercise partitioning
+    // and routing on one-node machines (CPUs are reused if there are fewer)
+    static NumaTopology simulate(size_t n) {
+        std::vector<int> cpus;
+        for (const auto& node : detect().nodes) cpus.insert(cpus.end(), node.cpus.begin(), node.cpus.end());
+        NumaTopology topology;
+        topology.simulated = true;
+        for (size_t i = 0; i < n; ++i) topology.nodes.push_back(NumaNode{static_cast<int>(i), {}});
+        for (size_t i = 0; i < std::max(n, cpus.size()); ++i) {
+            topology.nodes[i % n].cpus.push_back(cpus[i % cpus.size()]);
+        }
+        return topology;
+    }
+};
+
+// Restricts the calling thread to cpus; false if that is not possible here
+bool bind_current_thread(const std::vector<int>& cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    return !cpus.empty() && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+// Asks the kernel to place the calling thread's new pages on node
+// (MPOL_PREFERRED, so allocation still succeeds when the node is full)
+bool prefer_memory_on_node(int node) {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+    constexpr int kMpolPreferred = 1;
+    if (node < 0 || node >= 64) return false;
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_set_mempolicy, kMpolPreferred, &mask, 65) == 0;
+#else
+    (void)node;
+    return false;
+#endif
+}
+
+// Node holding the page at addr, or -1 if unknown
+int memory_node_of(const void* addr) {
+#if defined(__linux__) && defined(SYS_move_pages)
+    static const uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    void* page = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(addr) & ~(page_size - 1));
+    int status = -1;
+    if (syscall(SYS_move_pages, 0, 1, &page, nullptr, &status, 0) != 0) return -1;
+    return status >= 0 ? status : -1;
+#else
+    (void)addr;
+    return -1;
+#endif
+}
+
+// Node the calling thread was bound to with bind_current_thread_to_node, or -1
+inline thread_local int current_numa_node = -1;
+
+bool bind_current_thread_to_node(const NumaNode& node, bool simulated) {
+    current_numa_node = node.id;
+    bool bound = bind_current_thread(node.cpus);
+    if (!simulated) bound = prefer_memory_on_node(node.id) && bound;
+    return bound;
+}
+
+// ========== Task scheduler ==========
+// One shared pool for background jobs (snapshots, sweeps, compaction...),
+// so they do not each start a thread and compete with request threads.
+// Every worker owns a deque per priority. It runs its own tasks oldest
+// first and, when it has none, steals the newest from another worker's
+// deque, always taking the highest priority available anywhere first. Tasks
+// are cooperative: a long job works until should_yield(), then returns
+// Yield and is requeued behind the tasks that were waiting. A task that
+// waits for something calls resume_after() before returning Yield and
+// sleeps without holding a worker.
+enum class TaskPriority { High, Normal, Low };
+enum class TaskStatus { Done, Yield };
+
+const char* task_priority_name(TaskPriority priority) {
+    switch (priority) {
+        case TaskPriority::High: return "high";
+        case TaskPriority::Normal: return "normal";
+        case TaskPriority::Low: return "low";
+    }
+    return "unknown";
+}
+
+class TaskContext {
+public:
+    TaskContext(std::chrono::steady_clock::time_point deadline, bool stopping)
+        : deadline_(deadline), stopping_(stopping) {}
+
+    // True once this time slice is used up
+    bool should_yield() const { return std::chrono::steady_clock::now() >= deadline_; }
+    // True while the scheduler shuts down; a task that yields now is dropped
+    bool stopping() const { return stopping_; }
+
+    // With Yield: requeue the task only once delay has passed
+    void resume_after(std::chrono::steady_clock::duration delay) {
+        resume_at_ = std::chrono::steady_clock::now() + delay;
+    }
+    std::chrono::steady_clock::time_point resume_at() const { return resume_at_; }
+
+private:
+    std::chrono::steady_clock::time_point deadline_;
+    bool stopping_;
+    std::chrono::steady_clock::time_point resume_at_{};
+};
+
+using TaskFn = std::function<TaskStatus(TaskContext&)>;
+
+struct SchedulerOptions {
+    size_t workers = 0;                      // 0 = a quarter of the hardware threads, at least one
+    double max_cpu_share = 0.25;             // of the whole machine, summed over all workers
+    std::chrono::microseconds slice{2000};   // time a task may run before it should yield
+    std::vector<int> cpus;                   // pin worker i to cpus[i % size]; empty = no pinning
+};
+
+struct WorkerStats {
+    size_t id = 0;
+    int cpu = -1; // -1 = not pinned
+    std::string running; // empty when idle
+    size_t queued[3] = {0, 0, 0}; // by TaskPriority
+    uint64_t executed = 0;
+    uint64_t slices = 0;
+    uint64_t stolen = 0;
+};
+
+struct SchedulerStats {
+    std::vector<WorkerStats> workers;
+    double max_cpu_share = 1.0;
+    std::chrono::microseconds slice{0};
+    uint64_t submitted = 0;
+    uint64_t completed = 0;
+    size_t sleeping = 0; // tasks waiting out resume_after()
+};
+
+class TaskScheduler {
+public:
+    explicit TaskScheduler(SchedulerOptions options = {}) : options_(std::move(options)) {
+        const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+        if (options_.workers == 0) options_.workers = std::max<size_t>(1, hardware / 4);
+        options_.max_cpu_share = std::min(1.0, std::max(0.01, options_.max_cpu_share));
+        // The cap is for the machine; each worker gets an equal duty cycle
+        duty_cycle_ = std::min(1.0, options_.max_cpu_share * static_cast<double>(hardware) / options_.workers);
+        for (size_t i = 0; i < options_.workers; ++i) {
+            workers_.push_back(std::make_unique<Worker>());
+            if (!options_.cpus.empty()) workers_[i]->cpu = options_.cpus[i % options_.cpus.size()];
+        }
+        for (size_t i = 0; i < options_.workers; ++i) {
+            workers_[i]->thread = std::thread([this, i] { worker_loop(i); });
+        }
+    }
+
+    // Runs the tasks still queued, then stops the workers
+    ~TaskScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& w : workers_) w->thread.join();
+    }
+
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    // Queues a task; from a worker thread it goes on that worker's own deque
+    void submit(std::string name, TaskFn fn, TaskPriority priority = TaskPriority::Normal) {
+        size_t target = current_worker_.scheduler == this ? current_worker_.index
+                                                          : next_worker_.fetch_add(1) % workers_.size();
+        {
+            // Counted before it is visible, so a thief never decrements first
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++submitted_;
+            ++outstanding_;
+            ++queued_;
+        }
+        {
+            std::lock_guard<std::mutex> lock(workers_[target]->mutex);
+            workers_[target]->queues[static_cast<int>(priority)].push_back(Task{std::move(name), std::move(fn), priority});
+        }
+        wake_.notify_one();
+    }
+
+    // One-shot job that runs to completion in a single slice
+    template <typename F>
+    void run(std::string name, F&& fn, TaskPriority priority = TaskPriority::Normal) {
+        submit(std::move(name),
+               [fn = std::forward<F>(fn)](TaskContext&) mutable {
+                   fn();
+                   return TaskStatus::Done;
+               },
+               priority);
+    }
+
+    size_t worker_count() const { return workers_.size(); }
+
+    // Blocks until every submitted task has finished
+    void wait_idle() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [&] { return outstanding_ == 0; });
+    }
+
+    SchedulerStats stats() const {
+        SchedulerStats out;
+        out.max_cpu_share = options_.max_cpu_share;
+        out.slice = options_.slice;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            out.submitted = submitted_;
+            out.completed = completed_;
+            out.sleeping = sleeping_.size();
+        }
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            Worker& w = *workers_[i];
+            WorkerStats ws;
+            ws.id = i;
+            ws.cpu = w.cpu;
+            {
+                std::lock_guard<std::mutex> lock(w.mutex);
+                ws.running = w.running;
+                for (int p = 0; p < 3; ++p) ws.queued[p] = w.queues[p].size();
+            }
+            ws.executed = w.executed.load();
+            ws.slices = w.slices.load();
+            ws.stolen = w.stolen.load();
+            out.workers.push_back(std::move(ws));
+        }
+        return out;
+    }
+
+private:
+    struct Task {
+        std::string name;
+        TaskFn fn;
+        TaskPriority priority;
+    };
+
+    struct Worker {
+        mutable std::mutex mutex; // guards queues and running
+        std::deque<Task> queues[3];
+        std::string running;
+        std::thread thread;
+        int cpu = -1;
+        std::atomic<uint64_t> executed{0};
+        std::atomic<uint64_t> slices{0};
+        std::atomic<uint64_t> stolen{0};
+    };
+
+    // Zero-initialized like any thread_local: no scheduler
+    struct CurrentWorker {
+        const TaskScheduler* scheduler;
+        size_t index;
+    };
+    static inline thread_local CurrentWorker current_worker_;
+
+    // Own oldest task first, then the newest from another worker, one
+    // priority level at a time
+    std::optional<Task> next_task(size_t index) {
+        Worker& self = *workers_[index];
+        for (int p = 0; p < 3; ++p) {
+            {
+                std::lock_guard<std::mutex> lock(self.mutex);
+                if (!self.queues[p].empty()) {
+                    Task task = std::move(self.queues[p].front());
+                    self.queues[p].pop_front();
+                    return task;
+                }
+            }
+            for (size_t k = 1; k < workers_.size(); ++k) {
+                Worker& victim = *workers_[(index + k) % workers_.size()];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.queues[p].empty()) {
+                    Task task = std::move(victim.queues[p].back());
+                    victim.queues[p].pop_back();
+                    ++self.stolen;
+                    return task;
+                }
+            }
+        }
+        return std::nullopt;
+    }
+
+    void worker_loop(size_t index) {
+        current_worker_ = {this, index};
+        Worker& self = *workers_[index];
+        if (self.cpu >= 0 && !bind_current_thread({self.cpu})) {
+            Logger::error("Could not pin background worker to CPU " + std::to_string(self.cpu));
+        }
+        while (true) {
+            wake_sleepers(index);
+            std::optional<Task> task = next_task(index);
+            bool stopping;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (task) --queued_;
+                if (!task) {
+                    if (stopping_ && sleeping_.empty()) return;
+                    auto ready = [&] { return stopping_ || queued_ > 0; };
+                    if (sleeping_.empty()) wake_.wait(lock, ready);
+                    else wake_.wait_until(lock, sleeping_.begin()->first, ready);
+                    continue;
+                }
+                stopping = stopping_;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(self.mutex);
+                self.running = task->name;
+            }
+            auto start = std::chrono::steady_clock::now();
+            TaskContext context(start + options_.slice, stopping);
+            TaskStatus status = task->fn(context);
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            ++self.slices;
+
+            bool requeue = status == TaskStatus::Yield && !stopping;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (requeue && context.resume_at() > std::chrono::steady_clock::now()) {
+                    sleeping_.emplace(context.resume_at(), std::move(*task));
+                    requeue = false;
+                } else if (requeue) {
+                    ++queued_;
+                } else {
+                    ++self.executed;
+                    ++completed_;
+                    if (--outstanding_ == 0) idle_.notify_all();
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(self.mutex);
+                self.running.clear();
+                // Behind every task that was waiting
+                if (requeue) self.queues[static_cast<int>(task->priority)].push_back(std::move(*task));
+            }
+            throttle(elapsed);
+        }
+    }
+
+    // Moves the sleeping tasks that are due (all of them once stopping) to
+    // this worker's deques
+    void wake_sleepers(size_t index) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (sleeping_.empty()) return;
+        const auto now = std::chrono::steady_clock::now();
+        Worker& self = *workers_[index];
+        while (!sleeping_.empty() && (stopping_ || sleeping_.begin()->first <= now)) {
+            Task task = std::move(sleeping_.begin()->second);
+            sleeping_.erase(sleeping_.begin());
+            ++queued_;
+            std::lock_guard<std::mutex> worker_lock(self.mutex);
+            self.queues[static_cast<int>(task.priority)].push_back(std::move(task));
+        }
+    }
+
+    // Sleeps long enough after each slice to keep this worker at its share
+    void throttle(std::chrono::steady_clock::duration busy) {
+        if (duty_cycle_ >= 1.0) return;
+        auto rest = std::chrono::duration_cast<std::chrono::microseconds>(busy * ((1.0 - duty_cycle_) / duty_cycle_));
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait_for(lock, std::min<std::chrono::microseconds>(rest, std::chrono::seconds(1)),
+                       [&] { return stopping_; });
+    }
+
+    SchedulerOptions options_;
+    double duty_cycle_ = 1.0;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<size_t> next_worker_{0};
+
+    mutable std::mutex mutex_; // guards the counters below and stopping_
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    size_t queued_ = 0;
+    size_t outstanding_ = 0;
+    uint64_t submitted_ = 0;
+    uint64_t completed_ = 0;
+    bool stopping_ = false;
+    std::multimap<std::chrono::steady_clock::time_point, Task> sleeping_; // by wake-up time
+};
+
+// Process-wide pool for the store's background jobs. configure_background_tasks
+// only has an effect before the first use.
+SchedulerOptions& background_task_options() {
+    static SchedulerOptions options;
+    return options;
+}
+
+void configure_background_tasks(SchedulerOptions options) { background_task_options() = std::move(options); }
+
+TaskScheduler& background_tasks() {
+    static TaskScheduler scheduler(background_task_options());
+    return scheduler;
+}
+
+// Destroys obj on a background worker rather than the calling thread, for
+// things that are slow to free (big tables, large values) and were taken
+// out from under a lock
+template <typename T>
+void free_lazily(T&& obj) {
+    auto holder = std::make_shared<std::decay_t<T>>(std::forward<T>(obj));
+    background_tasks().run("lazyfree", [holder = std::move(holder)]() mutable { holder.reset(); }, TaskPriority::Low);
+}
+
+// A one-shot job on the background pool that the submitting thread can take
+// back: wait() runs it in place if no worker has started it yet, so a caller
+// that is itself a background task never waits on a job queued behind it.
+// A job left unstarted until after wait() is dropped when a worker reaches
+// it, so fn may refer to the caller's locals.
+class SharedJob {
+public:
+    static std::shared_ptr<SharedJob> submit(std::string name, std::function<void()> fn,
+                                             TaskPriority priority = TaskPriority::Normal) {
+        auto job = std::make_shared<SharedJob>(std::move(fn));
+        background_tasks().run(std::move(name), [job] { job->run_if_unclaimed(); }, priority);
+        return job;
+    }
+
+    explicit SharedJob(std::function<void()> fn) : fn_(std::move(fn)) {}
+
+    void wait() {
+        if (run_if_unclaimed()) return;
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [&] { return done_; });
+    }
+
+private:
+    bool run_if_unclaimed() {
+        if (claimed_.exchange(true)) return false;
+        fn_();
+        fn_ = nullptr;
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        done_cv_.notify_all();
+        return true;
+    }
+
+    std::function<void()> fn_;
+    std::atomic<bool> claimed_{false};
+    std::mutex mutex_;
+    std::condition_variable done_cv_;
+    bool done_ = false;
+};
+
+// ========== Compressed snapshots ==========
+// Snapshot files can be stored as a sequence of independently compressed
+// blocks, so both directions parallelize: the saving thread serializes
+// into fixed-size blocks, the background pool compresses them (under its
+// worker count and CPU cap) and the blocks are written back in order;
+// loading decompresses all blocks the same way.
+//   KVSTORE Z\n
+//   per block: raw size u32, stored size u32, checksum u64 (of the raw bytes), stored bytes
+//   end: a block header of zeros
+// Header fields are little-endian. A block whose stored size equals its raw
+// size is kept uncompressed (used when compression would not shrink it).
+// The decompressed bytes are a snapshot in one of the formats above.
+const std::string kCompressedSnapshotMagic = "KVSTORE Z\n";
+
+struct SnapshotOptions {
+    bool compress = false;
+    int level = 1;                   // 1 (fastest) to 9 (smallest)
+    size_t block_size = 256 << 10;   // raw bytes per block
+    size_t threads = 0;              // blocks worked on at once; 0 = background workers plus the caller
+};
+
+// Largest block the writer produces; the reader rejects bigger ones
+constexpr size_t kMaxSnapshotBlock = size_t(1) << 30;
+// The LZ4 layout can't expand a block by much more than 255x; anything
+// claiming more is corrupt, and checking it bounds what a load allocates
+constexpr size_t kMaxBlockRatio = 256;
+
+size_t snapshot_threads(size_t threads) {
+    return threads ? threads : background_tasks().worker_count() + 1;
+}
+
+// LZ77 codec in the LZ4 block layout: sequences of
+//   token (literal count << 4 | match length - 4), extra literal count bytes,
+//   literals, match offset u16, extra match length bytes
+// where a 15 in a token nibble continues in bytes of up to 255. The last
+// sequence has literals only. Matches reach back at most 64 KiB. Higher
+// levels follow longer hash chains for better matches.
+namespace lz {
+
+constexpr size_t kMinMatch = 4;
+constexpr size_t kWindow = 65535;
+constexpr int kHashBits = 16;
+constexpr uint32_t kNone = UINT32_MAX;
+
+inline uint32_t read32(const char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint32_t hash(const char* p) { return (read32(p) * 2654435761u) >> (32 - kHashBits); }
+
+inline size_t match_length(const char* a, const char* b, const char* end) {
+    const char* start = b;
+    while (b + 8 <= end) {
+        uint64_t x, y;
+        std::memcpy(&x, a, 8);
+        std::memcpy(&y, b, 8);
+        if (x != y) break;
+        a += 8;
+        b += 8;
+    }
+    while (b < end && *a == *b) ++a, ++b;
+    return static_cast<size_t>(b - start);
+}
+
+inline void put_length(std::string& out, size_t n) {
+    for (; n >= 255; n -= 255) out.push_back(static_cast<char>(255));
+    out.push_back(static_cast<char>(n));
+}
+
+inline void put_sequence(std::string& out, const char* literals, size_t literal_count, size_t offset,
+                         size_t match) {
+    size_t extra = match ? match - kMinMatch : 0;
+    out.push_back(static_cast<char>((std::min<size_t>(literal_count, 15) << 4) | std::min<size_t>(extra, 15)));
+    if (literal_count >= 15) put_length(out, literal_count - 15);
+    out.append(literals, literal_count);
+    if (!match) return;
+    out.push_back(static_cast<char>(offset & 0xFF));
+    out.push_back(static_cast<char>(offset >> 8));
+    if (extra >= 15) put_length(out, extra - 15);
+}
+
+// Appends the compressed form of src to out
+void compress(const char* src, size_t size, std::string& out, int level) {
+    static thread_local std::vector<uint32_t> head, chain;
+    head.assign(size_t(1) << kHashBits, kNone);
+    if (level > 1) chain.resize(kWindow + 1);
+    const size_t depth = level > 1 ? size_t(1) << (std::min(level, 9) - 1) : 1;
+    const char* end = src + size;
+
+    auto insert = [&](size_t pos) {
+        uint32_t& h = head[hash(src + pos)];
+        if (level > 1) chain[pos & kWindow] = h;
+        h = static_cast<uint32_t>(pos);
+    };
+
+    size_t anchor = 0, pos = 0, misses = 0;
+    while (size >= kMinMatch && pos + kMinMatch <= size) {
+        size_t best = 0, best_offset = 0;
+        uint32_t candidate = head[hash(src + pos)];
+        for (size_t probe = 0; probe < depth && candidate != kNone && pos - candidate <= kWindow; ++probe) {
+            if (read32(src + candidate) == read32(src + pos)) {
+                size_t len = match_length(src + candidate, src + pos, end);
+                if (len > best) {
+                    best = len;
+                    best_offset = pos - candidate;
+                }
+            }
+            if (level <= 1) break;
+            uint32_t next = chain[candidate & kWindow];
+            if (next == kNone || next >= candidate) break; // slot reused by a newer position
+            candidate = next;
+        }
+        insert(pos);
+        if (best < kMinMatch) {
+            // Skip faster through data that does not compress (level 1 only)
+            pos += level > 1 ? 1 : 1 + (misses++ >> 6);
+            continue;
+        }
+        put_sequence(out, src + anchor, pos - anchor, best_offset, best);
+        size_t match_end = pos + best;
+        if (level > 1) {
+            for (size_t p = pos + 1; p < match_end && p + kMinMatch <= size; ++p) insert(p);
+        } else if (match_end >= 2 && match_end - 2 > pos && match_end - 2 + kMinMatch <= size) {
+            insert(match_end - 2);
+        }
+        pos = anchor = match_end;
+        misses = 0;
+    }
+    put_sequence(out, src + anchor, size - anchor, 0, 0);
+}
+
+// Decompresses exactly size bytes into dst; false on malformed input
+bool decompress(const char* src, size_t src_size, char* dst, size_t size) {
+    const uint8_t* ip = reinterpret_cast<const uint8_t*>(src);
+    const uint8_t* const in_end = ip + src_size;
+    size_t op = 0;
+    auto get_length = [&](size_t& n) {
+        for (uint8_t b = 255; b == 255;) {
+            if (ip >= in_end) return false;
+            b = *ip++;
+            n += b;
+        }
+        return true;
+    };
+    while (ip < in_end) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !get_length(literals)) return false;
+        if (literals > static_cast<size_t>(in_end - ip) || literals > size - op) return false;
+        std::memcpy(dst + op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == in_end) break;
+
+        if (in_end - ip < 2) return false;
+        size_t offset = ip[0] | (size_t(ip[1]) << 8);
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && !get_length(match)) return false;
+        match += kMinMatch;
+        if (offset == 0 || offset > op || match > size - op) return false;
+        const char* from = dst + op - offset;
+        if (offset >= match) {
+            std::memcpy(dst + op, from, match);
+        } else {
+            for (size_t i = 0; i < match; ++i) dst[op + i] = from[i]; // overlapping run
+        }
+        op += match;
+    }
+    return op == size;
+}
+
+} // namespace lz
+
+inline void put_le(std::string& out, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) out.push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+}
+
+inline uint64_t get_le(const char* p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i) v |= uint64_t(static_cast<uint8_t>(p[i])) << (8 * i);
+    return v;
+}
+
+constexpr size_t kBlockHeaderSize = 16;
+
+uint64_t block_checksum(const char* data, size_t size) {
+    ImageChecksum checksum;
+    checksum.update(data, size);
+    return checksum.value();
+}
+
+// An output stream that writes a compressed snapshot body into out: bytes
+// written to stream() are cut into blocks, compressed as SharedJobs on the
+// background pool and written in order. At most two blocks per thread are
+// in flight, which bounds memory and lets the serializing thread run ahead
+// of compression; the writer compresses any block no worker got to.
+class SnapshotCompressor : private std::streambuf {
+public:
+    SnapshotCompressor(std::ostream& out, const SnapshotOptions& options)
+        : out_(out), options_(options), stream_(this) {
+        options_.block_size = std::min(std::max<size_t>(options_.block_size, 1024), kMaxSnapshotBlock);
+        options_.level = std::min(9, std::max(1, options_.level));
+        const size_t threads = snapshot_threads(options_.threads);
+        max_in_flight_ = 2 * threads;
+        parallel_ = threads > 1;
+        start_block();
+    }
+
+    ~SnapshotCompressor() { finish(); }
+
+    SnapshotCompressor(const SnapshotCompressor&) = delete;
+    SnapshotCompressor& operator=(const SnapshotCompressor&) = delete;
+
+    std::ostream& stream() { return stream_; }
+
+    // Writes the last partial block and the end marker
+    void finish() {
+        if (finished_) return;
+        finished_ = true;
+        submit_block();
+        while (!in_flight_.empty()) write_oldest();
+        out_.write(std::string(kBlockHeaderSize, '\0').data(), kBlockHeaderSize);
+    }
+
+    uint64_t raw_bytes() const { return raw_bytes_; }
+    uint64_t stored_bytes() const { return stored_bytes_; }
+
+private:
+    struct Block {
+        std::string raw;
+        std::string stored; // header and data, ready to write
+        std::shared_ptr<SharedJob> job;
+    };
+
+    int overflow(int c) override {
+        submit_block();
+        start_block();
+        if (c != traits_type::eof()) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    void start_block() {
+        buffer_.resize(options_.block_size);
+        setp(&buffer_[0], &buffer_[0] + buffer_.size());
+    }
+
+    void submit_block() {
+        auto block = std::make_shared<Block>();
+        buffer_.resize(static_cast<size_t>(pptr() - pbase()));
+        block->raw.swap(buffer_);
+        setp(nullptr, nullptr);
+        if (block->raw.empty()) return;
+        raw_bytes_ += block->raw.size();
+        if (!parallel_) {
+            compress_block(*block, options_.level);
+            write_block(*block);
+            return;
+        }
+        while (in_flight_.size() >= max_in_flight_) write_oldest();
+        // write_oldest() waits on the job before the block is dropped
+        block->job = SharedJob::submit("compress", [block = block.get(), level = options_.level] {
+            compress_block(*block, level);
+        });
+        in_flight_.push_back(block);
+    }
+
+    static void compress_block(Block& block, int level) {
+        const std::string& raw = block.raw;
+        std::string& stored = block.stored;
+        stored.reserve(kBlockHeaderSize + raw.size() + raw.size() / 255 + 16);
+        stored.resize(kBlockHeaderSize);
+        lz::compress(raw.data(), raw.size(), stored, level);
+        if (stored.size() - kBlockHeaderSize >= raw.size()) {
+            stored.resize(kBlockHeaderSize);
+            stored += raw;
+        }
+        std::string header;
+        put_le(header, raw.size(), 4);
+        put_le(header, stored.size() - kBlockHeaderSize, 4);
+        put_le(header, block_checksum(raw.data(), raw.size()), 8);
+        stored.replace(0, kBlockHeaderSize, header);
+    }
+
+    void write_oldest() {
+        std::shared_ptr<Block> block = in_flight_.front();
+        in_flight_.pop_front();
+        block->job->wait();
+        write_block(*block);
+    }
+
+    void write_block(const Block& block) {
+        out_.write(block.stored.data(), static_cast<std::streamsize>(block.stored.size()));
+        stored_bytes_ += block.stored.size() - kBlockHeaderSize;
+    }
+
+    std::ostream& out_;
+    SnapshotOptions options_;
+    std::ostream stream_;
+    std::string buffer_;
+    std::deque<std::shared_ptr<Block>> in_flight_;
+    size_t max_in_flight_ = 2;
+    uint64_t raw_bytes_ = 0;
+    uint64_t stored_bytes_ = 0;
+    bool parallel_ = false;
+    bool finished_ = false;
+};
+
+// Decompresses a whole compressed snapshot, blocks in parallel on the
+// background pool; false if it is truncated, malformed, claims more than
+// the writer could have produced, or a checksum does not match
+bool inflate_snapshot(const std::string& data, std::string& out, size_t threads = 0) {
+    struct Span {
+        size_t from, stored, to, raw;
+        uint64_t checksum;
+    };
+    std::vector<Span> spans;
+    size_t pos = kCompressedSnapshotMagic.size(), total = 0;
+    while (true) {
+        if (data.size() - pos < kBlockHeaderSize) return false;
+        Span span;
+        span.raw = get_le(&data[pos], 4);
+        span.stored = get_le(&data[pos + 4], 4);
+        span.checksum = get_le(&data[pos + 8], 8);
+        pos += kBlockHeaderSize;
+        if (span.raw == 0) break;
+        if (span.stored > data.size() - pos || span.stored > span.raw) return false;
+        if (span.raw > kMaxSnapshotBlock || span.raw > span.stored * kMaxBlockRatio + 64) return false;
+        span.from = pos;
+        span.to = total;
+        total += span.raw;
+        pos += span.stored;
+        spans.push_back(span);
+    }
+    if (pos != data.size()) return false;
+
+    // Bounded by the checks above, but still a multiple of the file size
+    try {
+        out.assign(total, '\0');
+    } catch (const std::bad_alloc&) {
+        return false;
+    }
+    std::atomic<bool> ok{true};
+    auto inflate = [&](const Span& span) {
+        char* dst = &out[span.to];
+        if (span.stored == span.raw) {
+            std::memcpy(dst, &data[span.from], span.raw);
+        } else if (!lz::decompress(&data[span.from], span.stored, dst, span.raw)) {
+            ok = false;
+            return;
+        }
+        if (block_checksum(dst, span.raw) != span.checksum) ok = false;
+    };
+    if (std::min(snapshot_threads(threads), spans.size()) <= 1) {
+        for (const Span& span : spans) inflate(span);
+        return ok;
+    }
+    std::vector<std::shared_ptr<SharedJob>> jobs;
+    jobs.reserve(spans.size());
+    for (const Span& span : spans) jobs.push_back(SharedJob::submit("decompress", [&, span] { inflate(span); }));
+    for (auto& job : jobs) job->wait(); // runs any block no worker has started
+    return ok;
+}
+
+// Writes a snapshot through write(os), compressed if options ask for it
+bool write_snapshot_file(const std::string& filename, const SnapshotOptions& options,
+                         const std::function<void(std::ostream&)>& write) {
+    if (!options.compress) return write_file_atomically(filename, write);
+    return write_file_atomically(filename, [&](std::ostream& os) {
+        os << kCompressedSnapshotMagic;
+        SnapshotCompressor compressor(os, options);
+        write(compressor.stream());
+        compressor.finish();
+    });
+}
+
+// Reads a snapshot file, decompressing it if needed; nullopt (logged) if it
+// cannot be read or is corrupt
+std::optional<std::string> read_snapshot_file(const std::string& filename) {
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs) {
+        Logger::error("Could not open file: " + filename);
+        return std::nullopt;
+    }
+    std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    if (data.compare(0, kCompressedSnapshotMagic.size(), kCompressedSnapshotMagic) != 0) return data;
+    std::string raw;
+    if (!inflate_snapshot(data, raw)) {
+        Logger::error("Corrupt or unrecognized data file: " + filename);
+        return std::nullopt;
+    }
+    return raw;
+}
+
+// ========== Backing stores ==========
+// A store can run as a cache in front of a slower source of truth. Reads
+// that miss locally go to the backing store (read-through) and writes are
+// queued and sent to it in batches by a flusher thread (write-behind).
+class BackingStore {
+public:
+    virtual ~BackingStore() = default;
+    virtual const char* name() const = 0;
+    // nullopt if the key does not exist
+    virtual std::optional<std::string> load(const std::string& key) = 0;
+    // Applies writes in order, nullopt meaning delete; false if any failed
+    virtual bool store(const std::vector<std::pair<std::string, std::optional<std::string>>>& batch) = 0;
+};
+
+// One file per key in a directory, named by the key in hex so any key
+// works. latency is added to every load and every batch, to simulate a
+// remote source.
+class DirectoryBackingStore : public BackingStore {
+public:
+    explicit DirectoryBackingStore(std::string dir, std::chrono::microseconds latency = std::chrono::microseconds(0))
+        : dir_(std::move(dir)), latency_(latency) {
+        std::error_code ec;
+        std::filesystem::create_directories(dir_, ec);
+        if (ec) Logger::error("Could not create directory " + dir_ + ": " + ec.message());
+    }
+
+    const char* name() const override { return "directory"; }
+
+    std::optional<std::string> load(const std::string& key) override {
+        delay();
+        ++loads_;
+        std::ifstream ifs(path(key), std::ios::binary);
+        if (!ifs) return std::nullopt;
+        return std::string((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    }
+
+    bool store(const std::vector<std::pair<std::string, std::optional<std::string>>>& batch) override {
+        delay();
+        ++batches_;
+        bool ok = true;
+        for (const auto& [key, value] : batch) {
+            std::string file = path(key);
+            if (value) {
+                ok &= write_file_atomically(file, [&](std::ostream& os) { os.write(value->data(), static_cast<std::streamsize>(value->size())); });
+            } else {
+                std::error_code ec;
+                std::filesystem::remove(file, ec);
+                ok &= !ec;
+            }
+        }
+        return ok;
+    }
+
+    uint64_t loads() const { return loads_; }
+    uint64_t batches() const { return batches_; }
+
+private:
+    std::string path(const std::string& key) const {
+        static const char* digits = "0123456789abcdef";
+        std::string file = dir_ + "/k";
+        for (unsigned char c : key) {
+            file += digits[c >> 4];
+            file += digits[c & 15];
+        }
+        return file;
+    }
+
+    void delay() const {
+        if (latency_.count() > 0) std::this_thread::sleep_for(latency_);
+    }
+
+    const std::string dir_;
+    const std::chrono::microseconds latency_;
+    std::atomic<uint64_t> loads_{0};
+    std::atomic<uint64_t> batches_{0};
+};
+
+struct CacheOptions {
+    std::chrono::milliseconds negative_ttl{30000}; // how long a missing key is remembered; 0 = not at all
+    size_t max_negative = 65536;                   // remembered missing keys, over all stripes
+    size_t batch = 128;                            // writes per backing-store call
+    std::chrono::milliseconds flush_delay{50};     // writes wait up to this long to fill a batch
+};
+
+struct CacheStats {
+    uint64_t hits = 0;          // served by the local table
+    uint64_t misses = 0;        // went past the local table
+    uint64_t negative_hits = 0; // misses answered by the negative cache
+    uint64_t pending_hits = 0;  // misses answered by a queued write
+    uint64_t loads = 0;         // backing-store loads
+    uint64_t coalesced = 0;     // misses that waited for another thread's load
+    uint64_t load_us_total = 0;
+    uint64_t load_us_max = 0;
+    uint64_t queued = 0;        // writes not yet in the backing store
+    uint64_t written = 0;
+    uint64_t batches = 0;
+    uint64_t write_failures = 0; // failed batches; their writes are retried
+};
+
+// The read-through and write-behind state of one store. Per key, the queued
+// write, the load in flight and the negative entry live in one of several
+// stripes whose lock also covers the local write, so the local table and
+// the queue always agree on the order of writes to a key. Concurrent
+// misses on a key share one load; a write during a load keeps the loaded
+// (older) value out of the table. The flusher, a task on the background
+// pool that sleeps off the flush delay and yields between batches, sends
+// the newest queued value of each key, so repeated writes to a key between
+// flushes cost one write. flush() and the destructor drain on the caller.
+class BackingCache {
+public:
+    using Fill = std::function<void(const std::string& key, const std::string& value)>;
+
+    static constexpr size_t kStripes = 64;
+
+    // fill stores a loaded value in the local table without queuing it
+    BackingCache(std::shared_ptr<BackingStore> backing, CacheOptions options, Fill fill)
+        : backing_(std::move(backing)), options_(options), fill_(std::move(fill)) {
+        options_.batch = std::max<size_t>(options_.batch, 1);
+        flusher_ = std::make_shared<Flusher>();
+        flusher_->cache = this;
+    }
+
+    // Sends every queued write before returning, giving up on a batch the
+    // backing store refuses; a flush task still queued finds no cache
+    ~BackingCache() {
+        std::lock_guard<std::mutex> lock(flusher_->mutex);
+        flusher_->cache = nullptr;
+        drain_all();
+    }
+
+    BackingCache(const BackingCache&) = delete;
+    BackingCache& operator=(const BackingCache&) = delete;
+
+    const BackingStore& backing() const { return *backing_; }
+
+    void count_hit() { hits_.add(); }
+
+    // Answers a local miss from the write queue, the negative cache, a load
+    // in flight, or a new load
+    std::optional<std::string> read_through(const std::string& key) {
+        misses_.add();
+        Stripe& stripe = stripe_of(key);
+        std::unique_lock<std::mutex> lock(stripe.mutex);
+        if (auto it = stripe.dirty.find(key); it != stripe.dirty.end()) {
+            ++pending_hits_;
+            return it->second.value;
+        }
+        if (auto it = stripe.absent.find(key); it != stripe.absent.end()) {
+            if (std::chrono::steady_clock::now() < it->second) {
+                ++negative_hits_;
+                return std::nullopt;
+            }
+            stripe.absent.erase(it);
+        }
+        if (auto it = stripe.loading.find(key); it != stripe.loading.end()) {
+            auto result = it->second->result;
+            lock.unlock();
+            ++coalesced_;
+            return result.get();
+        }
+
+        std::promise<std::optional<std::string>> promise;
+        auto load = std::make_shared<Load>();
+        load->result = promise.get_future().share();
+        stripe.loading[key] = load;
+        lock.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        std::optional<std::string> value = backing_->load(key);
+        record_load(std::chrono::steady_clock::now() - start);
+
+        lock.lock();
+        stripe.loading.erase(key);
+        if (!load->stale) {
+            if (value) fill_(key, *value);
+            else remember_absent_locked(stripe, key);
+        }
+        lock.unlock();
+        promise.set_value(value);
+        return value;
+    }
+
+    // Runs local_write() and, if it returns true, queues value (nullopt =
+    // delete) for the backing store
+    template <typename F>
+    bool write(const std::string& key, std::optional<std::string> value, F&& local_write) {
+        Stripe& stripe = stripe_of(key);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        if (auto it = stripe.loading.find(key); it != stripe.loading.end()) it->second->stale = true;
+        stripe.absent.erase(key);
+        if (!local_write()) return false;
+        auto [it, added] = stripe.dirty.try_emplace(key);
+        it->second.value = std::move(value);
+        it->second.seq = ++next_seq_;
+        if (added) {
+            std::lock_guard<std::mutex> queue_lock(queue_mutex_);
+            if (queued_++ == 0) due_ = std::chrono::steady_clock::now() + options_.flush_delay;
+            // A full batch wakes a flusher that sleeps off the delay
+            if (tasks_ == 0 || (napping_ && queued_ == options_.batch)) {
+                ++tasks_;
+                napping_ = false;
+                schedule_flush();
+            }
+        }
+        return true;
+    }
+
+    // Sends every queued write to the backing store on the calling thread;
+    // false if a batch failed on the way (it stays queued and is retried)
+    bool flush() {
+        std::lock_guard<std::mutex> lock(flusher_->mutex);
+        return drain_all();
+    }
+
+    CacheStats stats() const {
+        CacheStats out;
+        out.hits = hits_.load();
+        out.misses = misses_.load();
+        out.negative_hits = negative_hits_;
+        out.pending_hits = pending_hits_;
+        out.loads = loads_;
+        out.coalesced = coalesced_;
+        out.load_us_total = load_us_total_;
+        out.load_us_max = load_us_max_;
+        out.written = written_;
+        out.batches = batches_;
+        out.write_failures = write_failures_;
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        out.queued = queued_;
+        return out;
+    }
+
+private:
+    struct Load {
+        std::shared_future<std::optional<std::string>> result;
+        bool stale = false; // written meanwhile; the result must not be cached
+    };
+
+    struct Queued {
+        std::optional<std::string> value;
+        uint64_t seq = 0;
+    };
+
+    struct Stripe {
+        std::mutex mutex;
+        std::unordered_map<std::string, Queued> dirty;
+        std::unordered_map<std::string, std::shared_ptr<Load>> loading;
+        std::unordered_map<std::string, std::chrono::steady_clock::time_point> absent; // key -> expiry
+    };
+
+    Stripe& stripe_of(const std::string& key) { return stripes_[fast_hash(key) % kStripes]; }
+
+    void remember_absent_locked(Stripe& stripe, const std::string& key) {
+        if (options_.negative_ttl.count() <= 0) return;
+        if (stripe.absent.size() >= std::max<size_t>(1, options_.max_negative / kStripes)) {
+            stripe.absent.erase(stripe.absent.begin());
+        }
+        stripe.absent[key] = std::chrono::steady_clock::now() + options_.negative_ttl;
+    }
+
+    void record_load(std::chrono::steady_clock::duration elapsed) {
+        uint64_t us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+        ++loads_;
+        load_us_total_ += us;
+        uint64_t max = load_us_max_.load();
+        while (us > max && !load_us_max_.compare_exchange_weak(max, us)) {
+        }
+    }
+
+    // The flush task's way to the cache; cache is null once it is destroyed.
+    // mutex is held while a slice, flush() or the destructor sends writes.
+    struct Flusher {
+        std::mutex mutex;
+        BackingCache* cache = nullptr;
+    };
+
+    void schedule_flush() {
+        background_tasks().submit(
+            "cache flush",
+            [flusher = flusher_, delay = options_.flush_delay](TaskContext& context) {
+                std::unique_lock<std::mutex> lock(flusher->mutex, std::try_to_lock);
+                if (!lock) { // flush() is draining on its caller
+                    context.resume_after(delay);
+                    return TaskStatus::Yield;
+                }
+                return flusher->cache ? flusher->cache->flush_slice(context) : TaskStatus::Done;
+            },
+            TaskPriority::Low);
+    }
+
+    // One slice of the flush task: sleeps until a partial batch is due (or
+    // a failed batch may be retried), then sends writes until the slice is
+    // used up. Finishes once nothing is queued.
+    TaskStatus flush_slice(TaskContext& context) {
+        if (context.stopping()) { // a yield would be dropped
+            drain_all();
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            --tasks_;
+            return TaskStatus::Done;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            napping_ = false;
+            if (queued_ == 0) {
+                --tasks_;
+                return TaskStatus::Done;
+            }
+            const auto now = std::chrono::steady_clock::now();
+            const auto wake = now < retry_at_ ? retry_at_ : queued_ < options_.batch && now < due_ ? due_ : now;
+            if (wake > now) {
+                if (tasks_ > 1) { // another flusher is around
+                    --tasks_;
+                    return TaskStatus::Done;
+                }
+                napping_ = true;
+                context.resume_after(wake - now);
+                return TaskStatus::Yield;
+            }
+        }
+        if (drain_step(&context) && !pass_ok_) {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            retry_at_ = std::chrono::steady_clock::now() + options_.flush_delay; // back off
+        }
+        return TaskStatus::Yield;
+    }
+
+    // Finishes the pass in progress, then passes over every stripe until
+    // nothing is queued; false if a batch failed
+    bool drain_all() {
+        while (true) {
+            while (!drain_step(nullptr)) {
+            }
+            if (!pass_ok_) return false;
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            if (queued_ == 0) return true;
+        }
+    }
+
+    struct Write {
+        std::string key;
+        std::optional<std::string> value;
+        uint64_t seq;
+    };
+
+    // Sends the queued writes of the stripes from next_stripe_ on, batch by
+    // batch, stopping early once context's slice is used up. True at the end
+    // of a pass, with pass_ok_ false if a batch of it failed.
+    bool drain_step(const TaskContext* context) {
+        if (next_stripe_ == 0) pass_ok_ = true;
+        std::vector<Write> batch;
+        while (next_stripe_ < kStripes) {
+            {
+                Stripe& stripe = stripes_[next_stripe_++];
+                std::lock_guard<std::mutex> lock(stripe.mutex);
+                for (const auto& [key, queued] : stripe.dirty) batch.push_back({key, queued.value, queued.seq});
+            }
+            while (batch.size() >= options_.batch) {
+                std::vector<Write> rest(batch.begin() + static_cast<std::ptrdiff_t>(options_.batch), batch.end());
+                batch.resize(options_.batch);
+                pass_ok_ &= send(batch);
+                batch = std::move(rest);
+            }
+            if (context && context->should_yield()) break;
+        }
+        if (!batch.empty()) pass_ok_ &= send(batch);
+        if (next_stripe_ < kStripes) return false;
+        next_stripe_ = 0;
+        return true;
+    }
+
+    bool send(const std::vector<Write>& batch) {
+        std::vector<std::pair<std::string, std::optional<std::string>>> writes;
+        writes.reserve(batch.size());
+        for (const Write& w : batch) writes.emplace_back(w.key, w.value);
+        ++batches_;
+        if (!backing_->store(writes)) {
+            ++write_failures_;
+            return false;
+        }
+        written_ += batch.size();
+        size_t done = 0;
+        for (const Write& w : batch) {
+            Stripe& stripe = stripe_of(w.key);
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+            auto it = stripe.dirty.find(w.key);
+            if (it != stripe.dirty.end() && it->second.seq == w.seq) { // not rewritten meanwhile
+                stripe.dirty.erase(it);
+                if (!w.value) remember_absent_locked(stripe, w.key); // deleted: known to be missing
+                ++done;
+            }
+        }
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        queued_ -= done;
+        return true;
+    }
+
+    std::shared_ptr<BackingStore> backing_;
+    CacheOptions options_;
+    Fill fill_;
+    std::array<Stripe, kStripes> stripes_;
+    std::atomic<uint64_t> next_seq_{0};
+
+    StripedCounter hits_;
+    StripedCounter misses_;
+    std::atomic<uint64_t> negative_hits_{0};
+    std::atomic<uint64_t> pending_hits_{0};
+    std::atomic<uint64_t> loads_{0};
+    std::atomic<uint64_t> coalesced_{0};
+    std::atomic<uint64_t> load_us_total_{0};
+    std::atomic<uint64_t> load_us_max_{0};
+    std::atomic<uint64_t> written_{0};
+    std::atomic<uint64_t> batches_{0};
+    std::atomic<uint64_t> write_failures_{0};
+
+    std::shared_ptr<Flusher> flusher_;
+    size_t next_stripe_ = 0; // where the pass in progress goes on; under flusher_->mutex
+    bool pass_ok_ = true;
+
+    mutable std::mutex queue_mutex_; // guards the fields below
+    size_t queued_ = 0;              // keys with a queued write
+    size_t tasks_ = 0;               // flush tasks submitted and not finished
+    bool napping_ = false;           // a flush task sleeps until wake-up time
+    std::chrono::steady_clock::time_point due_;      // a partial batch goes out then
+    std::chrono::steady_clock::time_point retry_at_; // no sends before then after a failure
+};
+
+// ========== Store locks ==========
+// Store critical sections are short (a hash lookup and a copy). std::mutex
+// parks a waiter at once under contention and the futex wake-up then costs
+// more than the section itself, so these locks spin first and park only
+// when the holder stays longer than spinning usually takes.
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Waits while word == expected; may return spuriously, callers recheck
+inline void futex_wait(std::atomic<uint32_t>& word, uint32_t expected) {
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex needs a plain 32-bit word");
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+    if (word.load() == expected) std::this_thread::yield();
+#endif
+}
+
+inline void futex_wake(std::atomic<uint32_t>& word, int count) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#else
+    (void)word;
+    (void)count;
+#endif
+}
+
+// Spinning only helps if the holder can run meanwhile
+inline bool spinning_pays() {
+    static const bool multi_cpu = std::thread::hardware_concurrency() > 1;
+    return multi_cpu;
+}
+
+// Spins for about as long as recent acquisitions needed, then parks on a
+// futex. The estimate moves 1/8 of the way toward the spins an acquisition
+// took, or toward zero when spinning ran out and the thread had to park.
+// State: 0 free, 1 held, 2 held and waiters may be parked.
+class AdaptiveMutex {
+public:
+    static constexpr int kMinSpins = 16;
+    static constexpr int kMaxSpins = 4000;
+
+    void lock() {
+        if (try_lock()) return;
+        if (spinning_pays()) {
+            const int limit = std::min(kMaxSpins, 2 * spin_estimate_.load(std::memory_order_relaxed) + kMinSpins);
+            for (int i = 0; i < limit; ++i) {
+                cpu_relax();
+                if (state_.load(std::memory_order_relaxed) == 0 && try_lock()) {
+                    adapt(i);
+                    return;
+                }
+            }
+            adapt(0);
+        }
+        parks_.fetch_add(1, std::memory_order_relaxed);
+        while (state_.exchange(2, std::memory_order_acquire) != 0) futex_wait(state_, 2);
+    }
+
+    bool try_lock() {
+        uint32_t expected = 0;
+        return state_.compare_exchange_strong(expected, 1, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    void unlock() {
+        if (state_.exchange(0, std::memory_order_release) == 2) futex_wake(state_, 1);
+    }
+
+    int spin_estimate() const { return spin_estimate_.load(std::memory_order_relaxed); }
+    uint64_t parks() const { return parks_.load(std::memory_order_relaxed); }
+
+private:
+    void adapt(int spins) {
+        int estimate = spin_estimate_.load(std::memory_order_relaxed);
+        spin_estimate_.store(estimate + (spins - estimate) / 8, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint32_t> state_{0};
+    std::atomic<int> spin_estimate_{100};
+    std::atomic<uint64_t> parks_{0};
+};
+
+// FIFO version: threads take a ticket and get the lock in ticket order, so
+// no waiter starves. Waiters spin while they are next in line and park on
+// the serving counter otherwise; unlock wakes all parked waiters and the
+// one whose turn it is proceeds.
+class TicketMutex {
+public:
+    static constexpr int kSpins = 2000;
+
+    void lock() {
+        const uint32_t ticket = next_.fetch_add(1, std::memory_order_relaxed);
+        for (int i = 0;; ++i) {
+            uint32_t serving = serving_.load(std::memory_order_acquire);
+            if (serving == ticket) return;
+            if (spinning_pays() && ticket - serving == 1 && i < kSpins) {
+                cpu_relax();
+                continue;
+            }
+            waiters_.fetch_add(1, std::memory_order_seq_cst);
+            if (serving_.load(std::memory_order_seq_cst) == serving) futex_wait(serving_, serving);
+            waiters_.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    bool try_lock() {
+        uint32_t serving = serving_.load(std::memory_order_acquire);
+        uint32_t expected = serving;
+        return next_.compare_exchange_strong(expected, serving + 1, std::memory_order_acquire,
+                                             std::memory_order_relaxed);
+    }
+
+    void unlock() {
+        serving_.fetch_add(1, std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_seq_cst) > 0) futex_wake(serving_, INT_MAX);
+    }
+
+private:
+    alignas(64) std::atomic<uint32_t> next_{0};
+    alignas(64) std::atomic<uint32_t> serving_{0};
+    std::atomic<uint32_t> waiters_{0};
+};
+
+// Which lock a locked-backend store uses
+enum class LockPolicy { Mutex, Adaptive, Ticket };
+
+const char* lock_policy_name(LockPolicy policy) {
+    switch (policy) {
+        case LockPolicy::Mutex: return "mutex";
+        case LockPolicy::Adaptive: return "adaptive";
+        case LockPolicy::Ticket: return "ticket";
+    }
+    return "unknown";
+}
+
+std::optional<LockPolicy> parse_lock_policy(const std::string& name) {
+    for (auto policy : {LockPolicy::Mutex, LockPolicy::Adaptive, LockPolicy::Ticket}) {
+        if (name == lock_policy_name(policy)) return policy;
+    }
+    return std::nullopt;
+}
+
+// The store's lock; the policy is fixed at construction
+class StoreLock {
+public:
+    explicit StoreLock(LockPolicy policy = LockPolicy::Mutex) : policy_(policy) {}
+
+    void lock() {
+        switch (policy_) {
+            case LockPolicy::Mutex: mutex_.lock(); break;
+            case LockPolicy::Adaptive: adaptive_.lock(); break;
+            case LockPolicy::Ticket: ticket_.lock(); break;
+        }
+    }
+
+    bool try_lock() {
+        switch (policy_) {
+            case LockPolicy::Mutex: return mutex_.try_lock();
+            case LockPolicy::Adaptive: return adaptive_.try_lock();
+            case LockPolicy::Ticket: return ticket_.try_lock();
+        }
+        return false;
+    }
+
+    void unlock() {
+        switch (policy_) {
+            case LockPolicy::Mutex: mutex_.unlock(); break;
+            case LockPolicy::Adaptive: adaptive_.unlock(); break;
+            case LockPolicy::Ticket: ticket_.unlock(); break;
+        }
+    }
+
+    LockPolicy policy() const { return policy_; }
+
+private:
+    const LockPolicy policy_;
+    std::mutex mutex_;
+    AdaptiveMutex adaptive_;
+    TicketMutex ticket_;
+};
+
+// ========== KeyValueStore ==========
+// What a store does when a write arrives while it is over its memory quota
+enum class EvictionPolicy { NoEviction, AllKeysLRU, AllKeysRandom };
+
+const char* eviction_policy_name(EvictionPolicy policy) {
+    switch (policy) {
+        case EvictionPolicy::NoEviction: return "noeviction";
+        case EvictionPolicy::AllKeysLRU: return "allkeys-lru";
+        case EvictionPolicy::AllKeysRandom: return "allkeys-random";
+    }
+    return "unknown";
+}
+
+std::optional<EvictionPolicy> parse_eviction_policy(const std::string& name) {
+    for (auto policy : {EvictionPolicy::NoEviction, EvictionPolicy::AllKeysLRU, EvictionPolicy::AllKeysRandom}) {
+        if (name == eviction_policy_name(policy)) return policy;
+    }
+    return std::nullopt;
+}
+
+struct StoreStats {
+    size_t keys = 0;
+    size_t used_bytes = 0;
+    size_t quota_bytes = 0; // 0 means unlimited
+    EvictionPolicy policy = EvictionPolicy::NoEviction;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t writes = 0;
+    uint64_t deletes = 0;
+    uint64_t evictions = 0;
+    uint64_t rejected_writes = 0;
+    uint64_t combined_ops = 0;    // writes applied by flat combining
+    uint64_t combining_passes = 0; // lock acquisitions that applied them
+    uint64_t lazy_frees = 0;       // tables and values handed to the background to free
+};
+
+// Table behind a store. Locked is an unordered_map under the store mutex and
+// supports everything; the concurrent backends serve plain reads and writes
+// without a store-wide lock, but not operations that need several steps to
+// be atomic together (scripts, indexes, quotas, HLL and Bloom updates).
+enum class Backend { Locked, LockFree, Cuckoo, Prefix };
+
+const char* backend_name(Backend backend) {
+    switch (backend) {
+        case Backend::Locked: return "locked";
+        case Backend::LockFree: return "lockfree";
+        case Backend::Cuckoo: return "cuckoo";
+        case Backend::Prefix: return "prefix";
+    }
+    return "unknown";
+}
+
+std::optional<Backend> parse_backend(const std::string& name) {
+    for (auto backend : {Backend::Locked, Backend::LockFree, Backend::Cuckoo, Backend::Prefix}) {
+        if (name == backend_name(backend)) return backend;
+    }
+    return std::nullopt;
+}
+
+// A delete_prefix / delete_pattern running on the background pool
+struct BulkDeleteProgress {
+    uint64_t scanned = 0;
+    uint64_t deleted = 0;
+    bool done = false;
+    bool cancelled = false; // stopped early; what was deleted stays deleted
+    std::chrono::milliseconds elapsed{0};
+};
+
+class BulkDeleteJob {
+public:
+    // Every key match accepts starts with prefix
+    BulkDeleteJob(std::string description, std::function<bool(const std::string&)> match, std::string prefix = "")
+        : description_(std::move(description)), match_(std::move(match)), prefix_(std::move(prefix)) {}
+
+    const std::string& description() const { return description_; }
+
+    BulkDeleteProgress progress() const {
+        BulkDeleteProgress out;
+        out.scanned = scanned_;
+        out.deleted = deleted_;
+        std::lock_guard<std::mutex> lock(mutex_);
+        out.done = done_;
+        out.cancelled = cancelled_;
+        out.elapsed = done_ ? elapsed_
+                            : std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_);
+        return out;
+    }
+
+    // True once the job has finished, waiting up to timeout for it
+    bool wait_for(std::chrono::milliseconds timeout) const {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return finished_.wait_for(lock, timeout, [&] { return done_; });
+    }
+
+    BulkDeleteProgress wait() const {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            finished_.wait(lock, [&] { return done_; });
+        }
+        return progress();
+    }
+
+    // Stops the job before its next batch
+    void cancel() {
+        std::lock_guard<std::mutex> lock(run_mutex_);
+        cancel_ = true;
+    }
+
+private:
+    friend class KeyValueStore;
+
+    void finish(bool cancelled) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        cancelled_ = cancelled;
+        elapsed_ = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_);
+        finished_.notify_all();
+    }
+
+    const std::string description_;
+    const std::function<bool(const std::string&)> match_;
+    const std::string prefix_;
+    const std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+    std::atomic<uint64_t> scanned_{0};
+    std::atomic<uint64_t> deleted_{0};
+
+    // Walk state, touched only by the running step under run_mutex_
+    std::mutex run_mutex_;
+    bool cancel_ = false;
+    size_t cursor_ = 0;       // next bucket (locked backend)
+    size_t bucket_count_ = 0; // when the walk (re)started; a rehash restarts it
+    uint64_t image_generation_ = 0; // image being walked; a newly loaded one starts over
+    uint64_t image_offset_ = 0;     // next image record
+    TableCursor walk_;        // concurrent backends
+
+    mutable std::mutex mutex_;
+    mutable std::condition_variable finished_;
+    bool done_ = false;
+    bool cancelled_ = false;
+    std::chrono::milliseconds elapsed_{0};
+};
+
+// Provides thread-safe key-value storage
+class KeyValueStore {
+public:
+    // Approximate per-entry bookkeeping cost (hash node, string headers)
+    // added to key and value bytes for memory accounting
+    static constexpr size_t kEntryOverhead = 64;
+    static constexpr size_t kEvictionSamples = 5;
+
+    using Table = std::unordered_map<std::string, Value, KeyHash>;
+
+    KeyValueStore() = default;
+    // lock picks the lock the locked backend takes around every operation
+    explicit KeyValueStore(Backend backend, LockPolicy lock = LockPolicy::Mutex) : backend_(backend), mutex_(lock) {
+        if (backend == Backend::LockFree) concurrent_ = std::make_unique<LockFreeHashMap>();
+        if (backend == Backend::Cuckoo) concurrent_ = std::make_unique<CuckooHashMap>();
+        if (backend == Backend::Prefix) concurrent_ = std::make_unique<FrontCodedTable>();
+    }
+
+    // Bulk deletes refer to the store; stop them (at most one slice each)
+    ~KeyValueStore() {
+        std::lock_guard<std::mutex> lock(jobs_mutex_);
+        for (const auto& weak : jobs_) {
+            if (auto job = weak.lock()) job->cancel();
+        }
+    }
+
+    KeyValueStore(const KeyValueStore&) = delete;
+    KeyValueStore& operator=(const KeyValueStore&) = delete;
+
+    Backend backend() const { return backend_; }
+    LockPolicy lock_policy() const { return mutex_.policy(); }
+
+    // Returns false if the write was rejected because the store is over its
+    // quota and the policy is noeviction
+    bool set(const std::string& key, const std::string& value) {
+        if (!with_cache([&](BackingCache* cache) {
+                return cache ? cache->write(key, value, [&] { return set_local(key, value); }) : set_local(key, value);
+            })) {
+            return false;
+        }
+        Logger::info("Set: {" + format_value(key) + ": " + preview(value) + "}");
+        return true;
+    }
+
+    std::optional<std::string> get(const std::string& key) const {
+        return with_cache([&](BackingCache* cache) {
+            auto value = get_local(key);
+            if (!cache) return value;
+            if (!value) return cache->read_through(key);
+            cache->count_hit();
+            return value;
+        });
+    }
+
+    // The value in this store's own table, never read through
+    std::optional<std::string> get_local(const std::string& key) const {
+        // The version is read before the table, so a write racing with this
+        // read bumps it past the stamp we cache under
+        NearSlot near;
+        if (near_cache_.load(std::memory_order_acquire)) {
+            near = near_slot(key);
+            if (auto hit = near_lookup(near, key)) return hit;
+        }
+        std::vector<Chunk> chunks;
+        if (concurrent_) {
+            auto v = concurrent_->find(key);
+            if (!v) return std::nullopt;
+            if (std::string* s = v->inline_string()) {
+                near_fill(near, key, *s);
+                return std::move(*s);
+            }
+            chunks = v->chunks();
+        } else {
+            std::lock_guard<StoreLock> lock(mutex_);
+            auto it = store_.find(key);
+            if (it == store_.end()) {
+                auto imaged = image_find_locked(key); // served from the mapping, not moved
+                ++(imaged ? stats_.hits : stats_.misses);
+                if (!imaged) return std::nullopt;
+                std::string value(*imaged);
+                near_fill(near, key, value);
+                return value;
+            }
+            ++stats_.hits;
+            it->second.last_access = ++clock_;
+            if (const std::string* s = it->second.inline_string()) {
+                near_fill(near, key, *s);
+                return *s;
+            }
+            chunks = it->second.chunks();
+        }
+        // Large values are flattened after releasing the lock
+        return ValueReader(std::move(chunks)).read(SIZE_MAX);
+    }
+
+    void remove(const std::string& key) {
+        with_cache([&](BackingCache* cache) {
+            if (!cache) {
+                remove_local(key);
+                return;
+            }
+            cache->write(key, std::nullopt, [&] {
+                remove_local(key);
+                return true;
+            });
+        });
+        Logger::info("Removed key: " + format_value(key));
+    }
+
+    void print_all() const {
+        std::lock_guard<StoreLock> lock(mutex_);
+        std::cout << "\n[STORE DUMP]\n";
+        for_each_locked([](const std::string& key, const Value& value) {
+            std::cout << "- " << format_value(key) << ": " << format_value(value.str()) << "\n";
+        });
+        std::cout << std::endl;
+    }
+
+    bool exists(const std::string& key) const {
+        if (cache_.load(std::memory_order_acquire)) return get(key).has_value();
+        if (concurrent_) return concurrent_->contains(key);
+        std::lock_guard<StoreLock> lock(mutex_);
+        return store_.find(key) != store_.end() || image_find_locked(key);
+    }
+
+    // O(1) under the lock with lazy free on: the old table is swapped out
+    // and freed in the background
+    void clear() {
+        std::lock_guard<StoreLock> lock(mutex_);
+        if (concurrent_) concurrent_->clear();
+        dispose_locked(take_table_locked());
+        bump_all_versions();
+        Logger::info("Store cleared");
+    }
+
+    // ----- Bulk delete -----
+    // Deletes every key with a prefix, or matching a glob pattern, as a
+    // background job. The locked table (and a loaded image, record by
+    // record) is walked with the lock held for at most kBulkDeleteBatch
+    // entries at a time, and the deleted entries are freed lazily; the
+    // concurrent backends are walked in steps of about kBulkDeleteBatch
+    // entries (ConcurrentTable::walk_step), each step's matches erased
+    // before the next. Keys written while the job runs may or may not be
+    // deleted. The prefix backend is ordered, so
+    // there a prefix (or a pattern's literal start) only walks its own keys;
+    // elsewhere it costs a full walk. nullptr in cache mode.
+    static constexpr size_t kBulkDeleteBatch = 512;
+
+    std::shared_ptr<BulkDeleteJob> delete_prefix(const std::string& prefix) {
+        return start_bulk_delete("prefix " + format_value(prefix),
+                                 [prefix](const std::string& key) { return key.compare(0, prefix.size(), prefix) == 0; },
+                                 prefix);
+    }
+
+    std::shared_ptr<BulkDeleteJob> delete_pattern(const std::string& pattern) {
+        return start_bulk_delete("pattern " + format_value(pattern),
+                                 [pattern](const std::string& key) { return glob_match(pattern, key); },
+                                 pattern.substr(0, pattern.find_first_of("*?[\\")));
+    }
+
+    // ----- Lazy free -----
+    // With lazy free on (the default), clear, load and whole-store
+    // replacement swap out the old table, and remove/overwrite hand values
+    // of kLazyFreeBytes or more to a background worker, so the time the
+    // lock is held no longer grows with the data being dropped. Off frees
+    // everything in place, under the lock. The concurrent backends free
+    // their entries through their own reclamation.
+    static constexpr size_t kLazyFreeBytes = 64 << 10;
+    static constexpr size_t kLazyFreeEntries = 64; // smaller tables are freed in place
+
+    void set_lazy_free(bool on) {
+        lazy_free_.store(on, std::memory_order_relaxed);
+        Logger::info(std::string("Lazy free ") + (on ? "enabled" : "disabled"));
+    }
+
+    bool lazy_free() const { return lazy_free_.load(std::memory_order_relaxed); }
+
+    // ----- Key hashing -----
+    // Picks the hash that places keys in the table (see HashKind). Switching
+    // rehashes every entry under the lock, so it is meant to be set up front.
+    // The concurrent backends always use the seeded fast hash.
+    void set_hash(HashKind kind) {
+        std::lock_guard<StoreLock> lock(mutex_);
+        if (store_.hash_function().kind == kind) return;
+        Table rehashed(store_.bucket_count(), KeyHash{kind});
+        rehashed.max_load_factor(store_.max_load_factor());
+        move_entries(store_, rehashed);
+        store_.swap(rehashed);
+        hash_kind_.store(kind, std::memory_order_relaxed);
+        Logger::info(std::string("Key hash set to ") + hash_kind_name(kind));
+    }
+
+    HashKind hash_kind() const { return hash_kind_.load(std::memory_order_relaxed); }
+
+    // ----- Key handles -----
+    // The same operations on a KeyHandle: the table (when the handle was made
+    // for this store's hash_kind()), the concurrent backends, version shards
+    // and the near cache use its stored hashes instead of rehashing the key
+    bool set(const KeyHandle& key, const std::string& value) {
+        KeyHandle::Scope scope(key);
+        return set(key.key(), value);
+    }
+    std::optional<std::string> get(const KeyHandle& key) const {
+        KeyHandle::Scope scope(key);
+        return get(key.key());
+    }
+    void remove(const KeyHandle& key) {
+        KeyHandle::Scope scope(key);
+        remove(key.key());
+    }
+    bool exists(const KeyHandle& key) const {
+        KeyHandle::Scope scope(key);
+        return exists(key.key());
+    }
+    std::optional<long long> incr(const KeyHandle& key, long long delta = 1) {
+        KeyHandle::Scope scope(key);
+        return incr(key.key(), delta);
+    }
+    std::optional<size_t> append(const KeyHandle& key, const std::string& data) {
+        KeyHandle::Scope scope(key);
+        return append(key.key(), data);
+    }
+    std::optional<std::string> getrange(const KeyHandle& key, long long start, long long end) const {
+        KeyHandle::Scope scope(key);
+        return getrange(key.key(), start, end);
+    }
+    std::optional<size_t> strlen(const KeyHandle& key) const {
+        KeyHandle::Scope scope(key);
+        return strlen(key.key());
+    }
+    bool pfadd(const KeyHandle& key, const std::vector<std::string>& elements) {
+        KeyHandle::Scope scope(key);
+        return pfadd(key.key(), elements);
+    }
+    bool bfadd(const KeyHandle& key, const std::string& item) {
+        KeyHandle::Scope scope(key);
+        return bfadd(key.key(), item);
+    }
+    bool bfexists(const KeyHandle& key, const std::string& item) const {
+        KeyHandle::Scope scope(key);
+        return bfexists(key.key(), item);
+    }
+    std::optional<ValueReader> open_reader(const KeyHandle& key) const {
+        KeyHandle::Scope scope(key);
+        return open_reader(key.key());
+    }
+
+    // ----- Cache mode -----
+    // Puts this store in front of backing: get reads through on a miss and
+    // set/remove are written behind (see BackingCache). Commands that modify
+    // a value in place (incr, append, HyperLogLog, Bloom, scripts, streamed
+    // writes) are refused in cache mode; clear and load only affect the
+    // cached copies. nullptr sends the queued writes and leaves cache mode.
+    // Switch while the store is idle: a write racing with the switch may
+    // not reach the backing store. The old cache is retired through
+    // EpochReclaimer, since readers may still hold it.
+    void set_backing_store(std::shared_ptr<BackingStore> backing, CacheOptions options = {}) {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        if (cache_storage_) {
+            cache_.store(nullptr, std::memory_order_release);
+            cache_storage_->flush();
+            EpochReclaimer::instance().retire(cache_storage_.release());
+            EpochReclaimer::instance().reclaim();
+        }
+        if (!backing) return;
+        const char* name = backing->name();
+        cache_storage_ = std::make_unique<BackingCache>(
+            std::move(backing), options, [this](const std::string& key, const std::string& value) { fill_local(key, value); });
+        cache_.store(cache_storage_.get(), std::memory_order_release);
+        Logger::info(std::string("Cache mode on over the ") + name + " backing store");
+    }
+
+    bool cache_mode() const { return cache_.load(std::memory_order_acquire) != nullptr; }
+
+    // Waits for queued writes to reach the backing store; false if one failed
+    bool flush_backing() {
+        return with_cache([](BackingCache* cache) { return !cache || cache->flush(); });
+    }
+
+    std::optional<CacheStats> cache_stats() const {
+        return with_cache([](BackingCache* cache) -> std::optional<CacheStats> {
+            if (!cache) return std::nullopt;
+            return cache->stats();
+        });
+    }
+
+    // ----- Memory quota -----
+    // Limits this store to max_bytes (0 = unlimited). Before each write, a
+    // store over its quota evicts keys per policy, or with noeviction rejects
+    // the write. Deletes are always allowed.
+    void set_quota(size_t max_bytes, EvictionPolicy policy) {
+        if (unsupported_on_concurrent("quota")) return;
+        std::lock_guard<StoreLock> lock(mutex_);
+        materialize_image_locked(); // eviction samples the live table
+        stats_.quota_bytes = max_bytes;
+        stats_.policy = policy;
+        Logger::info("Quota set to " + std::to_string(max_bytes) + " bytes (" + eviction_policy_name(policy) + ")");
+    }
+
+    // ----- Flat combining -----
+    // With combining on, set and remove publish themselves in a slot and
+    // whichever writer gets the lock applies every published operation in
+    // one pass, so a burst of writers costs one lock handoff instead of one
+    // each. Only for the locked backend.
+    bool set_flat_combining(bool on) {
+        if (unsupported_on_concurrent("combining")) return false;
+        std::lock_guard<StoreLock> lock(mutex_);
+        if (on && !combining_slots_) combining_slots_.reset(new CombiningSlot[kCombiningSlots]);
+        flat_combining_.store(on, std::memory_order_release);
+        Logger::info(std::string("Flat combining ") + (on ? "enabled" : "disabled"));
+        return true;
+    }
+
+    bool flat_combining() const { return flat_combining_.load(std::memory_order_acquire); }
+
+    // ----- Near cache -----
+    // With the near cache on, get first looks in a small direct-mapped table
+    // private to the calling thread, so hot keys are served without the lock
+    // or the shared table. Entries are stamped with the version of their
+    // key's shard and every write bumps that version, so stale entries just
+    // miss. Near hits do not count as accesses for LRU eviction or stats.
+    static constexpr size_t kNearCacheSlots = 4096;
+    static constexpr size_t kNearCacheMaxValue = 4096; // larger values are not cached
+    static constexpr size_t kVersionShards = 1024;  // a write invalidates ~1/1024 of every thread's entries
+
+    struct NearCacheStats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
+
+    void set_near_cache(bool on) {
+        std::lock_guard<StoreLock> lock(mutex_);
+        if (on && !version_storage_) {
+            // Writers bump versions from here on, even if the cache is later
+            // turned off, so entries cached before that cannot come back stale
+            version_storage_.reset(new VersionShard[kVersionShards]);
+            versions_.store(version_storage_.get(), std::memory_order_release);
+        }
+        near_cache_.store(on, std::memory_order_release);
+        Logger::info(std::string("Near cache ") + (on ? "enabled" : "disabled"));
+    }
+
+    bool near_cache() const { return near_cache_.load(std::memory_order_acquire); }
+
+    // Number of changes (writes, removes, clears, loads) since creation; a
+    // clear or load counts once. Drives automatic snapshots.
+    uint64_t changes() const { return changes_.load(); }
+
+    // Near-cache hits and misses of the calling thread, over all stores
+    static NearCacheStats near_cache_stats() { return thread_near_cache().stats; }
+
+    StoreStats stats() const {
+        std::lock_guard<StoreLock> lock(mutex_);
+        StoreStats out = stats_;
+        out.keys = size_locked();
+        return out;
+    }
+
+    // ----- Counters -----
+    // Adds delta to the integer at key (a missing key counts as 0). Returns
+    // the new value, or nullopt if the value is not an integer or would overflow.
+    std::optional<long long> incr(const std::string& key, long long delta = 1) {
+        if (unsupported_in_cache_mode("incr")) return std::nullopt;
+        std::optional<long long> n;
+        if (concurrent_) {
+            concurrent_->update(key, [&](const Value* current) -> std::optional<Value> {
+                n = add_to_integer(current, delta);
+                if (!n) return std::nullopt;
+                return Value(std::to_string(*n));
+            });
+            bump_version(key);
+        } else {
+            std::lock_guard<StoreLock> lock(mutex_);
+            if (!admit_write_locked()) return std::nullopt;
+            n = incrby_locked(key, delta);
+        }
+        if (!n) Logger::error("Value is not an integer or out of range: " + format_value(key));
+        return n;
+    }
+
+    // ----- Scripts -----
+    static constexpr size_t kDefaultScriptBudget = 100000;
+
+    // Compiles and caches a script; returns its id, or nullopt on a compile error
+    std::optional<std::string> script_load(const std::string& source) {
+        auto script = cached_script(source);
+        if (!script) return std::nullopt;
+        return script->id;
+    }
+
+    // Runs a script atomically: no other operation on this store interleaves
+    // with it, and if it fails none of its writes remain
+    ScriptResult eval(const std::string& source, const std::vector<std::string>& args,
+                      size_t budget = kDefaultScriptBudget) {
+        auto script = cached_script(source);
+        if (!script) return ScriptResult{false, std::nullopt, "compile error", 0};
+        return run_atomically(*script, args, budget);
+    }
+
+    ScriptResult evalsha(const std::string& id, const std::vector<std::string>& args,
+                         size_t budget = kDefaultScriptBudget) {
+        std::shared_ptr<const Script> script;
+        {
+            std::lock_guard<std::mutex> lock(scripts_mutex_);
+            auto it = scripts_.find(id);
+            if (it != scripts_.end()) script = it->second;
+        }
+        if (!script) return ScriptResult{false, std::nullopt, "no script with id " + id, 0};
+        return run_atomically(*script, args, budget);
+    }
+
+    // ----- HyperLogLog -----
+    // Adds elements to the HLL at key (created if missing). Returns true if
+    // the estimate may have changed, false if nothing changed or key holds a
+    // non-HLL value.
+    bool pfadd(const std::string& key, const std::vector<std::string>& elements) {
+        if (unsupported_on_concurrent("pfadd") || unsupported_in_cache_mode("pfadd")) return false;
+        std::lock_guard<StoreLock> lock(mutex_);
+        if (!admit_write_locked()) return false;
+        auto it = find_locked(key);
+        if (it == store_.end()) {
+            assign_locked(key, HyperLogLog::create());
+            it = store_.find(key);
+        } else if (!is_hll(it->second)) {
+            Logger::error("Key does not hold a HyperLogLog: " + format_value(key));
+            return false;
+        }
+        bool changed = false;
+        modify_locked(it, [&](Value& v) {
+            for (const auto& element : elements) changed |= HyperLogLog::add(*v.inline_string(), element);
+        });
+        return changed;
+    }
+
+    // Estimated cardinality of the union of the HLLs at keys.
+    // Missing keys count as empty; nullopt if any key holds another type.
+    std::optional<uint64_t> pfcount(const std::vector<std::string>& keys) const {
+        if (unsupported_on_concurrent("pfcount")) return std::nullopt;
+        std::lock_guard<StoreLock> lock(mutex_);
+        std::string merged;
+        for (const auto& key : keys) {
+            std::optional<Value> scratch;
+            const Value* value = lookup_locked(key, scratch);
+            if (!value) continue;
+            if (!is_hll(*value)) {
+                Logger::error("Key does not hold a HyperLogLog: " + format_value(key));
+                return std::nullopt;
+            }
+            const std::string& hll = *value->inline_string();
+            if (keys.size() == 1) return HyperLogLog::count(hll);
+            if (merged.empty()) merged = HyperLogLog::to_dense(hll);
+            else HyperLogLog::merge_into(merged, hll);
+        }
+        return merged.empty() ? 0 : HyperLogLog::count(merged);
+    }
+
+    // Stores the union of dest and all sources into dest (dense encoding)
+    bool pfmerge(const std::string& dest, const std::vector<std::string>& sources) {
+        if (unsupported_on_concurrent("pfmerge") || unsupported_in_cache_mode("pfmerge")) return false;
+        std::lock_guard<StoreLock> lock(mutex_);
+        if (!admit_write_locked()) return false;
+        std::string merged = HyperLogLog::to_dense(HyperLogLog::create());
+        std::vector<std::string> keys = sources;
+        keys.push_back(dest);
+        for (const auto& key : keys) {
+            std::optional<Value> scratch;
+            const Value* value = lookup_locked(key, scratch);
+            if (!value) continue;
+            if (!is_hll(*value)) {
+                Logger::error("Key does not hold a HyperLogLog: " + format_value(key));
+                return false;
+            }
+            HyperLogLog::merge_into(merged, *value->inline_string());
+        }
+        assign_locked(dest, std::move(merged));
+        Logger::info("Merged HyperLogLogs into: " + format_value(dest));
+        return true;
+    }
+
+    // ----- Bloom filter -----
+    // Adds item to the scalable Bloom filter at key (created if missing).
+    // Returns true if the item was newly added.
+    bool bfadd(const std::string& key, const std::string& item) {
+        if (unsupported_on_concurrent("bfadd") || unsupported_in_cache_mode("bfadd")) return false;
+        std::lock_guard<StoreLock> lock(mutex_);
+        if (!admit_write_locked()) return false;
+        auto it = find_locked(key);
+        if (it == store_.end()) {
+            assign_locked(key, ScalableBloomFilter::create());
+            it = store_.find(key);
+        } else if (!is_bloom(it->second)) {
+            Logger::error("Key does not hold a Bloom filter: " + format_value(key));
+            return false;
+        }
+        bool added = false;
+        modify_locked(it, [&](Value& v) { added = ScalableBloomFilter::add(*v.inline_string(), item); });
+        return added;
+    }
+
+    // True if item was (probably) added to the Bloom filter at key
+    bool bfexists(const std::string& key, const std::string& item) const {
+        if (unsupported_on_concurrent("bfexists")) return false;
+        std::lock_guard<StoreLock> lock(mutex_);
+        std::optional<Value> scratch;
+        const Value* value = lookup_locked(key, scratch);
+        if (!value) return false;
+        if (!is_bloom(*value)) {
+            Logger::error("Key does not hold a Bloom filter: " + format_value(key));
+            return false;
+        }
+        return ScalableBloomFilter::contains(*value->inline_string(), item);
+    }
+
+    // ----- Large values -----
+    // Appends to the value at key (created if missing) without copying the
+    // existing bytes; returns the new length (nullopt if over quota)
+    std::optional<size_t> append(const std::string& key, const std::string& data) {
+        if (unsupported_in_cache_mode("append")) return std::nullopt;
+        if (concurrent_) {
+            size_t length = 0;
+            concurrent_->update(key, [&](const Value* current) -> std::optional<Value> {
+                Value v = current ? *current : Value();
+                v.append(data);
+                length = v.size();
+                return v;
+            });
+            bump_version(key);
+            return length;
+        }
+        std::lock_guard<StoreLock> lock(mutex_);
+        if (!admit_write_locked()) return std::nullopt;
+        auto it = find_locked(key);
+        if (it == store_.end()) {
+            assign_locked(key, Value());
+            it = store_.find(key);
+        }
+        modify_locked(it, [&](Value& v) { v.append(data); });
+        return it->second.size();
+    }
+
+    // Bytes start..end (inclusive) of the value; negative offsets count from
+    // the end, as in Redis GETRANGE. nullopt if the key is missing.
+    std::optional<std::string> getrange(const std::string& key, long long start, long long end) const {
+        std::optional<Value> copy;
+        std::unique_lock<StoreLock> lock(mutex_, std::defer_lock);
+        const Value* value = nullptr;
+        if (concurrent_) {
+            copy = concurrent_->find(key); // inline copy or shared chunks
+            value = copy ? &*copy : nullptr;
+        } else {
+            lock.lock();
+            value = lookup_locked(key, copy);
+        }
+        if (!value) return std::nullopt;
+        long long size = static_cast<long long>(value->size());
+        if (start < 0) start = std::max(0LL, size + start);
+        if (end < 0) end = size + end;
+        end = std::min(end, size - 1);
+        if (start > end) return std::string();
+        return value->range(static_cast<size_t>(start), static_cast<size_t>(end - start + 1));
+    }
+
+    std::optional<size_t> strlen(const std::string& key) const {
+        if (concurrent_) {
+            auto v = concurrent_->find(key);
+            if (!v) return std::nullopt;
+            return v->size();
+        }
+        std::lock_guard<StoreLock> lock(mutex_);
+        std::optional<Value> scratch;
+        const Value* value = lookup_locked(key, scratch);
+        if (!value) return std::nullopt;
+        return value->size();
+    }
+
+    // Streams a new value for key; nothing is visible until commit()
+    ValueWriter open_writer(const std::string& key) { return ValueWriter(*this, key); }
+
+    // Snapshot of the value at key for chunked reading
+    std::optional<ValueReader> open_reader(const std::string& key) const {
+        if (concurrent_) {
+            auto v = concurrent_->find(key);
+            if (!v) return std::nullopt;
+            return ValueReader(v->chunks());
+        }
+        std::lock_guard<StoreLock> lock(mutex_);
+        std::optional<Value> scratch;
+        const Value* value = lookup_locked(key, scratch);
+        if (!value) return std::nullopt;
+        return ValueReader(value->chunks());
+    }
+
+    // ----- Secondary indexes -----
+    // Creates an index over the full value (empty field) or over a top-level
+    // field of JSON object values, built from the current contents and kept
+    // in sync by every write afterwards.
+    bool create_index(const std::string& name, const std::string& field = "") {
+        if (unsupported_on_concurrent("index")) return false;
+        std::lock_guard<StoreLock> lock(mutex_);
+        if (indexes_.count(name)) {
+            Logger::error("Index already exists: " + name);
+            return false;
+        }
+        materialize_image_locked(); // indexes track the live table
+        SecondaryIndex index(field);
+        for (const auto& [key, value] : store_) index.insert(key, value);
+        indexes_.emplace(name, std::move(index));
+        Logger::info("Created index: " + name + (field.empty() ? " on value" : " on field " + field));
+        return true;
+    }
+
+    bool drop_index(const std::string& name) {
+        std::lock_guard<StoreLock> lock(mutex_);
+        if (indexes_.erase(name) == 0) {
+            Logger::error("No such index: " + name);
+            return false;
+        }
+        Logger::info("Dropped index: " + name);
+        return true;
+    }
+
+    // Sorted keys whose indexed term equals term; nullopt if no such index
+    std::optional<std::vector<std::string>> query_index(const std::string& name, const std::string& term) const {
+        std::lock_guard<StoreLock> lock(mutex_);
+        auto it = indexes_.find(name);
+        if (it == indexes_.end()) {
+            Logger::error("No such index: " + name);
+            return std::nullopt;
+        }
+        return it->second.query(term);
+    }
+
+    // (name, field) of every index; field is empty for full-value indexes
+    std::vector<std::pair<std::string, std::string>> list_indexes() const {
+        std::lock_guard<StoreLock> lock(mutex_);
+        std::vector<std::pair<std::string, std::string>> out;
+        for (const auto& [name, index] : indexes_) out.emplace_back(name, index.field());
+        std::sort(out.begin(), out.end());
+        return out;
+    }
+
+    void save_to_file(const std::string& filename, const SnapshotOptions& options = {}) const {
+        std::lock_guard<StoreLock> lock(mutex_);
+        bool ok = write_snapshot_file(filename, options, [&](std::ostream& os) {
+            os << kSnapshotMagic;
+            for_each_locked([&](const std::string& key, const Value& value) { write_record(os, key, value); });
+        });
+        if (ok) Logger::info("Data saved to " + filename);
+    }
+
+    // Accepts the length-prefixed snapshot format (optionally compressed) and
+    // the older JSON format. The store is only replaced if the whole file parses.
+    void load_from_file(const std::string& filename) {
+        if (auto data = read_snapshot_file(filename)) load_snapshot(*data, filename);
+    }
+
+    // Loads the contents of a snapshot file already read into data
+    void load_snapshot(const std::string& data, const std::string& filename) {
+        std::unordered_map<std::string, Value> loaded;
+        bool ok = data.compare(0, kSnapshotMagic.size(), kSnapshotMagic) == 0 ? parse_snapshot(data, loaded)
+                                                                              : parse_legacy_json(data, loaded);
+        if (!ok) {
+            Logger::error("Corrupt or unrecognized data file: " + filename);
+            return;
+        }
+
+        replace_contents(std::move(loaded));
+        Logger::info("Data loaded from " + filename);
+    }
+
+    // Replaces the whole contents, rebuilding indexes and accounting
+    void replace_contents(std::unordered_map<std::string, Value> contents) {
+        std::lock_guard<StoreLock> lock(mutex_);
+        bump_all_versions();
+        if (concurrent_) {
+            concurrent_->clear();
+            for (auto& [key, value] : contents) concurrent_->insert_or_assign(key, std::move(value));
+            bump_all_versions();
+            return;
+        }
+        dispose_locked(take_table_locked());
+        store_.reserve(contents.size());
+        move_entries(contents, store_);
+        for (const auto& [key, value] : store_) stats_.used_bytes += entry_bytes(key, value);
+        for (auto& [name, index] : indexes_) {
+            for (const auto& [key, value] : store_) index.insert(key, value);
+        }
+    }
+
+    // Writes this store as one section of a multi-namespace snapshot
+    void write_namespace(std::ostream& os, const std::string& name) const {
+        std::lock_guard<StoreLock> lock(mutex_);
+        if (concurrent_) {
+            // The section header needs the count up front, so take a copy first
+            std::vector<std::pair<std::string, Value>> entries;
+            concurrent_->for_each([&](const std::string& key, const Value& value) { entries.emplace_back(key, value); });
+            os << "ns " << name.size() << ' ' << entries.size() << '\n' << name << '\n';
+            for (const auto& [key, value] : entries) write_record(os, key, value);
+            return;
+        }
+        os << "ns " << name.size() << ' ' << size_locked() << '\n' << name << '\n';
+        for_each_locked([&](const std::string& key, const Value& value) { write_record(os, key, value); });
+    }
+
+    // ----- Table images -----
+    // save_image writes the store as a table image. load_image maps one and
+    // serves reads from it in place: nothing is re-inserted, and an entry
+    // only moves into the live table when it is first written. Creating an
+    // index or setting a quota moves all remaining entries over.
+    bool save_image(const std::string& filename) const {
+        std::lock_guard<StoreLock> lock(mutex_);
+        bool ok = TableImage::write(filename, size_locked(), [&](auto&& fn) { for_each_locked(fn); });
+        if (ok) Logger::info("Image saved to " + filename);
+        return ok;
+    }
+
+    bool load_image(const std::string& filename) {
+        if (unsupported_on_concurrent("loadimage")) return false;
+        auto image = TableImage::open(filename); // validated before the store is touched
+        if (!image) return false;
+        std::lock_guard<StoreLock> lock(mutex_);
+        dispose_locked(take_table_locked());
+        image_ = std::move(image);
+        ++image_generation_;
+        stats_.used_bytes = image_->payload_bytes() + image_->size() * kEntryOverhead;
+        if (!indexes_.empty() || stats_.quota_bytes) materialize_image_locked();
+        for (auto& [name, index] : indexes_) {
+            for (const auto& [key, value] : store_) index.insert(key, value);
+        }
+        bump_all_versions();
+        Logger::info("Image loaded from " + filename + " (" + std::to_string(size_locked()) + " keys)");
+        return true;
+    }
+
+private:
+    friend class ValueWriter;
+
+    bool commit_chunks(const std::string& key, const std::vector<Chunk>& chunks) {
+        if (unsupported_in_cache_mode("streamed write")) return false;
+        Value value = Value::from_chunks(chunks);
+        size_t size = value.size();
+        if (concurrent_) {
+            concurrent_->insert_or_assign(key, std::move(value));
+            bump_version(key);
+        } else {
+            std::lock_guard<StoreLock> lock(mutex_);
+            if (!admit_write_locked()) return false;
+            assign_locked(key, std::move(value));
+        }
+        Logger::info("Committed streamed value: " + format_value(key) + " (" + std::to_string(size) + " bytes)");
+        return true;
+    }
+
+    // Script access to the store while mutex_ is held. Remembers the first
+    // prior state of every key it writes so a failed script can be undone.
+    class ScriptView {
+    public:
+        explicit ScriptView(KeyValueStore& kv) : kv_(kv) {}
+
+        std::optional<std::string> get(const std::string& key) const {
+            std::optional<Value> scratch;
+            const Value* value = kv_.lookup_locked(key, scratch);
+            if (!value) return std::nullopt;
+            return value->str();
+        }
+        bool exists(const std::string& key) const {
+            std::optional<Value> scratch;
+            return kv_.lookup_locked(key, scratch) != nullptr;
+        }
+        void set(const std::string& key, const std::string& value) {
+            remember(key);
+            kv_.assign_locked(key, value);
+        }
+        std::optional<long long> incrby(const std::string& key, long long delta) {
+            remember(key);
+            return kv_.incrby_locked(key, delta);
+        }
+        bool del(const std::string& key) {
+            remember(key);
+            return kv_.erase_locked(key);
+        }
+
+        void rollback() {
+            for (auto it = undo_.rbegin(); it != undo_.rend(); ++it) {
+                if (it->second) kv_.assign_locked(it->first, std::move(*it->second));
+                else kv_.erase_locked(it->first);
+            }
+            undo_.clear();
+        }
+
+    private:
+        void remember(const std::string& key) {
+            if (!touched_.insert(key).second) return;
+            std::optional<Value> scratch;
+            const Value* value = kv_.lookup_locked(key, scratch);
+            undo_.emplace_back(key, value ? std::optional<Value>(*value) : std::nullopt);
+        }
+
+        KeyValueStore& kv_;
+        std::vector<std::pair<std::string, std::optional<Value>>> undo_;
+        std::unordered_set<std::string> touched_;
+    };
+
+    std::shared_ptr<const Script> cached_script(const std::string& source) {
+        std::string id = script_id(source);
+        {
+            std::lock_guard<std::mutex> lock(scripts_mutex_);
+            auto it = scripts_.find(id);
+            if (it != scripts_.end()) return it->second;
+        }
+        std::string error;
+        auto compiled = compile_script(source, error);
+        if (!compiled) {
+            Logger::error("Script compile error: " + error);
+            return nullptr;
+        }
+        auto script = std::make_shared<const Script>(std::move(*compiled));
+        std::lock_guard<std::mutex> lock(scripts_mutex_);
+        return scripts_.emplace(id, script).first->second;
+    }
+
+    ScriptResult run_atomically(const Script& script, const std::vector<std::string>& args, size_t budget) {
+        if (unsupported_on_concurrent("eval")) return ScriptResult{false, std::nullopt, "unsupported backend", 0};
+        if (unsupported_in_cache_mode("eval")) return ScriptResult{false, std::nullopt, "unsupported in cache mode", 0};
+        std::lock_guard<StoreLock> lock(mutex_);
+        if (!admit_write_locked()) return ScriptResult{false, std::nullopt, "over memory quota", 0};
+        ScriptView view(*this);
+        ScriptResult result = run_script(script, args, view, budget);
+        if (!result.ok) view.rollback();
+        return result;
+    }
+
+    enum class CombinedOp { Set, Remove };
+
+    // One published operation. Slots are claimed per operation, so any
+    // number of threads can share them.
+    struct alignas(64) CombiningSlot {
+        std::atomic<int> state{kSlotFree};
+        CombinedOp op = CombinedOp::Set;
+        const std::string* key = nullptr;
+        Value* value = nullptr;
+        bool result = false;
+    };
+    static constexpr size_t kCombiningSlots = 64;
+    static constexpr int kSlotFree = 0, kSlotClaimed = 1, kSlotPending = 2, kSlotDone = 3;
+
+    // Publishes op and waits until some lock holder (maybe this thread)
+    // applies it. nullopt if combining is off or every slot is taken; the
+    // caller then locks and applies the op itself.
+    std::optional<bool> combine(CombinedOp op, const std::string& key, Value* value) {
+        if (!flat_combining()) return std::nullopt;
+        size_t start = std::hash<std::thread::id>{}(std::this_thread::get_id()) % kCombiningSlots;
+        CombiningSlot* slot = nullptr;
+        for (size_t i = 0; i < kCombiningSlots && !slot; ++i) {
+            CombiningSlot& candidate = combining_slots_[(start + i) % kCombiningSlots];
+            int expected = kSlotFree;
+            if (candidate.state.compare_exchange_strong(expected, kSlotClaimed, std::memory_order_acquire)) {
+                slot = &candidate;
+            }
+        }
+        if (!slot) return std::nullopt;
+        slot->op = op;
+        slot->key = &key;
+        slot->value = value;
+        slot->state.store(kSlotPending, std::memory_order_release);
+        while (slot->state.load(std::memory_order_acquire) != kSlotDone) {
+            if (mutex_.try_lock()) {
+                apply_published_locked();
+                mutex_.unlock();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        bool result = slot->result;
+        slot->state.store(kSlotFree, std::memory_order_release);
+        return result;
+    }
+
+    // The combiner's pass over all slots; callers hold mutex_
+    void apply_published_locked() {
+        uint64_t applied = 0;
+        for (size_t i = 0; i < kCombiningSlots; ++i) {
+            CombiningSlot& slot = combining_slots_[i];
+            if (slot.state.load(std::memory_order_acquire) != kSlotPending) continue;
+            if (slot.op == CombinedOp::Remove) {
+                slot.result = erase_locked(*slot.key);
+            } else if ((slot.result = admit_write_locked())) {
+                assign_locked(*slot.key, std::move(*slot.value));
+            }
+            slot.state.store(kSlotDone, std::memory_order_release);
+            ++applied;
+        }
+        if (applied) {
+            stats_.combined_ops += applied;
+            ++stats_.combining_passes;
+        }
+    }
+
+    std::optional<long long> incrby_locked(const std::string& key, long long delta) {
+        std::optional<Value> scratch;
+        auto next = add_to_integer(lookup_locked(key, scratch), delta);
+        if (next) assign_locked(key, std::to_string(*next));
+        return next;
+    }
+
+    // current + delta, treating a missing value as 0; nullopt if current is
+    // not an integer or the sum overflows
+    static std::optional<long long> add_to_integer(const Value* current, long long delta) {
+        long long n = 0;
+        if (current) {
+            const std::string* s = current->inline_string();
+            auto parsed = s ? parse_int(*s) : std::nullopt;
+            if (!parsed) return std::nullopt;
+            n = *parsed;
+        }
+        long long next = 0;
+        if (__builtin_add_overflow(n, delta, &next)) return std::nullopt;
+        return next;
+    }
+
+    // Visits every entry of whichever table backs the store; callers hold mutex_
+    template <typename F>
+    void for_each_locked(F&& fn) const {
+        if (concurrent_) {
+            concurrent_->for_each(fn);
+            return;
+        }
+        for (const auto& [key, value] : store_) fn(key, value);
+        if (!image_) return;
+        image_->for_each([&](std::string_view key, std::string_view value) {
+            std::string k(key);
+            if (!image_gone_.count(k)) fn(k, Value(std::string(value)));
+        });
+    }
+
+    std::shared_ptr<BulkDeleteJob> start_bulk_delete(std::string description,
+                                                     std::function<bool(const std::string&)> match, std::string prefix) {
+        if (unsupported_in_cache_mode("bulk delete")) return nullptr;
+        auto job = std::make_shared<BulkDeleteJob>(std::move(description), std::move(match), std::move(prefix));
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex_);
+            jobs_.erase(std::remove_if(jobs_.begin(), jobs_.end(), [](const auto& weak) { return weak.expired(); }),
+                        jobs_.end());
+            jobs_.push_back(job);
+        }
+        background_tasks().submit("bulk delete", [this, job](TaskContext& context) { return bulk_delete_step(*job, context); },
+                                  TaskPriority::Low);
+        return job;
+    }
+
+    // One time slice of a bulk delete, batch after batch
+    TaskStatus bulk_delete_step(BulkDeleteJob& job, TaskContext& context) {
+        std::lock_guard<std::mutex> running(job.run_mutex_);
+        bool more = true;
+        while (more && !job.cancel_ && !context.stopping()) {
+            more = concurrent_ ? bulk_delete_concurrent(job) : bulk_delete_batch(job);
+            if (more && context.should_yield()) return TaskStatus::Yield;
+        }
+        // A cancelled job must not touch the store: it may be gone
+        job.finish(more);
+        if (!more) {
+            Logger::info("Deleted " + std::to_string(job.deleted_.load()) + " keys matching " + job.description() +
+                         " in " + std::to_string(job.progress().elapsed.count()) + " ms");
+        }
+        return TaskStatus::Done;
+    }
+
+    // Returns true while image records or buckets are left. The image is
+    // walked first, record by record; its deleted entries only go into
+    // image_gone_.
+    bool bulk_delete_batch(BulkDeleteJob& job) {
+        Graveyard graveyard;
+        std::lock_guard<StoreLock> lock(mutex_);
+        if (image_ && job.image_generation_ != image_generation_) {
+            job.image_generation_ = image_generation_;
+            job.image_offset_ = 0;
+        }
+        if (image_ && job.image_offset_ < image_->end_offset()) {
+            std::vector<std::string> doomed;
+            size_t scanned = 0;
+            job.image_offset_ = image_->for_each_from(job.image_offset_, kBulkDeleteBatch,
+                                                      [&](std::string_view key, std::string_view) {
+                                                          std::string k(key);
+                                                          if (image_gone_.count(k)) return; // walked in store_
+                                                          ++scanned;
+                                                          if (job.match_(k)) doomed.push_back(std::move(k));
+                                                      });
+            for (const auto& key : doomed) erase_locked(key);
+            job.scanned_ += scanned;
+            job.deleted_ += doomed.size();
+            return true;
+        }
+        if (store_.bucket_count() != job.bucket_count_) {
+            // A rehash moved entries between buckets; matches already deleted stay deleted
+            job.bucket_count_ = store_.bucket_count();
+            job.cursor_ = 0;
+        }
+        std::vector<std::string> doomed;
+        size_t work = 0, scanned = 0;
+        for (; job.cursor_ < job.bucket_count_ && work < kBulkDeleteBatch; ++job.cursor_, ++work) {
+            for (auto it = store_.begin(job.cursor_); it != store_.end(job.cursor_); ++it, ++work, ++scanned) {
+                if (job.match_(it->first)) doomed.push_back(it->first);
+            }
+        }
+        for (const auto& key : doomed) erase_locked(key, &graveyard);
+        job.scanned_ += scanned;
+        job.deleted_ += doomed.size();
+        if (!graveyard.empty() && lazy_free()) {
+            free_lazily(std::move(graveyard));
+            ++stats_.lazy_frees;
+        }
+        return job.cursor_ < job.bucket_count_;
+    }
+
+    // Returns true while the walk goes on
+    bool bulk_delete_concurrent(BulkDeleteJob& job) {
+        std::vector<std::string> doomed;
+        job.scanned_ += concurrent_->walk_step(job.prefix_, job.walk_, kBulkDeleteBatch,
+                                               [&](const std::string& key, const Value&) {
+                                                   if (job.match_(key)) doomed.push_back(key);
+                                               });
+        for (const auto& key : doomed) {
+            if (!concurrent_->erase(key)) continue;
+            ++job.deleted_;
+            bump_version(key);
+        }
+        return !job.walk_.done;
+    }
+
+    // Calls fn with the current cache, or nullptr outside cache mode. A
+    // replaced cache is retired through EpochReclaimer, so fn runs pinned
+    // while there is one.
+    template <typename F>
+    std::invoke_result_t<F&, BackingCache*> with_cache(F&& fn) const {
+        if (!cache_.load(std::memory_order_acquire)) return fn(static_cast<BackingCache*>(nullptr));
+        EpochReclaimer::Guard guard(EpochReclaimer::instance());
+        return fn(cache_.load(std::memory_order_acquire));
+    }
+
+    // Installs a value read through from the backing store. It is not a
+    // change (nothing for a snapshot to save) and not a write the quota has
+    // to admit, so only the key's version moves.
+    void fill_local(const std::string& key, const std::string& value) {
+        Value v(value); // copy outside the lock
+        if (concurrent_) {
+            concurrent_->insert_or_assign(key, std::move(v));
+            bump_key_version(key);
+            return;
+        }
+        std::lock_guard<StoreLock> lock(mutex_);
+        assign_locked(key, std::move(v), false);
+    }
+
+    bool set_local(const std::string& key, const std::string& value) {
+        Value v(value); // copy outside the lock
+        if (concurrent_) {
+            concurrent_->insert_or_assign(key, std::move(v));
+            bump_version(key);
+        } else if (auto combined = combine(CombinedOp::Set, key, &v)) {
+            if (!*combined) return false;
+        } else {
+            std::lock_guard<StoreLock> lock(mutex_);
+            if (!admit_write_locked()) return false;
+            assign_locked(key, std::move(v));
+        }
+        return true;
+    }
+
+    void remove_local(const std::string& key) {
+        if (concurrent_) {
+            concurrent_->erase(key);
+            bump_version(key);
+        } else if (combine(CombinedOp::Remove, key, nullptr)) {
+            // applied by whichever writer held the lock
+        } else {
+            std::lock_guard<StoreLock> lock(mutex_);
+            erase_locked(key);
+        }
+    }
+
+    bool unsupported_in_cache_mode(const char* op) const {
+        if (!cache_mode()) return false;
+        Logger::error(std::string(op) + " is not supported in cache mode");
+        return true;
+    }
+
+    bool unsupported_on_concurrent(const char* op) const {
+        if (!concurrent_) return false;
+        Logger::error(std::string(op) + " is not supported on the " + concurrent_->name() + " backend");
+        return true;
+    }
+
+    size_t size_locked() const {
+        if (concurrent_) return concurrent_->size();
+        return store_.size() + (image_ ? image_->size() - image_gone_.size() : 0);
+    }
+
+    // key's value in the image, unless it has since been written or removed
+    std::optional<std::string_view> image_find_locked(const std::string& key) const {
+        if (!image_ || image_gone_.count(key)) return std::nullopt;
+        return image_->find(key);
+    }
+
+    // Read-only lookup across the live table and the image; image values are
+    // copied into scratch
+    const Value* lookup_locked(const std::string& key, std::optional<Value>& scratch) const {
+        auto it = store_.find(key);
+        if (it != store_.end()) return &it->second;
+        auto imaged = image_find_locked(key);
+        if (!imaged) return nullptr;
+        scratch.emplace(std::string(*imaged));
+        return &*scratch;
+    }
+
+    // store_ lookup for writers that change a value in place: an entry still
+    // in the image is moved into store_ first
+    Table::iterator find_locked(const std::string& key) {
+        auto it = store_.find(key);
+        if (it != store_.end()) return it;
+        auto imaged = image_find_locked(key);
+        if (!imaged) return it;
+        image_gone_.insert(key); // its bytes stay counted, now under store_
+        it = store_.try_emplace(key, std::string(*imaged)).first;
+        it->second.last_access = ++clock_;
+        return it;
+    }
+
+    // The image entry is being replaced or deleted; drops its accounting
+    void forget_image_entry_locked(const std::string& key, std::string_view value) {
+        image_gone_.insert(key);
+        stats_.used_bytes -= key.size() + value.size() + kEntryOverhead;
+    }
+
+    void materialize_image_locked() {
+        if (!image_) return;
+        image_->for_each([&](std::string_view key, std::string_view value) {
+            std::string k(key);
+            if (!image_gone_.count(k)) store_.emplace(std::move(k), Value(std::string(value)));
+        });
+        drop_image_locked();
+    }
+
+    void drop_image_locked() {
+        image_.reset();
+        image_gone_.clear();
+    }
+
+    // Everything a store drops on clear or replacement
+    struct DroppedTable {
+        Table entries;
+        std::vector<SecondaryIndex> indexes; // postings only; the definitions stay
+        std::unique_ptr<TableImage> image;
+        std::unordered_set<std::string> image_gone;
+    };
+
+    // Leaves the table, index postings and image empty in O(1)
+    DroppedTable take_table_locked() {
+        DroppedTable dropped;
+        dropped.entries = std::exchange(store_, Table(0, store_.hash_function()));
+        for (auto& [name, index] : indexes_) {
+            SecondaryIndex empty(index.field());
+            std::swap(index, empty);
+            dropped.indexes.push_back(std::move(empty));
+        }
+        dropped.image = std::move(image_);
+        dropped.image_gone.swap(image_gone_);
+        stats_.used_bytes = 0;
+        return dropped;
+    }
+
+    // Frees what was taken from the table, in the background if it is large
+    void dispose_locked(DroppedTable dropped) {
+        if (!lazy_free() || (dropped.entries.size() < kLazyFreeEntries && !dropped.image)) return;
+        free_lazily(std::move(dropped));
+        ++stats_.lazy_frees;
+    }
+
+    void dispose_locked(Value value) {
+        if (!lazy_free() || value.size() < kLazyFreeBytes) return;
+        free_lazily(std::move(value));
+        ++stats_.lazy_frees;
+    }
+
+    // Moves the nodes of from into to, hashing each key with to's hasher.
+    // (libstdc++'s merge() reuses the hash cached in the source node.)
+    template <typename From>
+    static void move_entries(From& from, Table& to) {
+        while (!from.empty()) to.insert(from.extract(from.begin()));
+    }
+
+    using Graveyard = std::vector<Table::node_type>;
+
+    // Removes key; with a graveyard the entry is moved there to be freed later
+    bool erase_locked(const std::string& key, Graveyard* graveyard = nullptr) {
+        auto it = store_.find(key);
+        if (it == store_.end()) {
+            auto imaged = image_find_locked(key);
+            if (!imaged) return false;
+            forget_image_entry_locked(key, *imaged);
+            ++stats_.deletes;
+            bump_version(key);
+            return true;
+        }
+        unindex_locked(key, it->second);
+        stats_.used_bytes -= entry_bytes(key, it->second);
+        ++stats_.deletes;
+        if (graveyard) {
+            graveyard->push_back(store_.extract(it));
+        } else {
+            dispose_locked(std::move(it->second));
+            store_.erase(it);
+        }
+        bump_version(key);
+        return true;
+    }
+
+    // Inserts or overwrites key; callers hold mutex_
+    void assign_locked(const std::string& key, Value value, bool change = true) {
+        auto it = store_.find(key);
+        if (it != store_.end()) {
+            unindex_locked(key, it->second);
+            stats_.used_bytes -= entry_bytes(key, it->second);
+            dispose_locked(std::exchange(it->second, std::move(value)));
+        } else {
+            if (auto imaged = image_find_locked(key)) forget_image_entry_locked(key, *imaged);
+            it = store_.try_emplace(key, std::move(value)).first;
+        }
+        it->second.last_access = ++clock_;
+        stats_.used_bytes += entry_bytes(key, it->second);
+        index_locked(key, it->second);
+        if (change) {
+            ++stats_.writes;
+            bump_version(key);
+        } else {
+            bump_key_version(key);
+        }
+    }
+
+    // Changes a value in place, keeping indexes and accounting in sync
+    template <typename F>
+    void modify_locked(Table::iterator it, F&& fn) {
+        unindex_locked(it->first, it->second);
+        stats_.used_bytes -= entry_bytes(it->first, it->second);
+        fn(it->second);
+        it->second.last_access = ++clock_;
+        stats_.used_bytes += entry_bytes(it->first, it->second);
+        ++stats_.writes;
+        index_locked(it->first, it->second);
+        bump_version(it->first);
+    }
+
+    static size_t entry_bytes(const std::string& key, const Value& value) {
+        return key.size() + value.size() + kEntryOverhead;
+    }
+
+    // Called before every write. Evicts until the store is back under its
+    // quota; returns false (and rejects the write) under noeviction.
+    bool admit_write_locked() {
+        if (stats_.quota_bytes == 0 || stats_.used_bytes <= stats_.quota_bytes) return true;
+        if (stats_.policy == EvictionPolicy::NoEviction) {
+            ++stats_.rejected_writes;
+            Logger::error("Write rejected: over memory quota (" + std::to_string(stats_.used_bytes) + " > " +
+                          std::to_string(stats_.quota_bytes) + " bytes)");
+            return false;
+        }
+        while (stats_.used_bytes > stats_.quota_bytes && !store_.empty()) {
+            erase_locked(pick_victim_locked());
+            --stats_.deletes;
+            ++stats_.evictions;
+        }
+        return true;
+    }
+
+    // Redis-style approximate eviction: look at a few entries starting from a
+    // random bucket and take the least recently used (or the first, for the
+    // random policy). Callers ensure the store is not empty.
+    std::string pick_victim_locked() {
+        const size_t buckets = store_.bucket_count();
+        size_t bucket = std::uniform_int_distribution<size_t>(0, buckets - 1)(rng_);
+        const std::string* victim = nullptr;
+        uint64_t oldest = UINT64_MAX;
+        size_t sampled = 0;
+        for (size_t scanned = 0; scanned < buckets && sampled < kEvictionSamples; ++scanned) {
+            for (auto it = store_.begin(bucket); it != store_.end(bucket) && sampled < kEvictionSamples; ++it) {
+                ++sampled;
+                if (it->second.last_access < oldest) {
+                    oldest = it->second.last_access;
+                    victim = &it->first;
+                }
+                if (stats_.policy == EvictionPolicy::AllKeysRandom) return *victim;
+            }
+            bucket = (bucket + 1) % buckets;
+        }
+        return *victim;
+    }
+
+    // Not padded: writes are rare next to the reads this is for, and 1024
+    // versions fit in 8 KB
+    struct VersionShard {
+        std::atomic<uint64_t> version{0};
+    };
+
+    struct NearEntry {
+        uint64_t store = 0; // owning store's id_, 0 = empty
+        uint64_t stamp = 0;
+        std::string key;
+        std::string value; // a private copy; refills reuse its buffer
+    };
+
+    struct NearCache {
+        std::array<NearEntry, kNearCacheSlots> entries;
+        NearCacheStats stats;
+    };
+
+    // Where key lives in this thread's near cache and the version to check
+    // it against; entry is null when the cache is off
+    struct NearSlot {
+        NearEntry* entry = nullptr;
+        uint64_t stamp = 0;
+    };
+
+    static NearCache& thread_near_cache() {
+        thread_local NearCache cache;
+        return cache;
+    }
+
+    NearSlot near_slot(const std::string& key) const {
+        uint64_t h = fast_hash(key);
+        const VersionShard& shard = versions_.load(std::memory_order_acquire)[h % kVersionShards];
+        NearCache& cache = thread_near_cache();
+        return {&cache.entries[(h >> 32) % kNearCacheSlots], shard.version.load(std::memory_order_acquire)};
+    }
+
+    std::optional<std::string> near_lookup(const NearSlot& slot, const std::string& key) const {
+        NearCache& cache = thread_near_cache();
+        const NearEntry& e = *slot.entry;
+        if (e.store == id_ && e.stamp == slot.stamp && e.key == key) {
+            ++cache.stats.hits;
+            return e.value;
+        }
+        ++cache.stats.misses;
+        return std::nullopt;
+    }
+
+    void near_fill(const NearSlot& slot, const std::string& key, const std::string& value) const {
+        if (!slot.entry || value.size() > kNearCacheMaxValue) return;
+        slot.entry->store = id_;
+        slot.entry->stamp = slot.stamp;
+        slot.entry->key = key;
+        slot.entry->value = value;
+    }
+
+    // Called after every change to key, once the change is visible to readers
+    void bump_version(const std::string& key) {
+        changes_.add();
+        bump_key_version(key);
+    }
+
+    // Invalidates near-cached copies of key without counting a change
+    void bump_key_version(const std::string& key) {
+        VersionShard* versions = versions_.load(std::memory_order_acquire);
+        if (versions) versions[fast_hash(key) % kVersionShards].version.fetch_add(1, std::memory_order_release);
+    }
+
+    void bump_all_versions() {
+        changes_.add();
+        VersionShard* versions = versions_.load(std::memory_order_acquire);
+        if (!versions) return;
+        for (size_t i = 0; i < kVersionShards; ++i) versions[i].version.fetch_add(1, std::memory_order_release);
+    }
+
+    static bool is_hll(const Value& v) {
+        const std::string* s = v.inline_string();
+        return s && HyperLogLog::is_hll(*s);
+    }
+
+    static bool is_bloom(const Value& v) {
+        const std::string* s = v.inline_string();
+        return s && ScalableBloomFilter::is_bloom(*s);
+    }
+
+    // Index maintenance; callers hold mutex_
+    void index_locked(const std::string& key, const Value& value) {
+        for (auto& [name, index] : indexes_) index.insert(key, value);
+    }
+
+    void unindex_locked(const std::string& key, const Value& value) {
+        for (auto& [name, index] : indexes_) index.erase(key, value);
+    }
+
+    Backend backend_ = Backend::Locked;
+    std::unique_ptr<ConcurrentTable> concurrent_; // set for the non-locked backends
+    mutable StoreLock mutex_;
+    Table store_;
+    std::atomic<HashKind> hash_kind_{HashKind::Fast};
+    std::unique_ptr<TableImage> image_;          // read-only base layer after load_image
+    std::unordered_set<std::string> image_gone_; // image keys since written or removed
+    uint64_t image_generation_ = 0;              // images loaded so far
+    std::unordered_map<std::string, SecondaryIndex> indexes_;
+    mutable StoreStats stats_;
+    mutable uint64_t clock_ = 0; // LRU tick
+    std::mt19937 rng_{std::random_device{}()};
+
+    std::mutex scripts_mutex_;
+    std::unordered_map<std::string, std::shared_ptr<const Script>> scripts_;
+
+    std::atomic<bool> flat_combining_{false};
+    std::unique_ptr<CombiningSlot[]> combining_slots_; // allocated on first enable, kept until destruction
+
+    inline static std::atomic<uint64_t> next_id_{0};
+    const uint64_t id_ = ++next_id_; // tells apart stores in the per-thread near caches
+    std::atomic<bool> lazy_free_{true};
+    std::atomic<bool> near_cache_{false};
+    std::unique_ptr<VersionShard[]> version_storage_;
+    std::atomic<VersionShard*> versions_{nullptr}; // set on first enable, kept until destruction
+    StripedCounter changes_;
+
+    std::mutex cache_mutex_; // serializes set_backing_store
+    std::atomic<BackingCache*> cache_{nullptr};
+    std::unique_ptr<BackingCache> cache_storage_;
+
+    std::mutex jobs_mutex_;
+    std::vector<std::weak_ptr<BulkDeleteJob>> jobs_; // bulk deletes to cancel on destruction
+};
+
+
+bool ValueWriter::commit() {
+    if (!kv_) return false;
+    flush();
+    bool ok = kv_->commit_chunks(key_, chunks_);
+    abort();
+    return ok;
+}
+
+// ========== Policy-based store ==========
+// A lean, compile-time configured store for embedding: key and value types,
+// hash, map, lock and logging/metrics are template parameters, so a
+// single-threaded user with NullLock and NullStoreLog pays for neither.
+// It covers get/set/remove/exists; everything else (quotas, scripts,
+// indexes, streaming, snapshots) stays in KeyValueStore.
+
+// Lock policy that does nothing, for stores used from one thread
+struct NullLock {
+    void lock() {}
+    bool try_lock() { return true; }
+    void unlock() {}
+};
+
+// Logging/metrics policies are told about every operation, under the lock
+struct NullStoreLog {
+    template <typename K>
+    void on_get(const K&, bool) {}
+    template <typename K>
+    void on_set(const K&) {}
+    template <typename K>
+    void on_remove(const K&, bool) {}
+};
+
+// Counts operations without logging them
+struct CountingStoreLog {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t writes = 0;
+    uint64_t deletes = 0;
+
+    template <typename K>
+    void on_get(const K&, bool hit) {
+        ++(hit ? hits : misses);
+    }
+    template <typename K>
+    void on_set(const K&) {
+        ++writes;
+    }
+    template <typename K>
+    void on_remove(const K&, bool removed) {
+        deletes += removed;
+    }
+};
+
+// Counts and logs writes through Logger, like KeyValueStore
+struct LoggerStoreLog : CountingStoreLog {
+    template <typename K>
+    void on_set(const K& key) {
+        CountingStoreLog::on_set(key);
+        Logger::info("Set: " + log_key(key));
+    }
+    template <typename K>
+    void on_remove(const K& key, bool removed) {
+        CountingStoreLog::on_remove(key, removed);
+        if (removed) Logger::info("Removed key: " + log_key(key));
+    }
+
+private:
+    template <typename K>
+    static std::string log_key(const K& key) {
+        if constexpr (std::is_arithmetic_v<K>) return std::to_string(key);
+        else return format_value(key);
+    }
+};
+
+// Open-addressing map for integer keys and trivially copyable values: one
+// flat array of slots, linear probing and backward-shift deletion, so there
+// are no per-entry allocations and no tombstones. Supports the part of the
+// std::unordered_map interface BasicKeyValueStore uses.
+template <typename K, typename V>
+class FlatIntMap {
+    static_assert(std::is_integral_v<K> && std::is_trivially_copyable_v<V>, "FlatIntMap is for integer keys and POD values");
+
+    struct Slot {
+        std::pair<K, V> kv;
+        bool used = false;
+    };
+
+public:
+    template <bool Const>
+    class Iterator {
+    public:
+        using SlotPtr = std::conditional_t<Const, const Slot*, Slot*>;
+        using Ref = std::conditional_t<Const, const std::pair<K, V>&, std::pair<K, V>&>;
+
+        Iterator(SlotPtr slot, SlotPtr end) : slot_(slot), end_(end) { skip(); }
+        Ref operator*() const { return slot_->kv; }
+        auto operator->() const { return &slot_->kv; }
+        Iterator& operator++() {
+            ++slot_;
+            skip();
+            return *this;
+        }
+        bool operator==(const Iterator& other) const { return slot_ == other.slot_; }
+        bool operator!=(const Iterator& other) const { return slot_ != other.slot_; }
+
+    private:
+        void skip() {
+            while (slot_ != end_ && !slot_->used) ++slot_;
+        }
+        SlotPtr slot_;
+        SlotPtr end_;
+    };
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    iterator begin() { return {slots_.data(), slots_.data() + slots_.size()}; }
+    iterator end() { return {slots_.data() + slots_.size(), slots_.data() + slots_.size()}; }
+    const_iterator begin() const { return {slots_.data(), slots_.data() + slots_.size()}; }
+    const_iterator end() const { return {slots_.data() + slots_.size(), slots_.data() + slots_.size()}; }
+
+    iterator find(K key) { return {slots_.data() + locate(key), slots_.data() + slots_.size()}; }
+    const_iterator find(K key) const { return {slots_.data() + locate(key), slots_.data() + slots_.size()}; }
+
+    std::pair<iterator, bool> insert_or_assign(K key, const V& value) {
+        if ((size_ + 1) * 2 > slots_.size()) grow(); // at most half full: probe runs stay short
+        size_t i = home(key);
+        while (slots_[i].used && slots_[i].kv.first != key) i = (i + 1) & mask_;
+        bool inserted = !slots_[i].used;
+        slots_[i].kv = {key, value};
+        slots_[i].used = true;
+        size_ += inserted;
+        return {{slots_.data() + i, slots_.data() + slots_.size()}, inserted};
+    }
+
+    size_t erase(K key) {
+        size_t i = locate(key);
+        if (i == slots_.size()) return 0;
+        // Pull later entries of the probe run back so lookups never see a gap
+        for (size_t j = (i + 1) & mask_; slots_[j].used; j = (j + 1) & mask_) {
+            size_t h = home(slots_[j].kv.first);
+            if (((j - h) & mask_) >= ((j - i) & mask_)) {
+                slots_[i] = slots_[j];
+                i = j;
+            }
+        }
+        slots_[i].used = false;
+        --size_;
+        return 1;
+    }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    void clear() {
+        slots_.clear();
+        size_ = 0;
+        mask_ = 0;
+    }
+
+private:
+    size_t home(K key) const {
+        return (static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ULL) >> shift_; // Fibonacci hashing
+    }
+
+    // Slot index of key, or slots_.size() if absent
+    size_t locate(K key) const {
+        if (slots_.empty()) return 0;
+        for (size_t i = home(key);; i = (i + 1) & mask_) {
+            if (!slots_[i].used) return slots_.size();
+            if (slots_[i].kv.first == key) return i;
+        }
+    }
+
+    void grow() {
+        std::vector<Slot> old = std::move(slots_);
+        slots_.assign(std::max<size_t>(16, old.size() * 2), Slot{});
+        mask_ = slots_.size() - 1;
+        shift_ = 64;
+        for (size_t n = slots_.size(); n > 1; n >>= 1) --shift_;
+        size_ = 0;
+        for (const Slot& s : old) {
+            if (s.used) insert_or_assign(s.kv.first, s.kv.second);
+        }
+    }
+
+    std::vector<Slot> slots_;
+    size_t size_ = 0;
+    size_t mask_ = 0;
+    int shift_ = 63; // 64 - log2(slots)
+};
+
+// Integer keys with POD values get the flat map; everything else a
+// std::unordered_map with the given hash
+template <typename K, typename V, typename Hash>
+using DefaultStoreMap =
+    std::conditional_t<std::is_integral_v<K> && std::is_trivially_copyable_v<V> && std::is_same_v<Hash, std::hash<K>>,
+                       FlatIntMap<K, V>, std::unordered_map<K, V, Hash>>;
+
+template <typename K, typename V, typename Hash = std::hash<K>, typename Map = DefaultStoreMap<K, V, Hash>,
+          typename Lock = std::mutex, typename Log = LoggerStoreLog>
+class BasicKeyValueStore {
+public:
+    using key_type = K;
+    using mapped_type = V;
+
+    std::optional<V> get(const K& key) const {
+        std::lock_guard<Lock> lock(lock_);
+        auto it = map_.find(key);
+        bool hit = it != map_.end();
+        log_.on_get(key, hit);
+        if (!hit) return std::nullopt;
+        return it->second;
+    }
+
+    // Pointer to the stored value, valid until the next write; only for
+    // unlocked stores, where no other thread can write meanwhile
+    const V* peek(const K& key) const {
+        static_assert(std::is_same_v<Lock, NullLock>, "peek needs a NullLock store");
+        auto it = map_.find(key);
+        log_.on_get(key, it != map_.end());
+        return it == map_.end() ? nullptr : &it->second;
+    }
+
+    void set(const K& key, V value) {
+        std::lock_guard<Lock> lock(lock_);
+        map_.insert_or_assign(key, std::move(value));
+        log_.on_set(key);
+    }
+
+    bool remove(const K& key) {
+        std::lock_guard<Lock> lock(lock_);
+        bool removed = map_.erase(key) > 0;
+        log_.on_remove(key, removed);
+        return removed;
+    }
+
+    bool exists(const K& key) const {
+        std::lock_guard<Lock> lock(lock_);
+        return map_.find(key) != map_.end();
+    }
+
+    size_t size() const {
+        std::lock_guard<Lock> lock(lock_);
+        return map_.size();
+    }
+
+    void clear() {
+        std::lock_guard<Lock> lock(lock_);
+        map_.clear();
+    }
+
+    template <typename F>
+    void for_each(F&& fn) const {
+        std::lock_guard<Lock> lock(lock_);
+        for (const auto& [key, value] : map_) fn(key, value);
+    }
+
+    // The logging/metrics policy, e.g. CountingStoreLog::hits
+    Log log() const {
+        std::lock_guard<Lock> lock(lock_);
+        return log_;
+    }
+
+private:
+    mutable Lock lock_;
+    mutable Log log_;
+    Map map_;
+};
+
+// Single-threaded and silent, with the flat map for integer keys
+template <typename K, typename V>
+using EmbeddedStore = BasicKeyValueStore<K, V, std::hash<K>, DefaultStoreMap<K, V, std::hash<K>>, NullLock, NullStoreLog>;
+
+// ========== Namespaces ==========
+// Named, isolated stores for multiplexing several applications. Each
+// namespace is its own KeyValueStore with its own table, lock, quota,
+// eviction policy and stats, so tenants never share a data lock. The
+// registry lock is only taken to look up, create, or drop namespaces;
+// callers keep the returned pointer and use it without the registry.
+class NamespaceRegistry {
+public:
+    static constexpr const char* kDefault = "default";
+
+    NamespaceRegistry() { open(kDefault); }
+
+    // Returns the namespace, creating it with the given backend and lock if needed
+    std::shared_ptr<KeyValueStore> open(const std::string& name, Backend backend = Backend::Locked,
+                                        LockPolicy lock_policy = LockPolicy::Mutex) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& ns = namespaces_[name];
+        if (!ns) ns = std::make_shared<KeyValueStore>(backend, lock_policy);
+        return ns;
+    }
+
+    std::shared_ptr<KeyValueStore> find(const std::string& name) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = namespaces_.find(name);
+        return it == namespaces_.end() ? nullptr : it->second;
+    }
+
+    // Removes a namespace (the default one is only cleared). Holders of the
+    // pointer may finish their current work on the detached store.
+    bool drop(const std::string& name) {
+        std::shared_ptr<KeyValueStore> ns;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = namespaces_.find(name);
+            if (it == namespaces_.end()) return false;
+            ns = it->second;
+            if (name != kDefault) namespaces_.erase(it);
+        }
+        ns->clear();
+        if (name != kDefault) dropped_changes_ += ns->changes();
+        return true;
+    }
+
+    // Changes across all namespaces, including dropped ones; only grows
+    uint64_t changes() const {
+        uint64_t total = dropped_changes_.load();
+        for (const auto& [name, ns] : all()) total += ns->changes();
+        return total;
+    }
+
+    std::vector<std::pair<std::string, std::shared_ptr<KeyValueStore>>> all() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return {namespaces_.begin(), namespaces_.end()};
+    }
+
+    void flush_all() {
+        for (const auto& [name, ns] : all()) ns->clear();
+    }
+
+    // Writes every namespace to one file. Each namespace is consistent in
+    // itself; namespaces are written one after another.
+    bool save_to_file(const std::string& filename, const SnapshotOptions& options = {}) const {
+        bool ok = write_snapshot_file(filename, options, [&](std::ostream& os) {
+            os << kNamespacedSnapshotMagic;
+            for (const auto& [name, ns] : all()) ns->write_namespace(os, name);
+        });
+        if (ok) Logger::info("Data saved to " + filename);
+        return ok;
+    }
+
+    // Loads a multi-namespace file, replacing every namespace (namespaces
+    // missing from the file end up empty). Single-store files go into target.
+    void load_from_file(const std::string& filename, const std::string& target = kDefault) {
+        auto file = read_snapshot_file(filename);
+        if (!file) return;
+        const std::string& data = *file;
+        if (data.compare(0, kNamespacedSnapshotMagic.size(), kNamespacedSnapshotMagic) != 0) {
+            open(target)->load_snapshot(data, filename);
+            return;
+        }
+
+        std::map<std::string, std::unordered_map<std::string, Value>> loaded;
+        if (!parse_namespaced_snapshot(data, loaded)) {
+            Logger::error("Corrupt or unrecognized data file: " + filename);
+            return;
+        }
+        for (const auto& [name, ns] : all()) {
+            if (!loaded.count(name)) ns->replace_contents({});
+        }
+        for (auto& [name, contents] : loaded) open(name)->replace_contents(std::move(contents));
+        Logger::info("Data loaded from " + filename + " (" + std::to_string(loaded.size()) + " namespaces)");
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<KeyValueStore>> namespaces_;
+    std::atomic<uint64_t> dropped_changes_{0};
+};
+
+// ========== NUMA partitions ==========
+// Splits the keyspace into one partition per NUMA node. Each partition is
+// its own KeyValueStore, created and only ever touched by worker threads
+// bound to that node (with memory preferred there), so its table and
+// values are allocated locally and stay there. Requests from any thread
+// are routed by key hash to the owning node's queue and run by its workers.
+class NumaStore {
+public:
+    struct NodeStats {
+        int node = 0;
+        size_t workers = 0;
+        size_t keys = 0;
+        uint64_t executed = 0;
+        uint64_t cross_node = 0; // requests handed over from a thread bound to another node
+    };
+
+    explicit NumaStore(NumaTopology topology, size_t workers_per_node = 1) : topology_(std::move(topology)) {
+        for (const auto& node : topology_.nodes) partitions_.push_back(std::make_unique<Partition>(node));
+        for (auto& p : partitions_) {
+            std::promise<void> created;
+            auto ready = created.get_future();
+            for (size_t w = 0; w < std::max<size_t>(1, workers_per_node); ++w) {
+                Partition* partition = p.get();
+                bool first = w == 0;
+                std::promise<void>* signal = first ? &created : nullptr;
+                p->workers.emplace_back([this, partition, signal] { worker_loop(*partition, signal); });
+            }
+            ready.wait(); // the partition's store exists before any request
+        }
+    }
+
+    ~NumaStore() {
+        for (auto& p : partitions_) {
+            {
+                std::lock_guard<std::mutex> lock(p->mutex);
+                p->stopping = true;
+            }
+            p->wake.notify_all();
+            for (auto& w : p->workers) w.join();
+        }
+    }
+
+    NumaStore(const NumaStore&) = delete;
+    NumaStore& operator=(const NumaStore&) = delete;
+
+    const NumaTopology& topology() const { return topology_; }
+    size_t partition_of(const std::string& key) const { return hash64(key) % partitions_.size(); }
+
+    std::optional<std::string> get(const std::string& key) {
+        return route(key, [&](KeyValueStore& kv) { return kv.get(key); });
+    }
+
+    bool set(const std::string& key, const std::string& value) {
+        return route(key, [&](KeyValueStore& kv) { return kv.set(key, value); });
+    }
+
+    void remove(const std::string& key) {
+        route(key, [&](KeyValueStore& kv) {
+            kv.remove(key);
+            return true;
+        });
+    }
+
+    // Runs fn(partition store) on a worker of key's node and returns its
+    // result. Not for use from inside a worker of the same node.
+    template <typename F>
+    auto route(const std::string& key, F&& fn) -> decltype(fn(std::declval<KeyValueStore&>())) {
+        using Result = decltype(fn(std::declval<KeyValueStore&>()));
+        Partition& p = *partitions_[partition_of(key)];
+        std::promise<Result> promise;
+        auto result = promise.get_future();
+        {
+            std::lock_guard<std::mutex> lock(p.mutex);
+            p.queue.emplace_back([&](KeyValueStore& kv) { promise.set_value(fn(kv)); });
+        }
+        if (current_numa_node != p.node.id) ++p.cross_node;
+        p.wake.notify_one();
+        return result.get(); // fn and promise live on this stack until then
+    }
+
+    std::vector<NodeStats> stats() const {
+        std::vector<NodeStats> out;
+        for (const auto& p : partitions_) {
+            NodeStats s;
+            s.node = p->node.id;
+            s.workers = p->workers.size();
+            s.keys = p->store->stats().keys;
+            s.executed = p->executed.load();
+            s.cross_node = p->cross_node.load();
+            out.push_back(s);
+        }
+        return out;
+    }
+
+private:
+    struct Partition {
+        explicit Partition(NumaNode n) : node(std::move(n)) {}
+        NumaNode node;
+        std::unique_ptr<KeyValueStore> store;
+        std::vector<std::thread> workers;
+        std::mutex mutex; // guards queue and stopping
+        std::condition_variable wake;
+        std::deque<std::function<void(KeyValueStore&)>> queue;
+        bool stopping = false;
+        std::atomic<uint64_t> executed{0};
+        std::atomic<uint64_t> cross_node{0};
+    };
+
+    void worker_loop(Partition& p, std::promise<void>* created) {
+        if (!bind_current_thread_to_node(p.node, topology_.simulated)) {
+            Logger::error("Could not bind worker to NUMA node " + std::to_string(p.node.id));
+        }
+        if (created) {
+            // First touch from this node: the table lands in local memory
+            p.store = std::make_unique<KeyValueStore>();
+            created->set_value();
+        }
+        while (true) {
+            std::function<void(KeyValueStore&)> work;
+            {
+                std::unique_lock<std::mutex> lock(p.mutex);
+                p.wake.wait(lock, [&] { return p.stopping || !p.queue.empty(); });
+                if (p.queue.empty()) return;
+                work = std::move(p.queue.front());
+                p.queue.pop_front();
+            }
+            ++p.executed; // before work() resolves the caller's future
+            work(*p.store);
+        }
+    }
+
+    NumaTopology topology_;
+    std::vector<std::unique_ptr<Partition>> partitions_;
+};
+
+// ========== Automatic snapshots ==========
+// Saves the registry to a file when enough has changed: a rule
+// {changes, period} fires once at least `changes` writes happened and
+// `period` has passed since the last successful save. Nothing is written
+// while the data is clean, and attempts are at least min_interval apart so
+// a failing disk is not retried in a loop. The save runs as a low-priority
+// background task; writes during a save count toward the next one.
+struct SaveRule {
+    uint64_t changes;
+    std::chrono::seconds period;
+};
+
+// Like Redis' default "save" lines
+const std::vector<SaveRule>& default_save_rules() {
+    static const std::vector<SaveRule> rules = {
+        {1, std::chrono::seconds(3600)}, {100, std::chrono::seconds(300)}, {10000, std::chrono::seconds(60)}};
+    return rules;
+}
+
+struct AutosaveStatus {
+    std::string path;
+    std::vector<SaveRule> rules;
+    uint64_t dirty = 0;    // changes not yet in a saved file
+    uint64_t saves = 0;
+    uint64_t failures = 0;
+    bool saving = false;
+    bool last_ok = true;
+    std::optional<std::chrono::system_clock::time_point> last_save;
+    std::chrono::milliseconds last_duration{0};
+};
+
+class SnapshotScheduler {
+public:
+    SnapshotScheduler(NamespaceRegistry& namespaces, std::string path, std::vector<SaveRule> rules,
+                      std::chrono::milliseconds min_interval = std::chrono::seconds(5),
+                      std::chrono::milliseconds poll = std::chrono::seconds(1))
+        : namespaces_(namespaces), path_(std::move(path)), rules_(std::move(rules)), min_interval_(min_interval),
+          poll_(poll), baseline_(namespaces.changes()), last_save_(std::chrono::steady_clock::now()),
+          last_attempt_(last_save_ - min_interval) {
+        thread_ = std::thread([this] { loop(); });
+    }
+
+    // Stops checking and waits for a save in flight
+    ~SnapshotScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        thread_.join();
+        std::unique_lock<std::mutex> lock(mutex_);
+        saved_.wait(lock, [&] { return !saving_; });
+    }
+
+    SnapshotScheduler(const SnapshotScheduler&) = delete;
+    SnapshotScheduler& operator=(const SnapshotScheduler&) = delete;
+
+    // Evaluates the rules once; true if a save was started
+    bool check() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (saving_ || stopping_) return false;
+        auto now = std::chrono::steady_clock::now();
+        uint64_t dirty = dirty_locked();
+        if (dirty == 0 || now - last_attempt_ < min_interval_) return false;
+        bool due = std::any_of(rules_.begin(), rules_.end(), [&](const SaveRule& rule) {
+            return dirty >= rule.changes && now - last_save_ >= rule.period;
+        });
+        if (!due) return false;
+        saving_ = true;
+        last_attempt_ = now;
+        background_tasks().run("autosave", [this] { save(); }, TaskPriority::Low);
+        return true;
+    }
+
+    AutosaveStatus status() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        AutosaveStatus out;
+        out.path = path_;
+        out.rules = rules_;
+        out.dirty = dirty_locked();
+        out.saves = saves_;
+        out.failures = failures_;
+        out.saving = saving_;
+        out.last_ok = last_ok_;
+        out.last_save = last_save_time_;
+        out.last_duration = last_duration_;
+        return out;
+    }
+
+private:
+    uint64_t dirty_locked() const {
+        uint64_t changes = namespaces_.changes();
+        return changes > baseline_ ? changes - baseline_ : 0;
+    }
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_) {
+            wake_.wait_for(lock, poll_, [&] { return stopping_; });
+            if (stopping_) break;
+            lock.unlock();
+            check();
+            lock.lock();
+        }
+    }
+
+    void save() {
+        // Read before writing: anything later may be missing from the file
+        uint64_t changes = namespaces_.changes();
+        auto start = std::chrono::steady_clock::now();
+        bool ok = namespaces_.save_to_file(path_);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        saving_ = false;
+        last_ok_ = ok;
+        last_duration_ = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed);
+        if (ok) {
+            baseline_ = changes;
+            last_save_ = start;
+            last_save_time_ = std::chrono::system_clock::now();
+            ++saves_;
+        } else {
+            ++failures_;
+        }
+        saved_.notify_all(); // under the lock: the destructor may free *this right after
+    }
+
+    NamespaceRegistry& namespaces_;
+    const std::string path_;
+    const std::vector<SaveRule> rules_;
+    const std::chrono::milliseconds min_interval_;
+    const std::chrono::milliseconds poll_;
+
+    mutable std::mutex mutex_; // guards everything below
+    std::condition_variable wake_;
+    std::condition_variable saved_;
+    uint64_t baseline_;
+    std::chrono::steady_clock::time_point last_save_;
+    std::chrono::steady_clock::time_point last_attempt_;
+    std::optional<std::chrono::system_clock::time_point> last_save_time_;
+    std::chrono::milliseconds last_duration_{0};
+    uint64_t saves_ = 0;
+    uint64_t failures_ = 0;
+    bool last_ok_ = true;
+    bool saving_ = false;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+// ========== CLI ==========
+// State carried from one command to the next
+struct CliSession {
+    explicit CliSession(NamespaceRegistry& registry) : namespaces(registry), selected(registry.open(current)) {}
+
+    NamespaceRegistry& namespaces;
+    std::string current = NamespaceRegistry::kDefault;
+    std::shared_ptr<KeyValueStore> selected;
+    std::ostream* reply = &std::cout; // where command output goes
+    int source_depth = 0;             // nesting of source commands
+    std::unique_ptr<SnapshotScheduler> autosave;
+    std::vector<std::shared_ptr<BulkDeleteJob>> delete_jobs; // started with async
+    std::optional<KeyHandle> last_key;
+
+    // Handle for key in the selected store; reused while commands keep
+    // naming the same key, as scripts run with source often do
+    const KeyHandle& key_handle(const std::string& key) {
+        HashKind kind = selected->hash_kind();
+        if (!last_key || last_key->kind() != kind || last_key->key() != key) last_key.emplace(key, kind);
+        return *last_key;
+    }
+};
+
+void print_delete_progress(std::ostream& os, const BulkDeleteJob& job) {
+    BulkDeleteProgress p = job.progress();
+    os << job.description() << ": " << p.deleted << " deleted, " << p.scanned << " scanned, "
+       << (p.done ? (p.cancelled ? "cancelled" : "done") : "running") << " (" << p.elapsed.count() << " ms)\n";
+}
+
+bool run_source_command(CliSession& session, const std::vector<std::string>& args);
+
+// Runs one parsed command; returns false for exit
+bool execute_command(CliSession& session, const std::vector<std::string>& args) {
+    NamespaceRegistry& namespaces = session.namespaces;
+    std::string& current = session.current;
+    std::shared_ptr<KeyValueStore>& selected = session.selected;
+    std::ostream& reply = *session.reply;
+    KeyValueStore& kv = *selected;
+    const std::string cmd = args[0];
+    const std::string key = args.size() > 1 ? args[1] : "";
+
+    if (cmd == "exit") return false;
+
+    if (cmd == "set") {
+        // Unquoted multi-word values are joined with single spaces
+        std::string value = join_args(args, 2);
+        if (args.size() < 3) {
+            Logger::error("Usage: set <key> <value>");
+            return true;
+        }
+        kv.set(session.key_handle(key), value);
+    } else if (cmd == "get") {
+        if (auto val = kv.get(session.key_handle(key))) {
+            reply << format_value(key) << " = " << format_value(*val) << "\n";
+        } else {
+            reply << "Key not found\n";
+        }
+    } else if (cmd == "remove") {
+        kv.remove(session.key_handle(key));
+    } else if (cmd == "pfadd") {
+        if (args.size() < 3) {
+            Logger::error("Usage: pfadd <key> <element>...");
+            return true;
+        }
+        reply << (kv.pfadd(session.key_handle(key), {args.begin() + 2, args.end()}) ? 1 : 0) << "\n";
+    } else if (cmd == "pfcount") {
+        if (args.size() < 2) {
+            Logger::error("Usage: pfcount <key>...");
+            return true;
+        }
+        if (auto n = kv.pfcount({args.begin() + 1, args.end()})) reply << *n << "\n";
+    } else if (cmd == "pfmerge") {
+        if (args.size() < 3) {
+            Logger::error("Usage: pfmerge <dest> <source>...");
+            return true;
+        }
+        kv.pfmerge(key, {args.begin() + 2, args.end()});
+    } else if (cmd == "bfadd" || cmd == "bfexists") {
+        if (args.size() != 3) {
+            Logger::error("Usage: " + cmd + " <key> <item>");
+            return true;
+        }
+        const KeyHandle& handle = session.key_handle(key);
+        bool result = cmd == "bfadd" ? kv.bfadd(handle, args[2]) : kv.bfexists(handle, args[2]);
+        reply << (result ? 1 : 0) << "\n";
+    } else if (cmd == "incr") {
+        long long delta = 1;
+        if (args.size() < 2 || (args.size() == 3 && !(std::istringstream(args[2]) >> delta))) {
+            Logger::error("Usage: incr <key> [delta]");
+            return true;
+        }
+        if (auto n = kv.incr(session.key_handle(key), delta)) reply << *n << "\n";
+    } else if (cmd == "eval" || cmd == "evalsha") {
+        if (args.size() < 2) {
+            Logger::error("Usage: " + cmd + (cmd == "eval" ? " <script>" : " <id>") + " [arg]...");
+            return true;
+        }
+        std::vector<std::string> script_args(args.begin() + 2, args.end());
+        ScriptResult r = cmd == "eval" ? kv.eval(key, script_args) : kv.evalsha(key, script_args);
+        if (r.ok) reply << (r.value ? format_value(*r.value) : "(nil)") << "\n";
+        else Logger::error("Script failed: " + r.error);
+    } else if (cmd == "script") {
+        if (args.size() != 3 || key != "load") {
+            Logger::error("Usage: script load <script>");
+            return true;
+        }
+        if (auto id = kv.script_load(args[2])) reply << *id << "\n";
+    } else if (cmd == "append") {
+        if (args.size() != 3) {
+            Logger::error("Usage: append <key> <value>");
+            return true;
+        }
+        if (auto n = kv.append(session.key_handle(key), args[2])) reply << *n << "\n";
+    } else if (cmd == "getrange") {
+        long long start = 0, end = 0;
+        if (args.size() != 4 || !(std::istringstream(args[2]) >> start) || !(std::istringstream(args[3]) >> end)) {
+            Logger::error("Usage: getrange <key> <start> <end>");
+            return true;
+        }
+        if (auto val = kv.getrange(session.key_handle(key), start, end)) reply << format_value(*val) << "\n";
+        else reply << "Key not found\n";
+    } else if (cmd == "strlen") {
+        if (auto n = kv.strlen(session.key_handle(key))) reply << *n << "\n";
+        else reply << "Key not found\n";
+    } else if (cmd == "setfile") {
+        // Streams a file into a value without loading it whole
+        std::ifstream in(args.size() == 3 ? args[2] : "", std::ios::binary);
+        if (!in) {
+            Logger::error("Usage: setfile <key> <file> (file must be readable)");
+            return true;
+        }
+        ValueWriter writer = kv.open_writer(key);
+        std::string buffer(Value::kChunkSize, '\0');
+        while (in.read(&buffer[0], static_cast<std::streamsize>(buffer.size())) || in.gcount() > 0) {
+            writer.write(buffer.substr(0, static_cast<size_t>(in.gcount())));
+        }
+        writer.commit();
+    } else if (cmd == "getfile") {
+        auto reader = kv.open_reader(key);
+        std::ofstream out(args.size() == 3 ? args[2] : "", std::ios::binary);
+        if (!reader || !out) {
+            Logger::error("Usage: getfile <key> <file> (key must exist)");
+            return true;
+        }
+        for (const auto& chunk : reader->chunks()) out.write(chunk->data(), static_cast<std::streamsize>(chunk->size()));
+        reply << reader->size() << " bytes written\n";
+    } else if (cmd == "index") {
+        const std::string& sub = key;
+        std::string name = args.size() > 2 ? args[2] : "";
+        if (sub == "create" && !name.empty()) {
+            kv.create_index(name, args.size() > 3 ? args[3] : "");
+        } else if (sub == "drop" && !name.empty()) {
+            kv.drop_index(name);
+        } else if (sub == "query" && !name.empty()) {
+            if (auto keys = kv.query_index(name, join_args(args, 3))) {
+                for (const auto& k : *keys) reply << "- " << format_value(k) << "\n";
+                reply << "(" << keys->size() << " keys)\n";
+            }
+        } else if (sub == "list") {
+            for (const auto& [n, field] : kv.list_indexes()) {
+                reply << "- " << n << " on " << (field.empty() ? "value" : "field " + field) << "\n";
+            }
+        } else {
+            Logger::error("Usage: index create <name> [field] | index drop <name> | index query <name> <value> | index list");
+        }
+    } else if (cmd == "select") {
+        auto backend = parse_backend(args.size() > 2 ? args[2] : "locked");
+        auto lock = parse_lock_policy(args.size() > 3 ? args[3] : "mutex");
+        if (args.size() < 2 || args.size() > 4 || !backend || !lock) {
+            Logger::error("Usage: select <namespace> [locked|lockfree|cuckoo|prefix] [mutex|adaptive|ticket]");
+            return true;
+        }
+        current = key;
+        selected = namespaces.open(current, *backend, *lock);
+        if (selected->backend() != *backend && args.size() >= 3) {
+            Logger::error("Namespace already exists with the " + std::string(backend_name(selected->backend())) +
+                          " backend");
+        } else if (selected->lock_policy() != *lock && args.size() == 4) {
+            Logger::error("Namespace already exists with the " +
+                          std::string(lock_policy_name(selected->lock_policy())) + " lock");
+        }
+    } else if (cmd == "namespaces") {
+        for (const auto& [name, ns] : namespaces.all()) {
+            reply << (name == current ? "* " : "- ") << format_value(name) << " (" << ns->stats().keys
+                      << " keys)\n";
+        }
+    } else if (cmd == "dropdb") {
+        if (args.size() != 2 || !namespaces.drop(key)) {
+            Logger::error("Usage: dropdb <existing namespace>");
+            return true;
+        }
+        if (key == current) {
+            current = NamespaceRegistry::kDefault;
+            selected = namespaces.open(current);
+        }
+    } else if (cmd == "flushall") {
+        namespaces.flush_all();
+    } else if (cmd == "quota") {
+        auto bytes = parse_int(key); // nullopt when missing
+        auto policy = parse_eviction_policy(args.size() > 2 ? args[2] : "noeviction");
+        if (!bytes || *bytes < 0 || !policy) {
+            Logger::error("Usage: quota <bytes, 0 = unlimited> [noeviction|allkeys-lru|allkeys-random]");
+            return true;
+        }
+        kv.set_quota(static_cast<size_t>(*bytes), *policy);
+    } else if (cmd == "stats") {
+        StoreStats st = kv.stats();
+        reply << "namespace:       " << format_value(current) << "\n"
+                  << "backend:         " << backend_name(kv.backend()) << "\n"
+                  << "lock:            " << lock_policy_name(kv.lock_policy()) << "\n"
+                  << "keys:            " << st.keys << "\n"
+                  << "used_bytes:      " << st.used_bytes << "\n"
+                  << "quota_bytes:     " << st.quota_bytes << (st.quota_bytes ? "" : " (unlimited)") << "\n"
+                  << "eviction_policy: " << eviction_policy_name(st.policy) << "\n"
+                  << "hits/misses:     " << st.hits << "/" << st.misses << "\n"
+                  << "writes/deletes:  " << st.writes << "/" << st.deletes << "\n"
+                  << "evictions:       " << st.evictions << "\n"
+                  << "rejected_writes: " << st.rejected_writes << "\n"
+                  << "lazy free:       " << (kv.lazy_free() ? "on" : "off") << " (" << st.lazy_frees
+                  << " handed off)\n"
+                  << "key hash:        " << hash_kind_name(kv.hash_kind()) << "\n"
+                  << "combining:       " << (kv.flat_combining() ? "on" : "off") << " (" << st.combined_ops
+                  << " writes in " << st.combining_passes << " passes)\n";
+        auto near = KeyValueStore::near_cache_stats();
+        reply << "near cache:      " << (kv.near_cache() ? "on" : "off") << " (" << near.hits << "/"
+                  << near.misses << " hits/misses on this thread)\n";
+        if (auto cs = kv.cache_stats()) {
+            reply << "cache:           " << cs->hits << "/" << cs->misses << " hits/misses, " << cs->negative_hits
+                  << " negative, " << cs->pending_hits << " from queue, " << cs->coalesced << " coalesced\n"
+                  << "cache loads:     " << cs->loads << " (avg " << (cs->loads ? cs->load_us_total / cs->loads : 0)
+                  << " us, max " << cs->load_us_max << " us)\n"
+                  << "write-behind:    " << cs->queued << " queued, " << cs->written << " written in " << cs->batches
+                  << " batches, " << cs->write_failures << " failed\n";
+        } else {
+            reply << "cache:           off\n";
+        }
+        if (session.autosave) {
+            AutosaveStatus as = session.autosave->status();
+            reply << "autosave:        " << format_value(as.path) << " (";
+            for (size_t i = 0; i < as.rules.size(); ++i) {
+                reply << (i ? ", " : "") << as.rules[i].period.count() << "s/" << as.rules[i].changes;
+            }
+            reply << "), " << as.dirty << " unsaved changes, " << as.saves << " saves, " << as.failures
+                  << " failed\n";
+            if (as.last_save) {
+                std::time_t t = std::chrono::system_clock::to_time_t(*as.last_save);
+                reply << "last save:       " << std::put_time(std::localtime(&t), "%Y-%m-%d %H:%M:%S") << " ("
+                      << as.last_duration.count() << " ms, " << (as.last_ok ? "ok" : "failed") << ")\n";
+            }
+        } else {
+            reply << "autosave:        off\n";
+        }
+    } else if (cmd == "combining") {
+        if (args.size() != 2 || (key != "on" && key != "off")) {
+            Logger::error("Usage: combining on|off");
+            return true;
+        }
+        kv.set_flat_combining(key == "on");
+    } else if (cmd == "cache") {
+        if (args.size() == 2 && key == "off") {
+            kv.set_backing_store(nullptr);
+        } else if (args.size() == 2 && key == "flush") {
+            if (!kv.flush_backing()) Logger::error("Some writes did not reach the backing store; they stay queued");
+        } else {
+            auto latency = args.size() == 3 ? parse_int(args[2]) : std::optional<long long>(0);
+            if (args.size() < 2 || args.size() > 3 || !latency || *latency < 0) {
+                Logger::error("Usage: cache <dir> [latency us] | cache flush | cache off");
+                return true;
+            }
+            kv.set_backing_store(std::make_shared<DirectoryBackingStore>(key, std::chrono::microseconds(*latency)));
+        }
+    } else if (cmd == "delprefix" || cmd == "delpattern") {
+        bool async = args.size() == 3 && args[2] == "async";
+        if (args.size() < 2 || (args.size() == 3 && !async) || args.size() > 3) {
+            Logger::error("Usage: " + cmd + (cmd == "delprefix" ? " <prefix>" : " <pattern>") + " [async]");
+            return true;
+        }
+        auto job = cmd == "delprefix" ? kv.delete_prefix(key) : kv.delete_pattern(key);
+        if (!job) return true;
+        if (async) {
+            session.delete_jobs.push_back(job);
+            reply << "Started delete job " << session.delete_jobs.size() << "\n";
+            return true;
+        }
+        while (!job->wait_for(std::chrono::seconds(1))) print_delete_progress(reply, *job);
+        BulkDeleteProgress p = job->progress();
+        reply << "Deleted " << p.deleted << " keys in " << p.elapsed.count() << " ms\n";
+    } else if (cmd == "deljobs") {
+        for (size_t i = 0; i < session.delete_jobs.size(); ++i) {
+            reply << "[" << i + 1 << "] ";
+            print_delete_progress(reply, *session.delete_jobs[i]);
+        }
+    } else if (cmd == "lazyfree") {
+        if (args.size() != 2 || (key != "on" && key != "off")) {
+            Logger::error("Usage: lazyfree on|off");
+            return true;
+        }
+        kv.set_lazy_free(key == "on");
+    } else if (cmd == "hash") {
+        auto kind = args.size() == 2 ? parse_hash_kind(key) : std::nullopt;
+        if (!kind) {
+            Logger::error("Usage: hash fast|siphash|std");
+            return true;
+        }
+        kv.set_hash(*kind);
+    } else if (cmd == "nearcache") {
+        if (args.size() != 2 || (key != "on" && key != "off")) {
+            Logger::error("Usage: nearcache on|off");
+            return true;
+        }
+        kv.set_near_cache(key == "on");
+    } else if (cmd == "numa") {
+        for (const auto& node : NumaTopology::detect().nodes) {
+            reply << "- node " << node.id << ": " << node.cpus.size() << " cpus (";
+            for (size_t i = 0; i < node.cpus.size(); ++i) reply << (i ? "," : "") << node.cpus[i];
+            reply << ")\n";
+        }
+    } else if (cmd == "tasks") {
+        SchedulerStats st = background_tasks().stats();
+        reply << "workers: " << st.workers.size() << " (cpu share cap " << st.max_cpu_share * 100
+                  << "%, slice " << st.slice.count() << "us)\n"
+                  << "submitted/completed: " << st.submitted << "/" << st.completed << ", sleeping " << st.sleeping
+                  << "\n";
+        for (const auto& w : st.workers) {
+            reply << "- worker " << w.id << (w.cpu >= 0 ? " on cpu " + std::to_string(w.cpu) : "") << ": "
+                      << (w.running.empty() ? "idle" : "running " + format_value(w.running))
+                      << ", queued high/normal/low " << w.queued[0] << "/" << w.queued[1] << "/" << w.queued[2]
+                      << ", executed " << w.executed << ", slices " << w.slices << ", stolen " << w.stolen << "\n";
+        }
+    } else if (cmd == "list") {
+        kv.print_all();
+    } else if (cmd == "clear" || cmd == "flushdb") {
+        kv.clear();
+    } else if (cmd == "save") {
+        SnapshotOptions options;
+        options.compress = args.size() > 2 && args[2] == "compress";
+        if (options.compress && args.size() > 3) {
+            auto level = parse_int(args[3]);
+            options.level = level ? static_cast<int>(*level) : 0;
+        }
+        if (args.size() < 2 || (args.size() > 2 && !options.compress) || args.size() > 4 || options.level < 1 ||
+            options.level > 9) {
+            Logger::error("Usage: save <file> [compress [level 1-9]]");
+            return true;
+        }
+        namespaces.save_to_file(key, options);
+    } else if (cmd == "load") {
+        namespaces.load_from_file(key, current);
+    } else if (cmd == "source") {
+        run_source_command(session, args);
+    } else if (cmd == "autosave") {
+        if (args.size() == 2 && key == "off") {
+            session.autosave.reset();
+            return true;
+        }
+        std::vector<SaveRule> rules;
+        bool ok = args.size() >= 2 && args.size() % 2 == 0;
+        for (size_t i = 2; ok && i + 1 < args.size(); i += 2) {
+            auto seconds = parse_int(args[i]);
+            auto changes = parse_int(args[i + 1]);
+            ok = seconds && changes && *seconds >= 0 && *changes > 0;
+            if (ok) rules.push_back({static_cast<uint64_t>(*changes), std::chrono::seconds(*seconds)});
+        }
+        if (!ok) {
+            Logger::error("Usage: autosave <file> [<seconds> <changes>]... | autosave off");
+            return true;
+        }
+        if (rules.empty()) rules = default_save_rules();
+        session.autosave.reset(); // one file at a time
+        session.autosave = std::make_unique<SnapshotScheduler>(namespaces, key, std::move(rules));
+    } else if (cmd == "saveimage" || cmd == "loadimage") {
+        if (args.size() != 2) {
+            Logger::error("Usage: " + cmd + " <file>");
+            return true;
+        }
+        if (cmd == "saveimage") kv.save_image(key);
+        else kv.load_image(key);
+    } else {
+        Logger::error("Unknown command: " + cmd);
+        reply << "Available commands: set, get, remove, list, clear, save <file>, load <file>,\n"
+                  << "  saveimage <file>, loadimage <file>, source <file> [batch <n>] [atomic] [echo],\n"
+                  << "  pfadd, pfcount, pfmerge, bfadd, bfexists, index, append, getrange, strlen,\n"
+                  << "  setfile <key> <file>, getfile <key> <file>, incr, eval, evalsha, script load,\n"
+                  << "  select <namespace> [backend] [lock], namespaces, flushdb, flushall, dropdb, quota, stats,\n"
+                  << "  combining on|off, nearcache on|off, tasks, numa, exit\n"
+                  << "Quote arguments containing spaces: set \"my key\" \"line 1\\nline 2\"\n";
+    }
+    return true;
+}
+
+// ----- source / --exec -----
+struct SourceOptions {
+    size_t batch = 1000;
+    bool atomic = false; // undo a batch's writes if any of its commands fails
+    bool echo = false;   // print command output instead of discarding it
+};
+
+struct SourceSummary {
+    size_t commands = 0;
+    size_t failed = 0;
+    size_t rolled_back = 0; // batches undone in atomic mode
+    double ms = 0;
+    std::vector<std::string> errors; // the first kMaxErrors, prefixed with their line
+    static constexpr size_t kMaxErrors = 20;
+};
+
+// Which key a command writes, for atomic batches: nullopt for read-only
+// commands, "" for commands that cannot be undone key by key
+std::optional<std::string> undo_key(const std::vector<std::string>& args) {
+    static const std::unordered_set<std::string> writes = {"set", "remove", "incr", "append", "pfadd", "bfadd",
+                                                           "pfmerge"};
+    static const std::unordered_set<std::string> reads = {"get", "pfcount", "bfexists", "getrange", "strlen",
+                                                          "stats", "list"};
+    if (writes.count(args[0]) && args.size() > 1) return args[1];
+    if (reads.count(args[0])) return std::nullopt;
+    return std::string();
+}
+
+// Runs the commands in a file through execute_command, batch by batch.
+// Info logs and command output are suppressed and errors collected; nullopt
+// if the file cannot be read.
+std::optional<SourceSummary> source_file(CliSession& session, const std::string& path, const SourceOptions& options) {
+    auto file = MappedFile::open(path);
+    if (!file) {
+        Logger::error("Could not open file: " + path);
+        return std::nullopt;
+    }
+    SourceSummary summary;
+    std::vector<std::string> errors;
+    auto record_errors = [&](size_t line, size_t from) {
+        for (size_t i = from; i < errors.size() && summary.errors.size() < SourceSummary::kMaxErrors; ++i) {
+            summary.errors.push_back("line " + std::to_string(line) + ": " + errors[i]);
+        }
+        errors.resize(from);
+    };
+
+    std::ostringstream discarded;
+    discarded.setstate(std::ios::badbit); // drops everything written to it
+    std::ostream* saved_reply = session.reply;
+    if (!options.echo) session.reply = &discarded;
+    const bool was_quiet = Logger::quiet();
+    std::vector<std::string>* saved_sink = Logger::error_sink();
+    Logger::set_quiet(true);
+    Logger::set_error_sink(&errors);
+    ++session.source_depth;
+
+    std::string_view text(file->data(), file->size());
+    size_t pos = 0, line = 0;
+    bool stopped = false;
+    auto start = std::chrono::steady_clock::now();
+    while (pos < text.size() && !stopped) {
+        // Parse one batch; unparsable lines stay in it (as nullopt) and fail in order
+        std::vector<std::pair<size_t, std::optional<std::vector<std::string>>>> batch;
+        while (pos < text.size() && batch.size() < options.batch) {
+            size_t end = text.find('\n', pos);
+            if (end == std::string_view::npos) end = text.size();
+            std::string input(text.substr(pos, end - pos));
+            pos = end + 1;
+            ++line;
+            if (!input.empty() && input.back() == '\r') input.pop_back();
+            auto parsed = split_args(input);
+            if (parsed && (parsed->empty() || (*parsed)[0][0] == '#')) continue;
+            batch.emplace_back(line, std::move(parsed));
+        }
+
+        // In atomic mode remember what the batch will overwrite
+        std::vector<std::pair<std::string, std::optional<std::string>>> undo;
+        std::shared_ptr<KeyValueStore> store = session.selected;
+        if (options.atomic) {
+            std::unordered_set<std::string> seen;
+            bool undoable = true;
+            for (const auto& [at, args] : batch) {
+                if (!args) continue;
+                auto key = undo_key(*args);
+                if (key && key->empty()) {
+                    Logger::error((*args)[0] + " cannot run in an atomic batch");
+                    record_errors(at, 0);
+                    undoable = false;
+                } else if (key && seen.insert(*key).second) {
+                    undo.emplace_back(*key, store->get(*key));
+                }
+            }
+            if (!undoable) {
+                summary.commands += batch.size();
+                summary.failed += batch.size();
+                ++summary.rolled_back;
+                continue;
+            }
+        }
+
+        size_t batch_failures = 0;
+        for (const auto& [at, args] : batch) {
+            ++summary.commands;
+            if (args) stopped = !execute_command(session, *args);
+            else Logger::error("Unterminated quote or bad escape");
+            if (!errors.empty()) {
+                ++batch_failures;
+                record_errors(at, 0);
+            }
+            if (stopped) break;
+        }
+        summary.failed += batch_failures;
+        if (options.atomic && batch_failures > 0) {
+            for (const auto& [key, value] : undo) {
+                if (value) store->set(key, *value);
+                else store->remove(key);
+            }
+            errors.clear();
+            ++summary.rolled_back;
+        }
+    }
+    summary.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    --session.source_depth;
+    Logger::set_error_sink(saved_sink);
+    Logger::set_quiet(was_quiet);
+    session.reply = saved_reply;
+    return summary;
+}
+
+void print_source_summary(std::ostream& os, const std::string& path, const SourceSummary& summary) {
+    os << "sourced " << path << ": " << summary.commands << " commands in " << std::fixed << std::setprecision(1)
+       << summary.ms << " ms (" << std::setprecision(0)
+       << (summary.ms > 0 ? summary.commands / summary.ms * 1000.0 : 0.0) << " ops/s), " << summary.failed
+       << " failed";
+    if (summary.rolled_back) os << ", " << summary.rolled_back << " batches rolled back";
+    os << "\n";
+    for (const auto& error : summary.errors) os << "  " << error << "\n";
+    if (summary.failed > summary.errors.size()) os << "  ...\n";
+}
+
+// source <file> [batch <n>] [atomic] [echo]
+bool run_source_command(CliSession& session, const std::vector<std::string>& args) {
+    SourceOptions options;
+    bool ok = args.size() >= 2;
+    for (size_t i = 2; ok && i < args.size(); ++i) {
+        if (args[i] == "atomic") {
+            options.atomic = true;
+        } else if (args[i] == "echo") {
+            options.echo = true;
+        } else if (args[i] == "batch" && i + 1 < args.size()) {
+            auto n = parse_int(args[++i]);
+            ok = n && *n > 0;
+            if (ok) options.batch = static_cast<size_t>(*n);
+        } else {
+            ok = false;
+        }
+    }
+    if (!ok) {
+        Logger::error("Usage: source <file> [batch <n>] [atomic] [echo]");
+        return false;
+    }
+    if (session.source_depth >= 8) {
+        Logger::error("source nested too deeply: " + args[1]);
+        return false;
+    }
+    auto summary = source_file(session, args[1], options);
+    if (!summary) return false;
+    print_source_summary(*session.reply, args[1], *summary);
+    if (summary->failed > 0 && session.source_depth > 0) {
+        Logger::error(std::to_string(summary->failed) + " commands failed in " + args[1]); // fails the outer line
+    }
+    return summary->failed == 0;
+}
+
+// Runs interactive prompt and handles commands
+void run_cli(NamespaceRegistry& namespaces) {
+    CliSession session(namespaces);
+    std::string input;
+    while (true) {
+        std::cout << (session.current == NamespaceRegistry::kDefault ? "" : "[" + session.current + "]") << ">> ";
+        if (!std::getline(std::cin, input)) break;
+        auto parsed = split_args(input);
+        if (!parsed) {
+            Logger::error("Unterminated quote or bad escape in: " + input);
+            continue;
+        }
+        if (parsed->empty()) continue;
+        if (!execute_command(session, *parsed)) break;
+    }
+}
+
+// ========== Tests ==========
+void test_probabilistic_types() {
+    KeyValueStore kv;
+    for (int i = 0; i < 5000; ++i) kv.pfadd("visitors", {"user" + std::to_string(i % 2000)});
+    uint64_t visitors = kv.pfcount({"visitors"}).value();
+    assert(visitors > 1900 && visitors < 2100);
+
+    std::vector<std::string> more;
+    for (int i = 1000; i < 3000; ++i) more.push_back("user" + std::to_string(i));
+    kv.pfadd("more", more);
+    uint64_t both = kv.pfcount({"visitors", "more"}).value();
+    assert(both > 2850 && both < 3150);
+    kv.pfmerge("all", {"visitors", "more"});
+    assert(kv.pfcount({"all"}).value() == both);
+    assert(HyperLogLog::is_dense(kv.get("all").value()));
+
+    kv.set("plain", "text");
+    assert(!kv.pfcount({"plain"}).has_value());
+
+    for (int i = 0; i < 3000; ++i) kv.bfadd("seen", "item" + std::to_string(i));
+    for (int i = 0; i < 3000; ++i) assert(kv.bfexists("seen", "item" + std::to_string(i)));
+    int false_positives = 0;
+    for (int i = 0; i < 3000; ++i) false_positives += kv.bfexists("seen", "other" + std::to_string(i));
+    assert(false_positives < 90);
+
+    // Both types survive a save/load round-trip
+    const std::string path = "kvstore_test_prob.json";
+    kv.save_to_file(path);
+    KeyValueStore loaded;
+    loaded.load_from_file(path);
+    std::remove(path.c_str());
+    assert(loaded.pfcount({"all"}).value() == both);
+    assert(loaded.bfexists("seen", "item42"));
+
+    // Hostile values with the right headers are plain strings, not HLLs or
+    // Bloom filters: out-of-range registers, unsorted or out-of-range sparse
+    // entries, zero-bit or truncated Bloom layers
+    Logger::set_quiet(true);
+    std::string dense = kv.get("all").value();
+    std::string high = dense, low = dense;
+    high[HyperLogLog::kHeaderSize + 7] = '~';
+    low[HyperLogLog::kHeaderSize + 7] = '\x01';
+    const std::string bloom = kv.get("seen").value();
+    const std::vector<std::string> hostile = {
+        "HLLS~~~~", "HLLS###$###\"", "HLLS##$$##$$", "HLLS$###", "HLLS~##$", high, low,
+        "SBF1", "SBF10000001000", "SBF1" + std::string(32, '0'),
+        "SBF1" "0000001000" "0000000000" "07" "0000000000",      // no bits
+        "SBF1" "0000000008" "0000000000" "02" "0000000004" "@",  // fewer bits than capacity
+        "SBF1" "0000000001" "0000000002" "02" "0000000004" "@",  // over capacity
+        "SBF1" "0000000001" "0000000000" "00" "0000000004" "@",  // no hashes
+        "SBF1" "0000000001" "0000000000" "02" "0000000008" "@",  // bits missing
+        "SBF1" "0000000001" "0000000000" "02" "000000000-" "@",  // not a number
+        bloom.substr(0, bloom.size() - 1), bloom + "x",
+    };
+    for (const auto& value : hostile) {
+        kv.set("bad", value);
+        assert(!kv.pfcount({"bad"}) && !kv.pfadd("bad", {"x"}) && !kv.pfmerge("out", {"bad"}));
+        assert(!kv.bfexists("bad", "a") && !kv.bfadd("bad", "a") && kv.get("bad").value() == value);
+    }
+    assert(HyperLogLog::is_hll("HLLS###$##$$") && ScalableBloomFilter::is_bloom("SBF1" "0000000001" "0000000000" "01"
+                                                                                  "0000000004" "A"));
+    Logger::set_quiet(false);
+}
+
+void test_secondary_indexes() {
+    KeyValueStore kv;
+    kv.set("u1", "{\"name\": \"ann\", \"status\": \"active\", \"age\": 31}");
+    kv.set("u2", "{\"name\": \"bob\", \"status\": \"banned\"}");
+    kv.set("color", "red");
+    kv.create_index("by_status", "status");
+    kv.create_index("by_value");
+    kv.set("u3", "{\"status\": \"active\", \"tags\": [\"a\", \"b\"]}");
+    kv.set("paint", "red");
+
+    assert((kv.query_index("by_status", "active").value() == std::vector<std::string>{"u1", "u3"}));
+    assert((kv.query_index("by_value", "red").value() == std::vector<std::string>{"color", "paint"}));
+    assert(json_field("{\"age\": 31, \"x\": {\"y\": 1}}", "age").value() == "31");
+    assert(json_field("{\"age\": 31, \"x\": {\"y\": 1}}", "x").value() == "{\"y\": 1}");
+    assert(!json_field("not json", "age"));
+
+    // Overwrite and remove keep the index in sync
+    kv.set("u1", "{\"status\": \"banned\"}");
+    kv.remove("u3");
+    assert(kv.query_index("by_status", "active").value().empty());
+    assert(kv.query_index("by_status", "banned").value().size() == 2);
+    kv.clear();
+    assert(kv.query_index("by_value", "red").value().empty());
+    assert(!kv.query_index("missing", "x"));
+    assert(kv.drop_index("by_value") && kv.list_indexes().size() == 1);
+}
+
+// Property test: arbitrary bytes survive the CLI quoting and the snapshot file
+void test_binary_safety() {
+    std::mt19937 rng(12345);
+    auto random_bytes = [&](size_t max_len) {
+        std::string out(rng() % (max_len + 1), '\0');
+        for (char& c : out) c = static_cast<char>(rng() & 0xff);
+        return out;
+    };
+
+    Logger::set_quiet(true);
+    KeyValueStore kv;
+    std::unordered_map<std::string, std::string> expected;
+    for (int i = 0; i < 500; ++i) {
+        std::string key = random_bytes(24), value = random_bytes(i % 50 == 0 ? 5000 : 64);
+        auto args = split_args("set " + quote(key) + " " + quote(value));
+        assert(args && args->size() == 3 && (*args)[1] == key && (*args)[2] == value);
+        kv.set(key, value);
+        expected[key] = value;
+    }
+
+    const std::string path = "kvstore_test_binary.db";
+    kv.save_to_file(path);
+    KeyValueStore loaded;
+    loaded.load_from_file(path);
+    std::remove(path.c_str());
+    for (const auto& [key, value] : expected) assert(loaded.get(key).value() == value);
+
+    // Older JSON files still load, including escaped quotes and colons in keys
+    {
+        std::ofstream legacy(path);
+        legacy << "{\n  \"a:b\": \"say \\\"hi\\\"\",\n  \"n\": \"1\"\n}\n";
+    }
+    loaded.load_from_file(path);
+    std::remove(path.c_str());
+    assert(loaded.get("a:b").value() == "say \"hi\"" && loaded.get("n").value() == "1");
+    Logger::set_quiet(false);
+
+    assert(!split_args("set \"unterminated"));
+    assert((split_args("set 'a b' \"c\\x41\"").value() == std::vector<std::string>{"set", "a b", "cA"}));
+}
+
+void test_large_values() {
+    Logger::set_quiet(true);
+    KeyValueStore kv;
+
+    // Appends past the rope threshold never copy the existing value
+    std::string expected;
+    for (int i = 0; i < 300; ++i) {
+        std::string piece(7919, static_cast<char>('a' + i % 26));
+        kv.append("big", piece);
+        expected += piece;
+    }
+    assert(kv.strlen("big").value() == expected.size() && expected.size() > Value::kRopeThreshold);
+    assert(kv.get("big").value() == expected);
+    assert(kv.getrange("big", 65530, 65545).value() == expected.substr(65530, 16));
+    assert(kv.getrange("big", -5, -1).value() == expected.substr(expected.size() - 5));
+    assert(kv.getrange("big", 10, 5).value().empty());
+
+    // A streamed value is invisible until commit, and abort leaves no trace
+    ValueWriter writer = kv.open_writer("stream");
+    for (int i = 0; i < 40; ++i) writer.write(std::string(50000, static_cast<char>('0' + i % 10)));
+    assert(!kv.exists("stream"));
+    assert(writer.commit() && !writer.commit());
+    assert(kv.strlen("stream").value() == 2000000);
+    ValueWriter aborted = kv.open_writer("never");
+    aborted.write("data");
+    aborted.abort();
+    assert(!aborted.commit() && !kv.exists("never"));
+
+    // Readers see a stable snapshot
+    ValueReader reader = kv.open_reader("stream").value();
+    kv.set("stream", "replaced");
+    std::string first = reader.read(50001);
+    assert(first == std::string(50000, '0') + "1" && reader.size() == 2000000);
+
+    const std::string path = "kvstore_test_large.db";
+    kv.save_to_file(path);
+    KeyValueStore loaded;
+    loaded.load_from_file(path);
+    std::remove(path.c_str());
+    assert(loaded.get("big").value() == expected);
+    Logger::set_quiet(false);
+}
+
+void test_scripts() {
+    Logger::set_quiet(true);
+    KeyValueStore kv;
+    assert(kv.incr("n").value() == 1 && kv.incr("n", 41).value() == 42);
+    kv.set("text", "abc");
+    assert(!kv.incr("text"));
+
+    const std::string transfer =
+        "$1 get $3 < if \"insufficient funds\" error then "
+        "$1 0 $3 - incrby drop $2 $3 incrby";
+    kv.set("alice", "100");
+    ScriptResult r = kv.eval(transfer, {"alice", "bob", "30"});
+    assert(r.ok && r.value.value() == "30");
+    assert(kv.get("alice").value() == "70" && kv.get("bob").value() == "30");
+
+    // Failure undoes earlier writes of the same run
+    r = kv.eval(transfer, {"alice", "bob", "500"});
+    assert(!r.ok && r.error == "insufficient funds");
+    r = kv.eval("$1 \"x\" set $1 del drop \"text\" incr", {"fresh"});
+    assert(!r.ok && !kv.exists("fresh"));
+    assert(kv.get("alice").value() == "70");
+
+    // Cached by hash, runnable by id, bounded by the budget
+    std::string id = kv.script_load(transfer).value();
+    assert(id == script_id(transfer) && kv.evalsha(id, {"bob", "alice", "10"}).ok);
+    assert(kv.get("alice").value() == "80");
+    assert(!kv.evalsha("0000", {}).ok);
+    r = kv.eval("1 2 3 + + dup drop", {}, 3);
+    assert(!r.ok && r.error == "instruction budget exceeded");
+    assert(kv.eval("1 if \"yes\" else \"no\" then", {}).value.value() == "yes");
+    assert(kv.eval("0 if \"yes\" else \"no\" then", {}).value.value() == "no");
+    assert(!kv.eval("$1 get", {}).ok && !kv.eval("nosuchword", {}).ok);
+    assert(!kv.eval("9223372036854775807 1 +", {}).ok);
+    std::string error;
+    assert(!compile_script("$99999999999999999999999", error) && error == "argument index out of range");
+    assert(!kv.eval("$99999999999999999999999", {}).ok && !kv.script_load("$99999999999999999999999"));
+    Logger::set_quiet(false);
+}
+
+void test_namespaces() {
+    Logger::set_quiet(true);
+    NamespaceRegistry registry;
+    auto a = registry.open("tenant-a");
+    auto b = registry.open("tenant-b");
+    a->set("k", "from a");
+    b->set("k", "from b");
+    a->clear();
+    assert(!a->exists("k") && b->get("k").value() == "from b");
+
+    // Quotas and eviction are per namespace
+    a->set_quota(2000, EvictionPolicy::AllKeysLRU);
+    for (int i = 0; i < 100; ++i) a->set("key" + std::to_string(i), std::string(50, 'x'));
+    StoreStats sa = a->stats();
+    assert(sa.evictions > 0 && sa.used_bytes <= 2000 + 200 && a->exists("key99"));
+    assert(b->stats().evictions == 0);
+
+    b->set_quota(1, EvictionPolicy::NoEviction);
+    assert(!b->set("other", "v") && b->stats().rejected_writes == 1);
+    b->remove("k");
+    assert(b->set("other", "v"));
+    b->set_quota(0, EvictionPolicy::NoEviction);
+
+    a->get("key99");
+    a->get("missing");
+    assert(a->stats().hits == 1 && a->stats().misses == 1);
+
+    // All namespaces round-trip through one file
+    const std::string path = "kvstore_test_ns.db";
+    registry.save_to_file(path);
+    NamespaceRegistry restored;
+    restored.load_from_file(path);
+    std::remove(path.c_str());
+    assert(restored.find("tenant-b")->get("other").value() == "v");
+    assert(restored.find("tenant-a")->stats().keys == sa.keys);
+    assert(registry.drop("tenant-a") && !registry.find("tenant-a") && a->stats().keys == 0);
+    Logger::set_quiet(false);
+}
+
+void test_epoch_reclamation() {
+    static std::atomic<int> freed{0};
+    auto counted_delete = [](void* p) {
+        delete static_cast<int*>(p);
+        ++freed;
+    };
+    EpochReclaimer& ebr = EpochReclaimer::instance();
+
+    // A thread pinned before the retirement holds it back until it unpins
+    // or passes a quiescent point
+    std::atomic<int> step{0};
+    std::thread reader([&] {
+        EpochReclaimer::Guard guard(ebr);
+        step = 1;
+        while (step != 2) std::this_thread::yield();
+        ebr.quiescent();
+        step = 3;
+        while (step != 4) std::this_thread::yield();
+    });
+    while (step != 1) std::this_thread::yield();
+    ebr.retire(new int(1), counted_delete);
+    for (int i = 0; i < 4; ++i) ebr.reclaim();
+    assert(freed == 0);
+    step = 2;
+    while (step != 3) std::this_thread::yield();
+    for (int i = 0; i < 4; ++i) ebr.reclaim();
+    assert(freed == 1);
+    step = 4;
+    reader.join();
+
+    // Retirements from an exited thread are adopted by the survivors
+    std::thread([&] { ebr.retire(new int(2), counted_delete); }).join();
+    for (int i = 0; i < 4 && freed != 2; ++i) ebr.reclaim();
+    assert(freed == 2);
+
+    // An adopted deleter that retires enough to trigger a scan of its own
+    // runs with the orphan list unlocked
+    std::thread([&] {
+        ebr.retire(new int(3), [](void* p) {
+            delete static_cast<int*>(p);
+            for (int i = 0; i < 64; ++i) EpochReclaimer::instance().retire(new int(i), [](void* q) {
+                delete static_cast<int*>(q);
+                ++freed;
+            });
+        });
+    }).join();
+    for (int i = 0; i < 8; ++i) ebr.reclaim();
+    ebr.synchronize();
+    assert(freed == 66);
+    EpochReclaimer::Stats st = ebr.stats();
+    assert(st.freed <= st.retired);
+}
+
+// Properties every linearizable map has, checked under concurrent load:
+// no lost read-modify-writes, exact final contents for per-thread keys, and
+// a single writer's register never read going backwards
+template <typename Table>
+void stress_concurrent_table() {
+    Table map;
+    const int threads = 4, ops = 2000;
+    std::atomic<bool> regressed{false};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            long long last_seen = -1;
+            for (int i = 0; i < ops; ++i) {
+                map.update("counter", [](const Value* v) -> std::optional<Value> {
+                    return Value(std::to_string(v ? parse_int(v->str()).value() + 1 : 1));
+                });
+                std::string key = std::to_string(t) + ":" + std::to_string(i);
+                map.insert_or_assign(key, Value(key));
+                if (i % 2) map.erase(key);
+                if (t == 0) {
+                    map.insert_or_assign("register", Value(std::to_string(i)));
+                } else if (auto v = map.find("register")) {
+                    long long seen = parse_int(v->str()).value();
+                    if (seen < last_seen) regressed = true;
+                    last_seen = seen;
+                }
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    assert(!regressed);
+    assert(map.find("counter")->str() == std::to_string(threads * ops));
+    assert(map.size() == static_cast<size_t>(threads * ops / 2 + 2));
+    size_t visited = 0;
+    map.for_each([&](const std::string&, const Value&) { ++visited; });
+    assert(visited == map.size());
+    for (int t = 0; t < threads; ++t) {
+        assert(map.contains(std::to_string(t) + ":0") && !map.contains(std::to_string(t) + ":1"));
+    }
+}
+
+// A walk in steps that erases each step's matches before the next still
+// sees every matching key once, while another thread keeps inserting
+template <typename Table>
+void walk_concurrent_table_in_steps() {
+    Table map;
+    for (int i = 0; i < 5000; ++i) {
+        map.insert_or_assign("a:" + std::to_string(i), Value("a"));
+        map.insert_or_assign("b:" + std::to_string(i), Value("b"));
+    }
+    std::atomic<bool> stop{false};
+    std::thread writer([&] {
+        for (int i = 0; !stop; ++i) map.insert_or_assign("c:" + std::to_string(i % 20000), Value("c"));
+    });
+    TableCursor cursor;
+    std::unordered_set<std::string> seen;
+    size_t steps = 0, duplicates = 0;
+    while (!cursor.done) {
+        std::vector<std::string> matched;
+        map.walk_step("a:", cursor, 100, [&](const std::string& key, const Value&) { matched.push_back(key); });
+        for (const auto& key : matched) {
+            duplicates += !seen.insert(key).second;
+            map.erase(key);
+        }
+        ++steps;
+    }
+    stop = true;
+    writer.join();
+    assert(seen.size() == 5000 && steps > 10 && !map.contains("a:42") && map.contains("b:42"));
+    assert(duplicates == 0 || std::string(map.name()) == "cuckoo"); // a displaced entry may show twice
+}
+
+void test_concurrent_backends() {
+    Logger::set_quiet(true);
+    for (Backend backend : {Backend::LockFree, Backend::Cuckoo, Backend::Prefix}) {
+        KeyValueStore kv(backend);
+        for (int i = 0; i < 5000; ++i) kv.set("key" + std::to_string(i), std::to_string(i));
+        kv.set("key7", "seven");
+        kv.remove("key8");
+        assert(kv.get("key7").value() == "seven" && !kv.exists("key8") && kv.get("key4999").value() == "4999");
+        assert(kv.stats().keys == 4999);
+        assert(kv.incr("n", 5).value() == 5 && kv.incr("n").value() == 6 && !kv.incr("key7"));
+        assert(kv.append("s", "ab").value() == 2 && kv.append("s", "cd").value() == 4);
+        assert(kv.getrange("s", 1, -1).value() == "bcd" && kv.strlen("s").value() == 4);
+        assert(!kv.pfadd("h", {"x"}) && !kv.create_index("by_value"));
+        kv.clear();
+        assert(kv.stats().keys == 0 && !kv.exists("key7"));
+    }
+
+    // Cuckoo only grows once displacement fails, so it stays well filled
+    CuckooHashMap cuckoo;
+    for (int i = 0; i < 20000; ++i) cuckoo.insert_or_assign(std::to_string(i), Value("v"));
+    assert(cuckoo.size() == 20000 && cuckoo.load_factor() > 0.45);
+
+    stress_concurrent_table<LockFreeHashMap>();
+    stress_concurrent_table<CuckooHashMap>();
+    stress_concurrent_table<FrontCodedTable>();
+    walk_concurrent_table_in_steps<LockFreeHashMap>();
+    walk_concurrent_table_in_steps<CuckooHashMap>();
+    walk_concurrent_table_in_steps<FrontCodedTable>();
+    Logger::set_quiet(false);
+}
+
+void test_task_scheduler() {
+    SchedulerOptions options;
+    options.workers = 2;
+    options.max_cpu_share = 1.0;
+    {
+        TaskScheduler scheduler(options);
+        std::atomic<int> done{0};
+        for (int i = 0; i < 100; ++i) scheduler.run("count", [&] { ++done; });
+        scheduler.wait_idle();
+        assert(done == 100 && scheduler.stats().completed == 100);
+
+        // Tasks spawned by a busy worker land on its own deque, so they only
+        // finish if the other worker steals them
+        std::atomic<int> children{0};
+        scheduler.run("parent", [&] {
+            for (int i = 0; i < 10; ++i) scheduler.run("child", [&] { ++children; });
+            auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+            while (children < 10 && std::chrono::steady_clock::now() < give_up) std::this_thread::yield();
+        });
+        scheduler.wait_idle();
+        assert(children == 10);
+        uint64_t stolen = 0;
+        for (const auto& w : scheduler.stats().workers) stolen += w.stolen;
+        assert(stolen > 0);
+    }
+
+    // One worker: priorities are served in order, and a task that yields
+    // lets the queued work run before its next slice
+    options.workers = 1;
+    options.slice = std::chrono::microseconds(0);
+    TaskScheduler scheduler(options);
+    std::atomic<bool> gate{false};
+    std::mutex order_mutex;
+    std::string order;
+    auto record = [&](char c) {
+        std::lock_guard<std::mutex> lock(order_mutex);
+        order += c;
+    };
+    scheduler.run("gate", [&] { while (!gate) std::this_thread::yield(); });
+    int slices = 0;
+    scheduler.submit("long", [&](TaskContext& ctx) {
+        record('L');
+        return ++slices < 3 && ctx.should_yield() ? TaskStatus::Yield : TaskStatus::Done;
+    });
+    scheduler.run("normal", [&] { record('N'); });
+    scheduler.run("low", [&] { record('W'); }, TaskPriority::Low);
+    scheduler.run("high", [&] { record('H'); }, TaskPriority::High);
+    gate = true;
+    scheduler.wait_idle();
+    assert(order == "HLNLLW");
+
+    // A task sleeping off resume_after() leaves the worker to the others
+    const auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration napped{};
+    int naps = 0;
+    scheduler.submit("nap", [&](TaskContext& ctx) {
+        if (naps++ == 0) {
+            ctx.resume_after(std::chrono::milliseconds(30));
+            return TaskStatus::Yield;
+        }
+        napped = std::chrono::steady_clock::now() - start;
+        record('S');
+        return TaskStatus::Done;
+    });
+    scheduler.run("normal", [&] { record('N'); });
+    scheduler.wait_idle();
+    assert(order == "HLNLLWNS" && naps == 2 && napped >= std::chrono::milliseconds(30));
+    assert(scheduler.stats().sleeping == 0);
+}
+
+void test_flat_combining() {
+    Logger::set_quiet(true);
+    KeyValueStore kv;
+    assert(kv.set_flat_combining(true));
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 8; ++t) {
+        writers.emplace_back([&kv, t] {
+            for (int i = 0; i < 200; ++i) {
+                std::string key = "w" + std::to_string(t) + ":" + std::to_string(i);
+                kv.set(key, key);
+                if (i % 4 == 0) kv.remove(key);
+            }
+        });
+    }
+    for (auto& w : writers) w.join();
+    StoreStats st = kv.stats();
+    assert(st.keys == 8 * 150 && st.combined_ops == 8 * 250 && st.combining_passes <= st.combined_ops);
+    assert(kv.get("w3:1").value() == "w3:1" && !kv.exists("w3:4"));
+
+    // Quota rejections come back through the slot
+    kv.set_quota(1, EvictionPolicy::NoEviction);
+    assert(!kv.set("over", "quota"));
+    assert(!KeyValueStore(Backend::LockFree).set_flat_combining(true));
+    Logger::set_quiet(false);
+}
+
+void test_source_command() {
+    const std::string path = "kvstore_test_source.txt", nested = "kvstore_test_nested.txt";
+    auto write = [](const std::string& file, const std::string& text) {
+        std::ofstream(file, std::ios::binary | std::ios::trunc) << text;
+    };
+    NamespaceRegistry namespaces;
+    CliSession session(namespaces);
+    KeyValueStore& kv = *session.selected;
+
+    write(path, "# warm-up\nset a 1\r\nset \"b c\" \"two words\"\n\nincr a\nincr \"b c\"\nset broken \"quote\n"
+                "get a\nstrlen \"b c\"");
+    auto summary = source_file(session, path, SourceOptions());
+    assert(summary && summary->commands == 7 && summary->failed == 2 && summary->errors.size() == 2);
+    assert(summary->errors[0].rfind("line 6: ", 0) == 0 && summary->errors[1].rfind("line 7: ", 0) == 0);
+    assert(kv.get("a").value() == "2" && kv.get("b c").value() == "two words");
+
+    // Atomic batches: a failing batch leaves no trace, the others stay
+    SourceOptions atomic;
+    atomic.atomic = true;
+    atomic.batch = 2;
+    write(path, "set x 1\nincr x\nset y 1\nincr \"b c\"\nset z 1\nflushall\nremove a\nset a 9\n");
+    summary = source_file(session, path, atomic);
+    assert(summary && summary->commands == 8 && summary->failed == 3 && summary->rolled_back == 2);
+    assert(kv.get("x").value() == "2" && !kv.exists("y") && !kv.exists("z") && kv.get("a").value() == "9");
+
+    // Nested files count as one failing line; exit stops the file
+    write(nested, "incr \"b c\"\n");
+    write(path, "source " + nested + "\nset after 1\nexit\nset never 1\n");
+    summary = source_file(session, path, SourceOptions());
+    assert(summary && summary->commands == 3 && summary->failed == 1);
+    assert(kv.exists("after") && !kv.exists("never") && !Logger::error_sink());
+
+    // A negative quota is a usage error, not a huge size_t
+    write(path, "quota -1\nquota 99999999999999999999\nquota 1000000 allkeys-lru\n");
+    summary = source_file(session, path, SourceOptions());
+    assert(summary && summary->failed == 2 && kv.stats().quota_bytes == 1000000);
+    std::remove(nested.c_str());
+    std::remove(path.c_str());
+    assert(!source_file(session, path, SourceOptions()));
+}
+
+void test_table_images() {
+    Logger::set_quiet(true);
+    const std::string path = "kvstore_test_image.img";
+    KeyValueStore kv;
+    for (int i = 0; i < 500; ++i) kv.set("key" + std::to_string(i), "value" + std::to_string(i));
+    kv.set(std::string("bin\0key", 7), std::string("\0\n\r", 3));
+    kv.set("empty", "");
+    kv.set("n", "41");
+    kv.set("text", "hello");
+    std::string big(Value::kRopeThreshold + 12345, 'x');
+    kv.set("big", big);
+    assert(kv.save_image(path));
+
+    KeyValueStore loaded;
+    loaded.set("stale", "gone after load");
+    assert(loaded.load_image(path));
+    assert(loaded.stats().keys == kv.stats().keys && loaded.stats().used_bytes == kv.stats().used_bytes);
+    assert(!loaded.exists("stale"));
+    for (int i = 0; i < 500; ++i) assert(loaded.get("key" + std::to_string(i)).value() == "value" + std::to_string(i));
+    assert(loaded.get(std::string("bin\0key", 7)).value() == std::string("\0\n\r", 3));
+    assert(loaded.get("empty").value().empty() && loaded.exists("empty"));
+    assert(loaded.get("big").value() == big && loaded.strlen("big").value() == big.size());
+    assert(loaded.getrange("text", 1, 3).value() == "ell");
+
+    // A bulk delete walks the image in steps rather than moving it live first
+    KeyValueStore pruned;
+    assert(pruned.load_image(path));
+    pruned.set("key1", "live");
+    assert(pruned.delete_prefix("key1")->wait().deleted == 111);
+    assert(!pruned.exists("key1") && !pruned.exists("key150") && pruned.get("key2").value() == "value2");
+    assert(pruned.stats().keys == kv.stats().keys - 111);
+
+    // Writes land in the live table and shadow the image
+    loaded.set("key1", "changed");
+    loaded.remove("key2");
+    assert(loaded.incr("n").value() == 42 && loaded.append("text", "!").value() == 6);
+    assert(loaded.get("key1").value() == "changed" && !loaded.get("key2") && loaded.get("text").value() == "hello!");
+    loaded.remove("key2");
+    assert(loaded.stats().keys == kv.stats().keys - 1);
+    loaded.save_to_file(path); // iterates the live table and the image
+    KeyValueStore snapshot;
+    snapshot.load_from_file(path);
+    assert(snapshot.stats().keys == loaded.stats().keys && snapshot.get("key1").value() == "changed");
+    assert(snapshot.get("key3").value() == "value3" && !snapshot.exists("key2"));
+
+    // Re-imaging over the mapped file, then the quota path moves everything live
+    assert(loaded.save_image(path));
+    KeyValueStore again;
+    assert(again.load_image(path) && again.get("key1").value() == "changed" && !again.exists("key2"));
+    again.set_quota(1 << 30, EvictionPolicy::AllKeysLRU);
+    assert(again.get("n").value() == "42" && again.stats().keys == loaded.stats().keys);
+
+    // Damaged or truncated images are rejected and leave the store alone
+    std::string bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    for (size_t at : {size_t{3}, sizeof(ImageHeader) + 5, bytes.size() - 9}) {
+        std::string bad = bytes;
+        bad[at] ^= 0x40;
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << bad;
+        assert(!again.load_image(path) && again.get("n").value() == "42");
+    }
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << bytes.substr(0, bytes.size() / 2);
+    assert(!again.load_image(path));
+    std::remove(path.c_str());
+    assert(!again.load_image(path));
+    Logger::set_quiet(false);
+}
+
+void test_basic_store() {
+    static_assert(std::is_same_v<EmbeddedStore<uint64_t, double>::mapped_type, double>);
+    static_assert(std::is_same_v<DefaultStoreMap<uint64_t, double, std::hash<uint64_t>>, FlatIntMap<uint64_t, double>>);
+    static_assert(std::is_same_v<DefaultStoreMap<std::string, int, std::hash<std::string>>,
+                                 std::unordered_map<std::string, int>>);
+
+    Logger::set_quiet(true);
+    BasicKeyValueStore<std::string, std::string> logged;
+    logged.set("a", "1");
+    assert(logged.get("a").value() == "1" && !logged.get("b"));
+    assert(logged.remove("a") && !logged.remove("a") && logged.size() == 0);
+    auto metrics = logged.log();
+    assert(metrics.hits == 1 && metrics.misses == 1 && metrics.writes == 1 && metrics.deletes == 1);
+    Logger::set_quiet(false);
+
+    // The flat map against std::unordered_map under random inserts and erases
+    EmbeddedStore<uint64_t, uint64_t> flat;
+    std::unordered_map<uint64_t, uint64_t> reference;
+    std::mt19937 rng(7);
+    for (int i = 0; i < 50000; ++i) {
+        uint64_t key = rng() % 2000;
+        if (rng() % 3 == 0) {
+            assert(flat.remove(key) == (reference.erase(key) > 0));
+        } else {
+            flat.set(key, i);
+            reference[key] = i;
+        }
+    }
+    assert(flat.size() == reference.size());
+    for (uint64_t key = 0; key < 2000; ++key) {
+        auto it = reference.find(key);
+        const uint64_t* value = flat.peek(key);
+        assert(it == reference.end() ? !value : value && *value == it->second);
+    }
+    size_t visited = 0;
+    flat.for_each([&](uint64_t key, uint64_t value) { visited += reference.at(key) == value; });
+    assert(visited == reference.size());
+    flat.clear();
+    assert(flat.size() == 0 && !flat.get(1));
+}
+
+void test_store_locks() {
+    assert(parse_lock_policy("adaptive") == LockPolicy::Adaptive && !parse_lock_policy("spin"));
+    for (LockPolicy policy : {LockPolicy::Mutex, LockPolicy::Adaptive, LockPolicy::Ticket}) {
+        StoreLock lock(policy);
+        assert(lock.try_lock());
+        std::thread([&] { assert(!lock.try_lock()); }).join();
+        lock.unlock();
+
+        long long counter = 0;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&] {
+                for (int i = 0; i < 20000; ++i) {
+                    std::lock_guard<StoreLock> guard(lock);
+                    ++counter;
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+        assert(counter == 80000);
+
+        Logger::set_quiet(true);
+        KeyValueStore kv(Backend::Locked, policy);
+        assert(kv.lock_policy() == policy);
+        threads.clear();
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&] {
+                for (int i = 0; i < 1000; ++i) kv.incr("n");
+            });
+        }
+        for (auto& t : threads) t.join();
+        assert(kv.get("n").value() == "4000");
+        Logger::set_quiet(false);
+    }
+}
+
+void test_near_cache() {
+    Logger::set_quiet(true);
+    for (Backend backend : {Backend::Locked, Backend::LockFree, Backend::Cuckoo}) {
+        KeyValueStore kv(backend), other(backend);
+        kv.set_near_cache(true);
+        other.set_near_cache(true);
+        auto hits = [] { return KeyValueStore::near_cache_stats().hits; };
+        kv.set("k", "1");
+        other.set("k", "other");
+        assert(kv.get("k").value() == "1");
+        uint64_t before = hits();
+        assert(kv.get("k").value() == "1" && other.get("k").value() == "other" && other.get("k").value() == "other");
+        assert(hits() == before + 2);
+
+        // Every kind of write invalidates
+        kv.set("k", "2");
+        assert(kv.get("k").value() == "2");
+        assert(kv.incr("k", 3).value() == 5 && kv.get("k").value() == "5");
+        assert(kv.append("k", "x").value() == 2 && kv.get("k").value() == "5x");
+        kv.remove("k");
+        assert(!kv.get("k"));
+        kv.set("k", "3");
+        kv.get("k");
+        kv.clear();
+        assert(!kv.get("k"));
+
+        // A write from another thread makes this thread's entry miss
+        kv.set("shared", "old");
+        assert(kv.get("shared").value() == "old");
+        std::thread([&] {
+            assert(kv.get("shared").value() == "old");
+            kv.set("shared", "new");
+        }).join();
+        assert(kv.get("shared").value() == "new");
+
+        std::string big(KeyValueStore::kNearCacheMaxValue + 1, 'b');
+        kv.set("big", big);
+        kv.get("big");
+        before = hits();
+        assert(kv.get("big").value() == big && hits() == before);
+
+        // Turning the cache off and on again cannot revive stale entries
+        kv.set_near_cache(false);
+        kv.set("shared", "newer");
+        kv.set_near_cache(true);
+        assert(kv.get("shared").value() == "newer");
+    }
+    KeyValueStore kv;
+    kv.set_near_cache(true);
+    kv.set("n", "1");
+    kv.get("n");
+    assert(kv.eval("\"n\" \"2\" set", {}).ok && kv.get("n").value() == "2");
+    Logger::set_quiet(false);
+}
+
+void test_numa_partitions() {
+    assert((parse_id_list("0-2,5") == std::vector<int>{0, 1, 2, 5}) && parse_id_list("3-1").empty());
+    NumaTopology topology = NumaTopology::simulate(2);
+    assert(topology.nodes.size() == 2 && !topology.nodes[1].cpus.empty());
+
+    Logger::set_quiet(true);
+    NumaStore store(topology);
+    for (int i = 0; i < 200; ++i) store.set("key" + std::to_string(i), std::to_string(i));
+    for (int i = 0; i < 200; ++i) assert(store.get("key" + std::to_string(i)).value() == std::to_string(i));
+    store.remove("key0");
+    assert(!store.get("key0"));
+    size_t keys = 0;
+    uint64_t executed = 0;
+    for (const auto& node : store.stats()) {
+        assert(node.keys > 0 && node.cross_node == node.executed); // this thread is bound to no node
+        keys += node.keys;
+        executed += node.executed;
+    }
+    assert(keys == 199 && executed == 402);
+    Logger::set_quiet(false);
+}
+
+void test_autosave() {
+    using namespace std::chrono_literals;
+    const std::string path = "test_autosave.kv";
+    std::remove(path.c_str());
+    Logger::set_quiet(true);
+    NamespaceRegistry namespaces;
+    auto wait_for_saves = [](SnapshotScheduler& autosave, uint64_t saves) {
+        for (int i = 0; i < 500 && (autosave.status().saves < saves || autosave.status().saving); ++i) {
+            std::this_thread::sleep_for(10ms);
+        }
+        return autosave.status();
+    };
+    {
+        SnapshotScheduler autosave(namespaces, path, {{2, 0s}}, 0ms, 5ms);
+        namespaces.open("a")->set("k1", "v1");
+        std::this_thread::sleep_for(30ms);
+        assert(autosave.status().saves == 0 && autosave.status().dirty == 1); // below the rule
+        namespaces.open(NamespaceRegistry::kDefault)->set("k2", "v2");
+        AutosaveStatus status = wait_for_saves(autosave, 1);
+        assert(status.saves == 1 && status.last_ok && status.dirty == 0 && status.last_save);
+
+        // Clean data is not saved again
+        std::this_thread::sleep_for(30ms);
+        assert(autosave.status().saves == 1);
+        namespaces.drop("a"); // dropping counts as a change
+        namespaces.open(NamespaceRegistry::kDefault)->set("k3", "v3");
+        assert(wait_for_saves(autosave, 2).saves == 2);
+    }
+    NamespaceRegistry restored;
+    restored.load_from_file(path);
+    assert(restored.open(NamespaceRegistry::kDefault)->get("k3").value() == "v3" && !restored.find("a"));
+    {
+        // Rules fire but the minimum interval holds the second save back
+        SnapshotScheduler autosave(namespaces, path, {{1, 0s}}, 1h, 5ms);
+        namespaces.open(NamespaceRegistry::kDefault)->set("k4", "v4");
+        assert(wait_for_saves(autosave, 1).saves == 1);
+        namespaces.open(NamespaceRegistry::kDefault)->set("k5", "v5");
+        std::this_thread::sleep_for(30ms);
+        assert(!autosave.check() && autosave.status().saves == 1 && autosave.status().dirty == 1);
+    }
+    Logger::set_quiet(false);
+    std::remove(path.c_str());
+}
+
+void test_compressed_snapshots() {
+    std::mt19937 rng(11);
+    std::string random(5000, '\0');
+    for (auto& c : random) c = static_cast<char>(rng());
+    std::string text;
+    for (int i = 0; i < 2000; ++i) text += "{\"id\": " + std::to_string(i) + ", \"name\": \"user" + std::to_string(i % 37) + "\"}\n";
+    for (const std::string& input : {std::string(), std::string("abc"), std::string(1000, 'x'), random, text}) {
+        for (int level : {1, 5, 9}) {
+            std::string packed;
+            lz::compress(input.data(), input.size(), packed, level);
+            std::string out(input.size(), '\0');
+            assert(lz::decompress(packed.data(), packed.size(), &out[0], out.size()) && out == input);
+            if (input == text) assert(packed.size() < text.size() / 3);
+            // Damaged input fails cleanly instead of overrunning
+            if (!packed.empty()) {
+                assert(!lz::decompress(packed.data(), packed.size() / 2, &out[0], out.size()) || input.empty());
+                assert(!lz::decompress(packed.data(), packed.size(), &out[0], out.size() + 1));
+            }
+        }
+    }
+
+    Logger::set_quiet(true);
+    const std::string path = "test_compressed.kv";
+    SnapshotOptions options;
+    options.compress = true;
+    options.block_size = 1024; // many blocks
+    options.threads = 4;
+    KeyValueStore kv;
+    for (int i = 0; i < 3000; ++i) kv.set("key" + std::to_string(i), "value " + std::to_string(i * 7));
+    kv.set("binary", std::string("a\0b\n", 4) + random);
+    kv.save_to_file(path, options);
+    {
+        KeyValueStore loaded;
+        loaded.load_from_file(path);
+        assert(loaded.stats().keys == kv.stats().keys && loaded.get("key2999").value() == "value 20993");
+        assert(loaded.get("binary").value() == kv.get("binary").value());
+    }
+
+    // A flipped byte is caught by the block checksum; nothing is replaced
+    std::string file;
+    {
+        std::ifstream in(path, std::ios::binary);
+        file.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    assert(file.compare(0, kCompressedSnapshotMagic.size(), kCompressedSnapshotMagic) == 0);
+    std::string raw;
+    assert(inflate_snapshot(file, raw, 3) && raw.compare(0, kSnapshotMagic.size(), kSnapshotMagic) == 0);
+    file[file.size() / 2] ^= 0x20;
+    assert(!inflate_snapshot(file, raw));
+    assert(!inflate_snapshot(file.substr(0, file.size() - 1), raw));
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << file;
+    }
+    std::vector<std::string> errors;
+    Logger::set_error_sink(&errors);
+    KeyValueStore untouched;
+    untouched.set("keep", "me");
+    untouched.load_from_file(path);
+    Logger::set_error_sink(nullptr);
+    assert(errors.size() == 1 && untouched.get("keep").value() == "me");
+
+    // Blocks claiming more than the writer can produce are rejected before
+    // anything is allocated: over the block size, or over the LZ4 ratio
+    auto forged = [](uint64_t raw, uint64_t stored, int blocks) {
+        std::string f = kCompressedSnapshotMagic;
+        for (int i = 0; i < blocks; ++i) {
+            put_le(f, raw, 4);
+            put_le(f, stored, 4);
+            put_le(f, 0, 8);
+            f.append(stored, '\0');
+        }
+        return f + std::string(kBlockHeaderSize, '\0');
+    };
+    assert(!inflate_snapshot(forged(0xFFFFFFFF, 1, 64), raw));
+    assert(!inflate_snapshot(forged(kMaxSnapshotBlock, 1, 1), raw));
+    assert(!inflate_snapshot(forged(1000 * kMaxBlockRatio, 1000, 1), raw));
+
+    // Highly compressible data stays within the ratio, and a save that runs
+    // as a background task itself (like autosave) does not wait on blocks
+    // queued behind it
+    KeyValueStore zeros;
+    zeros.set("z", std::string(3 << 20, '\0'));
+    SnapshotOptions big;
+    big.compress = true;
+    std::promise<void> saved;
+    background_tasks().run("save", [&] {
+        zeros.save_to_file(path, big);
+        saved.set_value();
+    });
+    saved.get_future().get();
+    {
+        KeyValueStore loaded;
+        loaded.load_from_file(path);
+        assert(loaded.get("z").value() == std::string(3 << 20, '\0'));
+    }
+
+    // Namespaced snapshots go through the same path
+    NamespaceRegistry namespaces;
+    namespaces.open("a")->set("x", "1");
+    namespaces.open(NamespaceRegistry::kDefault)->set("y", "2");
+    options.threads = 1;
+    assert(namespaces.save_to_file(path, options));
+    NamespaceRegistry restored;
+    restored.load_from_file(path);
+    assert(restored.open("a")->get("x").value() == "1" && restored.open(NamespaceRegistry::kDefault)->get("y").value() == "2");
+    std::remove(path.c_str());
+    Logger::set_quiet(false);
+}
+
+void test_cache_mode() {
+    using namespace std::chrono_literals;
+    // In-memory source with a configurable load delay and failing writes
+    struct TestBacking : BackingStore {
+        const char* name() const override { return "test"; }
+        std::optional<std::string> load(const std::string& key) override {
+            ++loads;
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms.load()));
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = data.find(key);
+            if (it == data.end()) return std::nullopt;
+            return it->second;
+        }
+        bool store(const std::vector<std::pair<std::string, std::optional<std::string>>>& batch) override {
+            if (fail) return false;
+            std::lock_guard<std::mutex> lock(mutex);
+            largest_batch = std::max(largest_batch, batch.size());
+            for (const auto& [key, value] : batch) {
+                if (value) data[key] = *value;
+                else data.erase(key);
+            }
+            return true;
+        }
+        std::optional<std::string> peek(const std::string& key) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = data.find(key);
+            return it == data.end() ? std::nullopt : std::optional<std::string>(it->second);
+        }
+        std::mutex mutex;
+        std::map<std::string, std::string> data;
+        std::atomic<int> loads{0};
+        std::atomic<int> delay_ms{0};
+        std::atomic<bool> fail{false};
+        size_t largest_batch = 0;
+    };
+
+    Logger::set_quiet(true);
+    auto backing = std::make_shared<TestBacking>();
+    backing->data["k1"] = "v1";
+    KeyValueStore kv;
+    CacheOptions options;
+    options.negative_ttl = 1h;
+    options.flush_delay = 1ms;
+    kv.set_backing_store(backing, options);
+
+    // Read-through fills the table without counting as a change; a missing
+    // key is remembered
+    const uint64_t changes = kv.changes();
+    assert(kv.get("k1").value() == "v1" && kv.get("k1").value() == "v1" && backing->loads == 1);
+    assert(kv.changes() == changes);
+    assert(!kv.get("missing") && !kv.get("missing") && backing->loads == 2);
+    kv.set("missing", "now");
+    assert(kv.get("missing").value() == "now");
+    assert(kv.flush_backing() && backing->peek("missing").value() == "now");
+    kv.remove("k1");
+    assert(kv.flush_backing() && !backing->peek("k1") && !kv.get("k1"));
+    CacheStats st = kv.cache_stats().value();
+    assert(st.negative_hits == 2 && st.loads == 2 && st.hits == 2 && st.queued == 0 && st.written == 2);
+
+    // Concurrent misses on one key share a load
+    backing->data["slow"] = "value";
+    backing->delay_ms = 50;
+    std::vector<std::thread> readers;
+    std::atomic<int> correct{0};
+    for (int t = 0; t < 8; ++t) {
+        readers.emplace_back([&] { correct += kv.get("slow") == std::optional<std::string>("value"); });
+    }
+    for (auto& t : readers) t.join();
+    assert(correct == 8 && backing->loads == 3);
+
+    // A write during a load wins over the loaded value
+    backing->data["race"] = "old";
+    std::thread reader([&] { kv.get("race"); });
+    std::this_thread::sleep_for(10ms);
+    kv.set("race", "new");
+    reader.join();
+    backing->delay_ms = 0;
+    assert(kv.get("race").value() == "new");
+
+    // Writes go out in batches, and failed batches are retried
+    for (int i = 0; i < 300; ++i) kv.set("batch" + std::to_string(i), std::to_string(i));
+    assert(kv.flush_backing() && backing->peek("batch299").value() == "299" && backing->largest_batch <= 128);
+    backing->fail = true;
+    kv.set("retry", "1");
+    assert(!kv.flush_backing() && kv.cache_stats()->queued == 1);
+    backing->fail = false;
+    assert(kv.flush_backing() && backing->peek("retry").value() == "1");
+
+    // Without a flush, the flusher task sends writes once the delay is over
+    kv.set("behind", "1");
+    auto give_up = std::chrono::steady_clock::now() + 5s;
+    while (!backing->peek("behind") && std::chrono::steady_clock::now() < give_up) std::this_thread::sleep_for(1ms);
+    assert(backing->peek("behind").value() == "1");
+
+    std::vector<std::string> errors;
+    Logger::set_error_sink(&errors);
+    assert(!kv.incr("counter") && !kv.append("race", "x"));
+    Logger::set_error_sink(nullptr);
+    assert(errors.size() == 2);
+
+    // Leaving cache mode sends what is queued; the directory store round-trips any key
+    kv.set("last", "write");
+    kv.set_backing_store(nullptr);
+    assert(backing->peek("last").value() == "write" && !kv.cache_mode());
+    EpochReclaimer::instance().synchronize(); // the retired cache lets go of its backing store
+    assert(backing.use_count() == 1);
+
+    // Fills bypass the quota: a noeviction store still caches what it loads
+    {
+        KeyValueStore full;
+        full.set("resident", "value");
+        full.set_quota(1, EvictionPolicy::NoEviction);
+        full.set_backing_store(backing, options);
+        assert(full.get("batch7").value() == "7" && full.get("batch7").value() == "7");
+        assert(full.cache_stats()->loads == 1 && full.exists("resident"));
+        full.set_backing_store(nullptr);
+    }
+    const std::string dir = "test_cache_dir";
+    {
+        auto directory = std::make_shared<DirectoryBackingStore>(dir);
+        KeyValueStore writer;
+        writer.set_backing_store(directory);
+        writer.set(std::string("a/b\0c", 5), "binary key");
+        writer.set_backing_store(nullptr);
+        KeyValueStore reader_kv;
+        reader_kv.set_backing_store(directory);
+        assert(reader_kv.get(std::string("a/b\0c", 5)).value() == "binary key" && directory->loads() == 1);
+    }
+    std::filesystem::remove_all(dir);
+    Logger::set_quiet(false);
+}
+
+void test_lazy_free() {
+    Logger::set_quiet(true);
+    KeyValueStore kv;
+    kv.create_index("by_value");
+    for (int i = 0; i < 1000; ++i) kv.set("key" + std::to_string(i), "v" + std::to_string(i % 10));
+    kv.clear();
+    StoreStats st = kv.stats();
+    assert(st.keys == 0 && st.used_bytes == 0 && st.lazy_frees == 1);
+    assert(kv.query_index("by_value", "v1").value().empty() && kv.list_indexes().size() == 1);
+    kv.set("again", "v1");
+    assert(kv.query_index("by_value", "v1").value() == std::vector<std::string>{"again"});
+
+    // Large values leave in the background; readers keep their copy
+    const std::string big(3 << 20, 'x');
+    kv.set("big", big);
+    ValueReader reader = kv.open_reader("big").value();
+    kv.remove("big");
+    kv.set("big", big);
+    kv.set("big", "small now");
+    kv.set("big", "smaller");
+    assert(kv.stats().lazy_frees == 3 && reader.read(SIZE_MAX) == big);
+
+    // Off frees in place; small tables are always freed in place
+    kv.set_lazy_free(false);
+    kv.set("big", big);
+    kv.remove("big");
+    for (int i = 0; i < 1000; ++i) kv.set("key" + std::to_string(i), "value");
+    kv.clear();
+    kv.set_lazy_free(true);
+    kv.set("one", "entry");
+    kv.clear();
+    assert(kv.stats().lazy_frees == 3 && kv.stats().keys == 0);
+    background_tasks().wait_idle();
+    Logger::set_quiet(false);
+}
+
+void test_bulk_delete() {
+    assert(glob_match("h?llo", "hello") && glob_match("h*o", "hello") && glob_match("*", ""));
+    assert(glob_match("h[ae]llo", "hallo") && !glob_match("h[ae]llo", "hillo") && glob_match("h[^e]llo", "hallo"));
+    assert(glob_match("h[a-c]llo", "hbllo") && !glob_match("h[a-c]llo", "hdllo") && glob_match("a\\*b", "a*b"));
+    assert(!glob_match("a\\*b", "axb") && glob_match("*:*:1?", "t:a:15") && !glob_match("t*1", "t:a:15"));
+    assert(glob_match("[]]x", "]x") && glob_match("[x", "[x"));
+
+    Logger::set_quiet(true);
+    for (Backend backend : {Backend::Locked, Backend::Cuckoo}) {
+        KeyValueStore kv(backend);
+        if (backend == Backend::Locked) kv.create_index("by_value");
+        for (int i = 0; i < 5000; ++i) {
+            kv.set("tenant:a:" + std::to_string(i), "a");
+            kv.set("tenant:b:" + std::to_string(i), "b");
+        }
+        kv.set("tenant:aa", "a");
+        auto job = kv.delete_prefix("tenant:a:");
+        BulkDeleteProgress p = job->wait();
+        assert(p.done && !p.cancelled && p.deleted == 5000 && p.scanned >= 10001);
+        assert(!kv.exists("tenant:a:42") && kv.exists("tenant:aa") && kv.exists("tenant:b:42"));
+        assert(kv.delete_pattern("tenant:b:*[05]")->wait().deleted == 1000);
+        assert(!kv.exists("tenant:b:15") && kv.exists("tenant:b:16") && kv.stats().keys == 4001);
+        if (backend == Backend::Locked) {
+            assert(kv.query_index("by_value", "a").value() == std::vector<std::string>{"tenant:aa"});
+            assert(kv.stats().lazy_frees >= 1);
+        }
+    }
+
+    // Destroying the store cancels a job that is still running
+    std::shared_ptr<BulkDeleteJob> job;
+    {
+        KeyValueStore kv;
+        for (int i = 0; i < 200000; ++i) kv.set("k" + std::to_string(i), "v");
+        job = kv.delete_pattern("k*");
+    }
+    BulkDeleteProgress p = job->wait();
+    assert(p.done && (p.cancelled || p.deleted == 200000));
+    background_tasks().wait_idle();
+    Logger::set_quiet(false);
+}
+
+// Keys that all land in bucket 0 of a table with the given bucket count
+// under the unseeded std::hash, found offline the way an attacker would
+std::vector<std::string> colliding_keys(size_t count, size_t buckets) {
+    std::vector<std::string> keys;
+    std::hash<std::string> h;
+    for (uint64_t i = 0; keys.size() < count; ++i) {
+        std::string key = "user:" + std::to_string(i);
+        if (h(key) % buckets == 0) keys.push_back(std::move(key));
+    }
+    return keys;
+}
+
+void test_key_hashing() {
+    // SipHash-2-4 reference vectors: key 00..0f, message 00..(n-1)
+    std::string msg;
+    for (int i = 0; i < 15; ++i) msg.push_back(static_cast<char>(i));
+    const uint64_t k0 = 0x0706050403020100ULL, k1 = 0x0f0e0d0c0b0a0908ULL;
+    assert(siphash24(msg.data(), 0, k0, k1) == 0x726fdb47dd0e0e31ULL);
+    assert(siphash24(msg.data(), 8, k0, k1) == 0x93f5f5799a932462ULL);
+    assert(siphash24(msg.data(), 15, k0, k1) == 0xa129ca6149be45e5ULL);
+
+    // Every length path of wyhash is seeded and sees every byte
+    std::string data(200, 'x');
+    std::unordered_set<uint64_t> seen;
+    for (size_t len = 0; len <= data.size(); ++len) {
+        uint64_t h = wyhash(data.data(), len, 1);
+        assert(h == wyhash(data.data(), len, 1) && h != wyhash(data.data(), len, 2));
+        seen.insert(h);
+        for (size_t i = 0; i < len; i += 7) {
+            std::string flipped = data.substr(0, len);
+            flipped[i] ^= 1;
+            assert(wyhash(flipped.data(), len, 1) != h);
+        }
+    }
+    assert(seen.size() == data.size() + 1);
+    assert(parse_hash_kind("siphash") == HashKind::SipHash && !parse_hash_kind("md5"));
+
+    // Collision attack: keys crafted against std::hash pile into one bucket,
+    // while the seeded hashes spread them out
+    const size_t n = 512;
+    std::unordered_map<std::string, int, KeyHash> probe(n, KeyHash{HashKind::Std});
+    auto keys = colliding_keys(n, probe.bucket_count());
+    for (HashKind kind : {HashKind::Std, HashKind::Fast, HashKind::SipHash}) {
+        std::unordered_map<std::string, int, KeyHash> table(n, KeyHash{kind});
+        assert(table.bucket_count() == probe.bucket_count());
+        for (const auto& key : keys) table.emplace(key, 0);
+        size_t worst = 0;
+        for (size_t b = 0; b < table.bucket_count(); ++b) worst = std::max(worst, table.bucket_size(b));
+        assert(kind == HashKind::Std ? worst == n : worst < 16);
+    }
+
+    // Switching a store's hash keeps its contents, and survives clear/load
+    Logger::set_quiet(true);
+    KeyValueStore kv;
+    assert(kv.hash_kind() == HashKind::Fast);
+    for (const auto& key : keys) kv.set(key, "v");
+    kv.set_hash(HashKind::SipHash);
+    assert(kv.hash_kind() == HashKind::SipHash && kv.stats().keys == n && kv.get(keys[7]).value() == "v");
+    kv.clear();
+    assert(kv.hash_kind() == HashKind::SipHash);
+    kv.replace_contents({{"a", Value(std::string("1"))}});
+    assert(kv.hash_kind() == HashKind::SipHash && kv.get("a").value() == "1");
+    Logger::set_quiet(false);
+}
+
+void test_key_handles() {
+    KeyHandle plain("user:42:profile"), keyed("user:42:profile", HashKind::SipHash);
+    assert(plain.fast() == hash_key(HashKind::Fast, "user:42:profile") && plain.table_hash() == plain.fast());
+    assert(keyed.fast() == plain.fast() && keyed.table_hash() == hash_key(HashKind::SipHash, keyed.key()));
+
+    // The stored hashes are used only for the handle's own string object
+    std::string copy = plain.key();
+    {
+        KeyHandle::Scope scope(plain);
+        assert(KeyHandle::hinted(plain.key()) == &plain && !KeyHandle::hinted(copy));
+        {
+            KeyHandle::Scope inner(keyed);
+            assert(KeyHandle::hinted(keyed.key()) == &keyed && !KeyHandle::hinted(plain.key()));
+        }
+        assert(KeyHandle::hinted(plain.key()) == &plain);
+        assert(KeyHash{HashKind::SipHash}(plain.key()) == hash_key(HashKind::SipHash, copy));
+    }
+    assert(!KeyHandle::hinted(plain.key()));
+
+    Logger::set_quiet(true);
+    for (Backend backend : {Backend::Locked, Backend::LockFree, Backend::Cuckoo, Backend::Prefix}) {
+        KeyValueStore kv(backend);
+        kv.set_near_cache(true);
+        KeyHandle counter("counter"), text("text"), other("text", HashKind::SipHash);
+        assert(kv.incr(counter, 5).value() == 5 && kv.incr(counter).value() == 6 && kv.get("counter").value() == "6");
+        assert(kv.set(text, "hello") && kv.get(text).value() == "hello" && kv.get(text).value() == "hello");
+        kv.set("text", "changed"); // the near cache copy taken through the handle must miss
+        assert(kv.get(text).value() == "changed" && kv.get(other).value() == "changed");
+        if (backend == Backend::Locked) {
+            assert(kv.append(text, "!").value() == 8 && kv.strlen(text).value() == 8);
+            assert(kv.getrange(text, 0, 1).value() == "ch" && kv.open_reader(text).has_value());
+        }
+        kv.remove(text);
+        assert(!kv.exists(text) && !kv.exists("text") && kv.exists(counter));
+    }
+
+    // A SipHash store with handles made for it, and for the default hash
+    KeyValueStore kv;
+    kv.set_hash(HashKind::SipHash);
+    KeyHandle fitted("k", kv.hash_kind()), unfitted("k");
+    kv.set(fitted, "v");
+    assert(kv.get(unfitted).value() == "v" && kv.get("k").value() == "v");
+    kv.set_hash(HashKind::Fast);
+    assert(kv.get(fitted).value() == "v" && kv.get(unfitted).value() == "v");
+
+    // The CLI keeps the handle while commands name the same key
+    NamespaceRegistry registry;
+    CliSession session(registry);
+    const KeyHandle* first = &session.key_handle("a");
+    assert(&session.key_handle("a") == first && session.key_handle("b").key() == "b");
+    session.selected->set_hash(HashKind::SipHash);
+    assert(session.key_handle("b").kind() == HashKind::SipHash);
+    Logger::set_quiet(false);
+}
+
+// tenant:<t>:user:<u>:session:<s> keys, in a shuffled order
+std::vector<std::string> hierarchical_keys(int tenants, int users, int sessions, uint64_t seed = 7) {
+    std::vector<std::string> keys;
+    for (int t = 0; t < tenants; ++t) {
+        for (int u = 0; u < users; ++u) {
+            for (int s = 0; s < sessions; ++s) {
+                keys.push_back("tenant:" + std::to_string(1000 + t) + ":user:" + std::to_string(50000 + u * 37) +
+                               ":session:" + std::to_string(s));
+            }
+        }
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(seed));
+    return keys;
+}
+
+void test_prefix_backend() {
+    // Matches a sorted map through splits, merges and overwrites
+    FrontCodedTable table;
+    std::map<std::string, std::string> model;
+    auto keys = hierarchical_keys(4, 50, 10);
+    for (const char* odd : {"", "a", "ab", "\xff"}) keys.push_back(odd);
+    keys.push_back(std::string("a\0b", 3));
+    std::mt19937_64 rng(11);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        const std::string& key = keys[i];
+        assert(table.insert_or_assign(key, Value(key)) == !model.count(key));
+        model[key] = key;
+        if (rng() % 4 == 0) {
+            const std::string& victim = keys[rng() % (i + 1)];
+            assert(table.erase(victim) == (model.erase(victim) == 1));
+        }
+    }
+    for (const auto& key : keys) {
+        auto v = table.find(key);
+        assert(v.has_value() == (model.count(key) == 1) && (!v || v->str() == key));
+    }
+    assert(!table.find("tenant:1000:user:") && !table.contains("zzz") && table.size() == model.size());
+    std::vector<std::string> walked;
+    table.for_each([&](const std::string& key, const Value&) { walked.push_back(key); });
+    assert(walked.size() == model.size() && std::equal(walked.begin(), walked.end(), model.begin(),
+                                                       [](const auto& k, const auto& e) { return k == e.first; }));
+
+    // A prefix walk looks at its own keys (and the one after), in order
+    const std::string prefix = "tenant:1002:user:";
+    std::vector<std::string> under;
+    size_t scanned = table.for_each_prefix(prefix, [&](const std::string& key, const Value&) { under.push_back(key); });
+    size_t expected = 0;
+    for (auto it = model.lower_bound(prefix); it != model.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+        ++expected;
+    }
+    assert(under.size() == expected && expected > 0 && scanned <= expected + 1);
+    assert(std::is_sorted(under.begin(), under.end()));
+
+    // Front coding keeps key bytes well under the raw key bytes
+    size_t raw = 0;
+    for (const auto& [key, value] : model) raw += key.size();
+    assert(table.key_bytes() < raw / 2);
+    for (const auto& key : keys) table.erase(key);
+    assert(table.size() == 0 && !table.find("a"));
+
+    // Through the store, a bulk delete by prefix walks only that prefix
+    Logger::set_quiet(true);
+    KeyValueStore kv(Backend::Prefix);
+    for (int i = 0; i < 5000; ++i) {
+        kv.set("tenant:a:" + std::to_string(i), "a");
+        kv.set("tenant:b:" + std::to_string(i), "b");
+    }
+    BulkDeleteProgress p = kv.delete_prefix("tenant:a:")->wait();
+    assert(p.deleted == 5000 && p.scanned <= 5001 && kv.stats().keys == 5000 && kv.exists("tenant:b:7"));
+    p = kv.delete_pattern("tenant:b:*[05]")->wait();
+    assert(p.deleted == 1000 && p.scanned == 5000 && !kv.exists("tenant:b:15") && kv.exists("tenant:b:16"));
+    Logger::set_quiet(false);
+}
+
+void run_tests() {
+    KeyValueStore kv;
+    kv.set("username", "abhishek");
+    kv.set("lang", "C++17");
+    assert(kv.get("username").value() == "abhishek");
+    assert(kv.exists("lang"));
+    kv.remove("lang");
+    assert(!kv.exists("lang"));
+    kv.clear();
+    assert(!kv.exists("username"));
+
+    test_probabilistic_types();
+    test_secondary_indexes();
+    test_binary_safety();
+    test_large_values();
+    test_scripts();
+    test_namespaces();
+    test_epoch_reclamation();
+    test_concurrent_backends();
+    test_task_scheduler();
+    test_flat_combining();
+    test_table_images();
+    test_source_command();
+    test_basic_store();
+    test_store_locks();
+    test_near_cache();
+    test_numa_partitions();
+    test_autosave();
+    test_compressed_snapshots();
+    test_cache_mode();
+    test_lazy_free();
+    test_bulk_delete();
+    test_key_hashing();
+    test_key_handles();
+    test_prefix_backend();
+    Logger::info("All tests passed");
+}
+
+// ========== Benchmarks ==========
+// Run with: ./kvstore --bench
+template <typename F>
+double time_ms(F&& fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void bench_probabilistic_types() {
+    std::cout << "\n[HyperLogLog accuracy]\n";
+    for (size_t n : {100, 1000, 10000, 100000, 1000000}) {
+        std::string hll = HyperLogLog::create();
+        for (size_t i = 0; i < n; ++i) HyperLogLog::add(hll, "user:" + std::to_string(i));
+        double est = double(HyperLogLog::count(hll));
+        std::cout << "  n=" << std::setw(8) << n << "  estimate=" << std::setw(8) << uint64_t(est)
+                  << "  error=" << std::fixed << std::setprecision(2) << 100.0 * std::fabs(est - n) / n << "%"
+                  << "  bytes=" << hll.size() << "\n";
+    }
+
+    std::cout << "\n[HyperLogLog throughput]\n";
+    const size_t ops = 1000000;
+    std::vector<std::string> items;
+    for (size_t i = 0; i < ops; ++i) items.push_back("user:" + std::to_string(i));
+    std::string a = HyperLogLog::create(), b = HyperLogLog::create();
+    double add_ms = time_ms([&] { for (const auto& item : items) HyperLogLog::add(a, item); });
+    for (size_t i = 0; i < ops / 2; ++i) HyperLogLog::add(b, "other:" + std::to_string(i));
+    const int rounds = 1000;
+    uint64_t sink = 0;
+    double merge_ms = time_ms([&] {
+        for (int i = 0; i < rounds; ++i) {
+            std::string dest = a;
+            HyperLogLog::merge_into(dest, b);
+            sink += uint8_t(dest[HyperLogLog::kHeaderSize]);
+        }
+    });
+    double count_ms = time_ms([&] { for (int i = 0; i < rounds; ++i) sink += HyperLogLog::count(a); });
+    std::cout << "  pfadd:   " << std::setprecision(1) << ops / add_ms / 1000.0 << " M ops/s\n"
+              << "  pfmerge: " << merge_ms * 1000.0 / rounds << " us per merge (incl. copy)\n"
+              << "  pfcount: " << count_ms * 1000.0 / rounds << " us per count\n";
+
+    std::cout << "\n[Scalable Bloom filter]\n";
+    for (size_t n : {1000, 10000, 100000}) {
+        std::string bf = ScalableBloomFilter::create();
+        double bf_add_ms = time_ms([&] { for (size_t i = 0; i < n; ++i) ScalableBloomFilter::add(bf, items[i]); });
+        size_t false_positives = 0;
+        const size_t probes = 100000;
+        double probe_ms = time_ms([&] {
+            for (size_t i = 0; i < probes; ++i) {
+                false_positives += ScalableBloomFilter::contains(bf, "absent:" + std::to_string(i));
+            }
+        });
+        std::cout << "  n=" << std::setw(6) << n << "  fp-rate=" << std::setprecision(3)
+                  << 100.0 * false_positives / probes << "%"
+                  << "  bytes=" << bf.size()
+                  << "  add=" << std::setprecision(2) << n / bf_add_ms / 1000.0 << " M ops/s"
+                  << "  exists=" << probes / probe_ms / 1000.0 << " M ops/s\n";
+    }
+    if (sink == 42) std::cout << "";
+}
+
+void bench_secondary_indexes() {
+    std::cout << "\n[Index maintenance cost per set]\n";
+    const int ops = 200000;
+    std::vector<std::string> values;
+    const char* statuses[] = {"active", "idle", "banned", "pending"};
+    for (int i = 0; i < ops; ++i) {
+        values.push_back("{\"id\": " + std::to_string(i) + ", \"status\": \"" + statuses[i % 4] +
+                         "\", \"region\": \"r" + std::to_string(i % 16) + "\"}");
+    }
+    struct Config { const char* label; std::vector<std::pair<std::string, std::string>> indexes; };
+    std::vector<Config> configs = {
+        {"no index", {}},
+        {"value index", {{"v", ""}}},
+        {"json field index", {{"s", "status"}}},
+        {"3 indexes", {{"v", ""}, {"s", "status"}, {"r", "region"}}},
+    };
+    Logger::set_quiet(true);
+    double baseline = 0;
+    for (const auto& config : configs) {
+        KeyValueStore kv;
+        for (const auto& [name, field] : config.indexes) kv.create_index(name, field);
+        // Two passes over the same keys: inserts, then overwrites
+        double ms = time_ms([&] {
+            for (int pass = 0; pass < 2; ++pass) {
+                for (int i = 0; i < ops; ++i) kv.set("user:" + std::to_string(i), values[(i + pass) % ops]);
+            }
+        });
+        double ns_per_set = ms * 1e6 / (2.0 * ops);
+        if (baseline == 0) baseline = ns_per_set;
+        std::cout << "  " << std::left << std::setw(18) << config.label << std::right << std::fixed
+                  << std::setprecision(0) << std::setw(6) << ns_per_set << " ns/set  (+"
+                  << ns_per_set - baseline << " ns)\n";
+    }
+    Logger::set_quiet(false);
+}
+
+void bench_scripts() {
+    std::cout << "\n[Scripted read-modify-write vs client-side round-trips]\n";
+    Logger::set_quiet(true);
+    KeyValueStore kv;
+    const int ops = 200000;
+    kv.set("counter", "0");
+
+    double client_ms = time_ms([&] {
+        for (int i = 0; i < ops; ++i) {
+            long long n = parse_int(kv.get("counter").value()).value();
+            kv.set("counter", std::to_string(n + 1));
+        }
+    });
+    const std::string source = "\"counter\" dup get 1 + set";
+    double eval_ms = time_ms([&] { for (int i = 0; i < ops; ++i) kv.eval(source, {}); });
+    std::string id = kv.script_load(source).value();
+    double evalsha_ms = time_ms([&] { for (int i = 0; i < ops; ++i) kv.evalsha(id, {}); });
+    std::string error;
+    double compile_ms = time_ms([&] { for (int i = 0; i < ops; ++i) compile_script(source, error); });
+    Logger::set_quiet(false);
+
+    auto line = [&](const char* label, double ms) {
+        std::cout << "  " << std::left << std::setw(28) << label << std::right << std::fixed
+                  << std::setprecision(0) << std::setw(6) << ms * 1e6 / ops << " ns/op\n";
+    };
+    line("client get + set (2 calls)", client_ms);
+    line("eval (cached by hash)", eval_ms);
+    line("evalsha", evalsha_ms);
+    line("compile only (uncached)", compile_ms);
+    std::cout << "  (in-process calls; over a network each client call adds a round-trip)\n";
+}
+
+// Same interface as the concurrent tables, guarded by one mutex
+class MutexTable {
+public:
+    std::optional<Value> find(const std::string& key) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = map_.find(key);
+        if (it == map_.end()) return std::nullopt;
+        return it->second;
+    }
+    void insert_or_assign(const std::string& key, Value value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        map_.insert_or_assign(key, std::move(value));
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Value> map_;
+};
+
+// Aggregate throughput over a shared table; write_percent of ops are sets
+template <typename Table>
+double concurrent_mops(Table& table, int threads, int ops_per_thread, int keys, int write_percent) {
+    std::vector<std::thread> workers;
+    double ms = time_ms([&] {
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                std::mt19937 rng(static_cast<unsigned>(t));
+                for (int i = 0; i < ops_per_thread; ++i) {
+                    std::string key = "key" + std::to_string(rng() % static_cast<unsigned>(keys));
+                    if (static_cast<int>(rng() % 100) < write_percent) table.insert_or_assign(key, Value("v"));
+                    else table.find(key);
+                }
+            });
+        }
+        for (auto& w : workers) w.join();
+    });
+    return threads * static_cast<double>(ops_per_thread) / ms / 1000.0;
+}
+
+// Bytes currently allocated from the heap, where the C library reports it
+size_t heap_in_use() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+template <typename Table>
+void fill_table(Table& table, int keys) {
+    for (int i = 0; i < keys; ++i) table.insert_or_assign("key" + std::to_string(i), Value("v"));
+}
+
+void bench_concurrent_tables() {
+    const int keys = 100000, ops = 200000;
+    MutexTable locked;
+    LockFreeHashMap lockfree;
+    CuckooHashMap cuckoo;
+    fill_table(locked, keys);
+    fill_table(lockfree, keys);
+    fill_table(cuckoo, keys);
+
+    for (int write_percent : {5, 50}) {
+        std::cout << "\n[Concurrent table scaling: " << 100 - write_percent << "% get / " << write_percent
+                  << "% set, Mops/s]\n";
+        std::cout << "  threads   mutex+unordered_map   lockfree     cuckoo\n";
+        for (int threads : {1, 2, 4, 8}) {
+            double m = concurrent_mops(locked, threads, ops, keys, write_percent);
+            double l = concurrent_mops(lockfree, threads, ops, keys, write_percent);
+            double c = concurrent_mops(cuckoo, threads, ops, keys, write_percent);
+            std::cout << "  " << std::setw(7) << threads << std::fixed << std::setprecision(2) << std::setw(22) << m
+                      << std::setw(11) << l << std::setw(11) << c << "\n";
+        }
+    }
+    std::cout << "  (hardware threads: " << std::thread::hardware_concurrency() << ")\n";
+
+    // Heap growth for the same keys; keys are short enough for SSO, so this
+    // is the table's own overhead plus the Value
+    std::cout << "\n[Memory per key, " << keys << " keys]\n";
+    auto measure = [&](const char* label, auto make) {
+        size_t before = heap_in_use();
+        auto table = make();
+        fill_table(*table, keys);
+        size_t after = heap_in_use();
+        if (after == 0) return;
+        std::cout << "  " << std::left << std::setw(22) << label << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(7) << static_cast<double>(after - before) / keys << " bytes\n";
+    };
+    measure("mutex+unordered_map", [] { return std::make_unique<MutexTable>(); });
+    measure("lockfree", [] { return std::make_unique<LockFreeHashMap>(); });
+    measure("cuckoo", [] { return std::make_unique<CuckooHashMap>(); });
+    std::cout << "  cuckoo occupancy:     " << std::setprecision(1) << cuckoo.load_factor() * 100 << "% of slots\n";
+}
+
+// Zipf(s)-distributed ranks 0..n-1: a few hot keys take most of the writes
+class ZipfGenerator {
+public:
+    ZipfGenerator(size_t n, double s) : cdf_(n) {
+        double sum = 0;
+        for (size_t i = 0; i < n; ++i) cdf_[i] = sum += 1.0 / std::pow(static_cast<double>(i + 1), s);
+        for (double& c : cdf_) c /= sum;
+    }
+    template <typename Rng>
+    size_t operator()(Rng& rng) const {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        return std::min<size_t>(std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin(), cdf_.size() - 1);
+    }
+
+private:
+    std::vector<double> cdf_;
+};
+
+void bench_flat_combining() {
+    std::cout << "\n[Contended sets, zipf 0.99 over 1000 keys: direct locking vs flat combining]\n";
+    Logger::set_quiet(true);
+    const int total_ops = 400000;
+    ZipfGenerator zipf(1000, 0.99);
+    std::vector<std::string> keys;
+    for (int i = 0; i < 1000; ++i) keys.push_back("key" + std::to_string(i));
+
+    auto run = [&](bool combining, int threads) {
+        KeyValueStore kv;
+        if (combining) kv.set_flat_combining(true);
+        std::vector<std::thread> workers;
+        double ms = time_ms([&] {
+            for (int t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t] {
+                    std::mt19937 rng(static_cast<unsigned>(t));
+                    for (int i = 0; i < total_ops / threads; ++i) kv.set(keys[zipf(rng)], "v");
+                });
+            }
+            for (auto& w : workers) w.join();
+        });
+        StoreStats st = kv.stats();
+        return std::make_pair(total_ops / ms / 1000.0,
+                              st.combining_passes ? static_cast<double>(st.combined_ops) / st.combining_passes : 1.0);
+    };
+    std::cout << "  threads   direct Mops/s   combining Mops/s   writes per lock\n";
+    for (int threads : {8, 16, 32, 64}) {
+        auto direct = run(false, threads);
+        auto combined = run(true, threads);
+        std::cout << "  " << std::setw(7) << threads << std::fixed << std::setprecision(2) << std::setw(16)
+                  << direct.first << std::setw(19) << combined.first << std::setw(18) << combined.second << "\n";
+    }
+    Logger::set_quiet(false);
+}
+
+void bench_source() {
+    const int commands = 200000;
+    std::cout << "\n[source: " << commands << " commands (set/incr/get), by batch size]\n";
+    const std::string path = "kvstore_bench_source.txt";
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        for (int i = 0; i < commands; ++i) {
+            switch (i % 3) {
+                case 0: out << "set key" << i % 5000 << " value" << i << "\n"; break;
+                case 1: out << "incr counter" << i % 100 << "\n"; break;
+                default: out << "get key" << i % 5000 << "\n"; break;
+            }
+        }
+    }
+    std::cout << "  mode               ops/s\n";
+    for (auto [label, batch, atomic] : {std::make_tuple("batch 1", 1, false), std::make_tuple("batch 1000", 1000, false),
+                                        std::make_tuple("batch 1000 atomic", 1000, true)}) {
+        NamespaceRegistry namespaces;
+        CliSession session(namespaces);
+        SourceOptions options;
+        options.batch = static_cast<size_t>(batch);
+        options.atomic = atomic;
+        auto summary = source_file(session, path, options);
+        std::cout << "  " << std::left << std::setw(17) << label << std::right << std::fixed << std::setprecision(0)
+                  << std::setw(10) << summary->commands / summary->ms * 1000.0 << "\n";
+    }
+    std::remove(path.c_str());
+}
+
+void bench_warm_restart() {
+    const int keys = 500000;
+    std::cout << "\n[Restart: snapshot parse vs mapped table image, " << keys << " keys x 100-byte values]\n";
+    Logger::set_quiet(true);
+    const std::string snapshot = "kvstore_bench_restart.db", image = "kvstore_bench_restart.img";
+    {
+        KeyValueStore kv;
+        for (int i = 0; i < keys; ++i) kv.set("key" + std::to_string(i), std::string(100, static_cast<char>('a' + i % 26)));
+        kv.save_to_file(snapshot);
+        kv.save_image(image);
+    }
+    std::vector<std::string> probes;
+    std::mt19937 rng(5);
+    for (int i = 0; i < 200000; ++i) probes.push_back("key" + std::to_string(rng() % keys));
+
+    auto restart = [&](const char* label, auto load) {
+        KeyValueStore kv;
+        double load_ms = time_ms([&] { load(kv); });
+        double get_ms = time_ms([&] {
+            for (const auto& key : probes) kv.get(key);
+        });
+        std::cout << "  " << std::left << std::setw(22) << label << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << load_ms << " ms" << std::setw(10) << std::setprecision(2)
+                  << probes.size() / get_ms / 1000.0 << " Mgets/s after\n";
+    };
+    restart("load (parse + insert)", [&](KeyValueStore& kv) { kv.load_from_file(snapshot); });
+    restart("loadimage (validate)", [&](KeyValueStore& kv) { kv.load_image(image); });
+    std::cout << "  (files are in the page cache here; from cold storage both add read time, the image nothing more)\n";
+    std::remove(snapshot.c_str());
+    std::remove(image.c_str());
+    Logger::set_quiet(false);
+}
+
+void bench_compressed_snapshots() {
+    const int keys = 300000;
+    std::cout << "\n[Snapshots: plain vs block-compressed, " << keys << " JSON-like values]\n";
+    Logger::set_quiet(true);
+    const std::string path = "kvstore_bench_compressed.db";
+    KeyValueStore kv;
+    for (int i = 0; i < keys; ++i) {
+        kv.set("user:" + std::to_string(i), "{\"id\": " + std::to_string(i) + ", \"name\": \"user" + std::to_string(i % 1000) +
+                                                "\", \"email\": \"user" + std::to_string(i) + "@example.com\", \"active\": " +
+                                                (i % 3 ? "true" : "false") + "}");
+    }
+    auto file_size = [&] {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        return static_cast<double>(in.tellg());
+    };
+    double plain_bytes = 0;
+    auto run = [&](const std::string& label, const SnapshotOptions& options) {
+        double save_ms = time_ms([&] { kv.save_to_file(path, options); });
+        double bytes = file_size();
+        if (!options.compress) plain_bytes = bytes;
+        KeyValueStore loaded;
+        double load_ms = time_ms([&] { loaded.load_from_file(path); });
+        std::cout << "  " << std::left << std::setw(26) << label << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(8) << bytes / (1 << 20) << " MB" << std::setw(7) << std::setprecision(2)
+                  << plain_bytes / bytes << "x" << std::setprecision(1) << std::setw(9) << save_ms << " ms save"
+                  << std::setw(9) << load_ms << " ms load\n";
+    };
+    run("plain", SnapshotOptions());
+    const size_t hardware = snapshot_threads(0);
+    std::vector<size_t> thread_counts = {1};
+    if (hardware > 1) thread_counts.push_back(hardware);
+    for (int level : {1, 6, 9}) {
+        for (size_t threads : thread_counts) {
+            SnapshotOptions options;
+            options.compress = true;
+            options.level = level;
+            options.threads = threads;
+            run("level " + std::to_string(level) + ", " + std::to_string(threads) + " thread" + (threads > 1 ? "s" : ""),
+                options);
+        }
+    }
+    std::cout << "  (blocks are compressed and decompressed on the background pool's " << hardware - 1
+              << " worker(s) plus the calling thread)\n";
+    std::remove(path.c_str());
+    Logger::set_quiet(false);
+}
+
+void bench_cache_mode() {
+    const int keys = 2000, gets = 20000;
+    const auto latency = std::chrono::microseconds(200);
+    std::cout << "\n[Cache mode over a directory store with " << latency.count() << " us per call, " << keys << " keys]\n";
+    Logger::set_quiet(true);
+    const std::string dir = "kvstore_bench_cache";
+    auto backing = std::make_shared<DirectoryBackingStore>(dir, latency);
+    std::vector<std::pair<std::string, std::optional<std::string>>> seed;
+    for (int i = 0; i < keys; ++i) seed.emplace_back("key" + std::to_string(i), "value" + std::to_string(i));
+    backing->store(seed);
+
+    std::mt19937 rng(3);
+    std::vector<std::string> picks;
+    for (int i = 0; i < gets; ++i) picks.push_back("key" + std::to_string(std::min<uint32_t>(rng() % keys, rng() % keys)));
+    auto report = [](const std::string& label, double ms, size_t ops, const std::string& note) {
+        std::cout << "  " << std::left << std::setw(34) << label << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(9) << ms << " ms" << std::setw(10) << std::setprecision(0) << ops / ms * 1000.0
+                  << " ops/s  " << note << "\n";
+    };
+    report("gets straight from the source", time_ms([&] {
+               for (int i = 0; i < gets / 10; ++i) backing->load(picks[i]);
+           }),
+           gets / 10, "");
+    {
+        KeyValueStore kv;
+        kv.set_backing_store(backing);
+        double ms = time_ms([&] {
+            for (const auto& key : picks) kv.get(key);
+        });
+        CacheStats st = kv.cache_stats().value();
+        report("gets through the cache", ms, gets,
+               std::to_string(100 * st.hits / (st.hits + st.misses)) + "% hits, avg load " +
+                   std::to_string(st.load_us_total / std::max<uint64_t>(1, st.loads)) + " us");
+    }
+    {
+        KeyValueStore kv;
+        kv.set_backing_store(backing);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; ++t) {
+            threads.emplace_back([&] {
+                for (int i = 0; i < 200; ++i) kv.get("key" + std::to_string(i));
+            });
+        }
+        for (auto& t : threads) t.join();
+        CacheStats st = kv.cache_stats().value();
+        std::cout << "  8 threads missing the same 200 keys: " << st.loads << " loads, " << st.coalesced
+                  << " coalesced\n";
+    }
+    const int writes = 1000;
+    report("sets written through, one call each", time_ms([&] {
+               for (int i = 0; i < writes; ++i) backing->store({{"key" + std::to_string(i), std::string("new")}});
+           }),
+           writes, "");
+    {
+        KeyValueStore kv;
+        kv.set_backing_store(backing);
+        double set_ms = time_ms([&] {
+            for (int i = 0; i < writes; ++i) kv.set("key" + std::to_string(i), "newer");
+        });
+        double flush_ms = time_ms([&] { kv.flush_backing(); });
+        CacheStats st = kv.cache_stats().value();
+        report("sets written behind", set_ms, writes,
+               "+ " + std::to_string(static_cast<int>(flush_ms)) + " ms to drain in " + std::to_string(st.batches) + " batches");
+    }
+    std::filesystem::remove_all(dir);
+    Logger::set_quiet(false);
+}
+
+void bench_lazy_free() {
+    std::cout << "\n[Lazy free: lock stalls seen by a concurrent reader]\n";
+    Logger::set_quiet(true);
+    auto measure = [](const char* label, bool lazy, auto fill, auto drop) {
+        KeyValueStore kv;
+        kv.set_lazy_free(lazy);
+        fill(kv);
+        std::atomic<bool> stop{false};
+        std::atomic<double> worst{0};
+        std::thread reader([&] {
+            while (!stop.load()) {
+                double ms = time_ms([&] { kv.get("probe"); });
+                if (ms > worst.load()) worst = ms;
+            }
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        double call_ms = time_ms([&] { drop(kv); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        stop = true;
+        reader.join();
+        background_tasks().wait_idle();
+        std::cout << "  " << std::left << std::setw(34) << label << std::setw(6) << (lazy ? "lazy" : "sync")
+                  << std::right << std::fixed << std::setprecision(2) << std::setw(9) << call_ms << " ms call"
+                  << std::setw(9) << worst.load() << " ms worst get\n";
+    };
+    auto fill_table = [](KeyValueStore& kv) {
+        for (int i = 0; i < 1000000; ++i) kv.set("key" + std::to_string(i), std::string(32, 'v'));
+    };
+    auto fill_big = [](KeyValueStore& kv) {
+        ValueWriter writer = kv.open_writer("big");
+        for (int i = 0; i < 4096; ++i) writer.write(std::string(Value::kChunkSize, 'x')); // 256 MB
+        writer.commit();
+    };
+    for (bool lazy : {false, true}) {
+        measure("clear, 1M keys", lazy, fill_table, [](KeyValueStore& kv) { kv.clear(); });
+    }
+    for (bool lazy : {false, true}) {
+        measure("remove a 256 MB value", lazy, fill_big, [](KeyValueStore& kv) { kv.remove("big"); });
+    }
+    std::cout << "  (one CPU here: the reader only runs when the writer is descheduled, so worst get is noisy)\n";
+    Logger::set_quiet(false);
+}
+
+void bench_bulk_delete() {
+    const int keys = 500000;
+    std::cout << "\n[Bulk delete: " << keys << " of " << 2 * keys << " keys by prefix, with a concurrent reader]\n";
+    Logger::set_quiet(true);
+    auto measure = [&](const char* label, auto drop) {
+        KeyValueStore kv;
+        for (int i = 0; i < keys; ++i) {
+            kv.set("gone:" + std::to_string(i), "value");
+            kv.set("kept:" + std::to_string(i), "value");
+        }
+        std::atomic<bool> stop{false};
+        std::atomic<double> worst{0};
+        std::thread reader([&] {
+            while (!stop.load()) {
+                double ms = time_ms([&] { kv.get("kept:1"); });
+                if (ms > worst.load()) worst = ms;
+            }
+        });
+        double ms = time_ms([&] { drop(kv); });
+        stop = true;
+        reader.join();
+        assert(kv.stats().keys == static_cast<size_t>(keys));
+        std::cout << "  " << std::left << std::setw(34) << label << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(9) << ms << " ms" << std::setw(9) << std::setprecision(2) << worst.load()
+                  << " ms worst get\n";
+    };
+    measure("remove() per key", [&](KeyValueStore& kv) {
+        for (int i = 0; i < keys; ++i) kv.remove("gone:" + std::to_string(i));
+    });
+    measure("delete_prefix (background job)", [](KeyValueStore& kv) { kv.delete_prefix("gone:")->wait(); });
+    std::cout << "  (the job runs on the background pool under its CPU share cap, "
+              << background_tasks().stats().max_cpu_share * 100 << "%)\n";
+    Logger::set_quiet(false);
+}
+
+void bench_key_hashing() {
+    std::cout << "\n[Key hashing: throughput by key length, GB/s]\n";
+    const size_t lengths[] = {8, 16, 32, 64, 256, 1024};
+    const size_t bytes = size_t(64) << 20;
+    using HashFn = uint64_t (*)(const std::string&);
+    const std::pair<const char*, HashFn> hashes[] = {
+        {"std::hash", [](const std::string& k) -> uint64_t { return std::hash<std::string>{}(k); }},
+        {"murmur64a", [](const std::string& k) { return hash64(k); }},
+        {"fast (wyhash)", [](const std::string& k) { return fast_hash(k); }},
+        {"siphash-2-4", [](const std::string& k) {
+             return siphash24(k.data(), k.size(), process_hash_seeds().sip[0], process_hash_seeds().sip[1]);
+         }},
+    };
+    std::cout << "  " << std::left << std::setw(14) << "key bytes" << std::right;
+    for (const auto& [name, fn] : hashes) std::cout << std::setw(15) << name;
+    std::cout << "\n";
+    for (size_t len : lengths) {
+        std::vector<std::string> keys(64);
+        std::mt19937_64 rng(len);
+        for (auto& k : keys) {
+            k.resize(len);
+            for (auto& c : k) c = static_cast<char>(rng());
+        }
+        const size_t rounds = bytes / len / keys.size();
+        std::cout << "  " << std::left << std::setw(14) << len << std::right;
+        for (const auto& [name, fn] : hashes) {
+            uint64_t sink = 0;
+            double ms = time_ms([&] {
+                for (size_t r = 0; r < rounds; ++r) {
+                    for (const auto& k : keys) sink += fn(k);
+                }
+            });
+            volatile uint64_t keep = sink;
+            (void)keep;
+            std::cout << std::setw(15) << std::fixed << std::setprecision(2) << bytes / ms / 1e6;
+        }
+        std::cout << "\n";
+    }
+
+    const size_t n = 5000;
+    std::cout << "\n[Key hashing: inserting " << n << " keys crafted to collide under std::hash]\n";
+    std::unordered_map<std::string, int, KeyHash> probe(n, KeyHash{HashKind::Std});
+    auto keys = colliding_keys(n, probe.bucket_count());
+    for (HashKind kind : {HashKind::Std, HashKind::Fast, HashKind::SipHash}) {
+        std::unordered_map<std::string, int, KeyHash> table(n, KeyHash{kind});
+        double ms = time_ms([&] {
+            for (const auto& key : keys) table.emplace(key, 0);
+            for (const auto& key : keys) table.count(key);
+        });
+        std::cout << "  " << std::left << std::setw(10) << hash_kind_name(kind) << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(10) << ms << " ms\n";
+    }
+}
+
+void bench_key_handles() {
+    const int keys = 1000, rounds = 200;
+    std::cout << "\n[Key handles: " << keys * rounds << " gets over " << keys
+              << " keys, string key vs precomputed KeyHandle, Mops/s]\n";
+    Logger::set_quiet(true);
+    for (HashKind kind : {HashKind::Fast, HashKind::SipHash}) {
+        for (size_t len : {16, 100, 1000}) {
+            KeyValueStore kv;
+            kv.set_hash(kind);
+            std::vector<std::string> names;
+            std::vector<KeyHandle> handles;
+            for (int i = 0; i < keys; ++i) {
+                std::string name = "tenant:" + std::to_string(i) + ":";
+                name.resize(len, 'x');
+                kv.set(name, "v");
+                handles.emplace_back(name, kind);
+                names.push_back(std::move(name));
+            }
+            double by_string = time_ms([&] {
+                for (int r = 0; r < rounds; ++r) {
+                    for (const auto& name : names) kv.get(name);
+                }
+            });
+            double by_handle = time_ms([&] {
+                for (int r = 0; r < rounds; ++r) {
+                    for (const auto& handle : handles) kv.get(handle);
+                }
+            });
+            const double ops = double(keys) * rounds / 1000.0;
+            std::cout << "  " << std::left << std::setw(8) << hash_kind_name(kind) << std::right << std::setw(5) << len
+                      << " B keys:" << std::fixed << std::setprecision(2) << std::setw(8) << ops / by_string
+                      << " ->" << std::setw(7) << ops / by_handle << " (" << std::setprecision(0)
+                      << (1 - by_handle / by_string) * 100 << "% less time)\n";
+        }
+    }
+    Logger::set_quiet(false);
+}
+
+void bench_prefix_backend() {
+    std::cout << "\n[Prefix backend: front-coded keys vs hash map on hierarchical keys]\n";
+    Logger::set_quiet(true);
+    struct Dataset {
+        const char* name;
+        std::vector<std::string> keys;
+    };
+    std::vector<Dataset> datasets;
+    datasets.push_back({"sessions", hierarchical_keys(20, 1000, 10)});
+    std::vector<std::string> metrics;
+    for (int host = 0; host < 50; ++host) {
+        for (int core = 0; core < 16; ++core) {
+            for (int minute = 0; minute < 240; ++minute) {
+                char key[96];
+                std::snprintf(key, sizeof(key), "metrics:host-%03d.dc1.example.com:cpu:core-%02d:2026-10-18T%02d:%02d",
+                              host, core, minute / 60, minute % 60);
+                metrics.push_back(key);
+            }
+        }
+    }
+    std::shuffle(metrics.begin(), metrics.end(), std::mt19937_64(3));
+    datasets.push_back({"metrics", std::move(metrics)});
+
+    for (const auto& [name, keys] : datasets) {
+        size_t raw = 0;
+        for (const auto& key : keys) raw += key.size();
+        const double n = static_cast<double>(keys.size());
+        std::cout << "  " << name << ": " << keys.size() << " keys, " << std::fixed << std::setprecision(1) << raw / n
+                  << " key bytes each\n";
+
+        // Heap per entry, minus the Value every entry holds either way
+        auto key_memory = [&](auto build) {
+            size_t before = heap_in_use();
+            auto table = build();
+            size_t used = heap_in_use() - before;
+            return (used - keys.size() * sizeof(Value)) / n;
+        };
+        double hashed = key_memory([&] {
+            auto table = std::make_unique<KeyValueStore::Table>();
+            for (const auto& key : keys) table->try_emplace(key, "v");
+            return table;
+        });
+        double coded = key_memory([&] {
+            auto table = std::make_unique<FrontCodedTable>();
+            for (const auto& key : keys) table->insert_or_assign(key, Value("v"));
+            return table;
+        });
+        std::cout << "    key memory per entry:  hash map " << std::setprecision(1) << hashed << " B, prefix " << coded
+                  << " B (" << std::setprecision(0) << (1 - coded / hashed) * 100 << "% less)\n";
+
+        std::vector<size_t> picks(200000);
+        std::mt19937_64 rng(5);
+        for (auto& pick : picks) pick = rng() % keys.size();
+        for (Backend backend : {Backend::Locked, Backend::Cuckoo, Backend::Prefix}) {
+            KeyValueStore kv(backend);
+            for (const auto& key : keys) kv.set(key, "v");
+            double hit_ms = time_ms([&] {
+                for (size_t pick : picks) kv.get(keys[pick]);
+            });
+            double miss_ms = time_ms([&] {
+                for (size_t pick : picks) kv.get(keys[pick] + "~");
+            });
+            std::cout << "    " << std::left << std::setw(8) << backend_name(backend) << std::right << " get: "
+                      << std::setprecision(0) << std::setw(5) << hit_ms * 1e6 / picks.size() << " ns hit, "
+                      << std::setw(5) << miss_ms * 1e6 / picks.size() << " ns miss\n";
+        }
+    }
+    Logger::set_quiet(false);
+}
+
+void bench_basic_store() {
+    std::cout << "\n[Policy-based stores: 1M single-thread ops, 50% get / 50% set over 100k keys]\n";
+    Logger::set_quiet(true);
+    const int ops = 1000000, keys = 100000;
+    std::vector<uint64_t> picks(ops);
+    std::mt19937_64 rng(42);
+    for (auto& p : picks) p = rng() % keys;
+    std::vector<std::string> names;
+    for (int i = 0; i < keys; ++i) names.push_back("key" + std::to_string(i));
+
+    auto report = [&](const char* label, double ms) {
+        std::cout << "  " << std::left << std::setw(46) << label << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(8) << ops / ms / 1000.0 << " Mops/s\n";
+    };
+    auto run = [&](auto& store, auto key_of, auto value_of) {
+        return time_ms([&] {
+            for (int i = 0; i < ops; ++i) {
+                if (i & 1) store.set(key_of(picks[i]), value_of(i));
+                else store.get(key_of(picks[i]));
+            }
+        });
+    };
+    auto name_of = [&](uint64_t k) -> const std::string& { return names[k]; };
+    auto text_of = [](int) { return std::string("value"); };
+    auto id_of = [](uint64_t k) { return k; };
+    auto number_of = [](int i) { return static_cast<uint64_t>(i); };
+    {
+        KeyValueStore store;
+        report("KeyValueStore (string, mutex, logging)", run(store, name_of, text_of));
+    }
+    {
+        BasicKeyValueStore<std::string, std::string> store;
+        report("Basic<string, string> (mutex, logging)", run(store, name_of, text_of));
+    }
+    {
+        EmbeddedStore<std::string, std::string> store;
+        report("Embedded<string, string> (no lock, no log)", run(store, name_of, text_of));
+    }
+    {
+        BasicKeyValueStore<uint64_t, uint64_t, std::hash<uint64_t>, std::unordered_map<uint64_t, uint64_t>, NullLock,
+                           NullStoreLog>
+            store;
+        report("Basic<uint64, uint64> on std::unordered_map", run(store, id_of, number_of));
+    }
+    {
+        EmbeddedStore<uint64_t, uint64_t> store;
+        report("Embedded<uint64, uint64> on FlatIntMap", run(store, id_of, number_of));
+    }
+    Logger::set_quiet(false);
+}
+
+void bench_store_locks() {
+    std::cout << "\n[Store lock policies: 90% get / 10% set over 64 keys, latency sampled every 8th op]\n";
+    Logger::set_quiet(true);
+    const int total_ops = 400000;
+    std::vector<std::string> keys;
+    for (int i = 0; i < 64; ++i) keys.push_back("key" + std::to_string(i));
+
+    std::cout << "  threads   lock        Mops/s   p50 ns    p99 ns   p99.9 ns\n";
+    for (int threads : {1, 4, 16}) {
+        for (LockPolicy policy : {LockPolicy::Mutex, LockPolicy::Adaptive, LockPolicy::Ticket}) {
+            KeyValueStore kv(Backend::Locked, policy);
+            for (const auto& key : keys) kv.set(key, "value");
+            std::vector<std::vector<uint64_t>> samples(threads);
+            std::vector<std::thread> workers;
+            double ms = time_ms([&] {
+                for (int t = 0; t < threads; ++t) {
+                    workers.emplace_back([&, t] {
+                        std::mt19937 rng(static_cast<unsigned>(t));
+                        for (int i = 0; i < total_ops / threads; ++i) {
+                            const std::string& key = keys[rng() % keys.size()];
+                            bool timed = i % 8 == 0;
+                            auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+                            if (rng() % 10 == 0) kv.set(key, "value");
+                            else kv.get(key);
+                            if (timed) {
+                                samples[t].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                         std::chrono::steady_clock::now() - start)
+                                                         .count());
+                            }
+                        }
+                    });
+                }
+                for (auto& w : workers) w.join();
+            });
+            std::vector<uint64_t> all;
+            for (const auto& s : samples) all.insert(all.end(), s.begin(), s.end());
+            std::sort(all.begin(), all.end());
+            auto pct = [&](double p) { return all[std::min(all.size() - 1, static_cast<size_t>(p * all.size()))]; };
+            std::cout << "  " << std::setw(7) << threads << "   " << std::left << std::setw(9)
+                      << lock_policy_name(policy) << std::right << std::fixed << std::setprecision(2) << std::setw(9)
+                      << total_ops / ms / 1000.0 << std::setw(9) << pct(0.5) << std::setw(10) << pct(0.99)
+                      << std::setw(11) << pct(0.999) << "\n";
+        }
+    }
+    Logger::set_quiet(false);
+}
+
+void bench_near_cache() {
+    std::cout << "\n[Read-mostly gets, zipf 0.99 over 10k keys, 1% sets, 4 threads: near cache off vs on]\n";
+    Logger::set_quiet(true);
+    const int keys = 10000, threads = 4, ops = 500000;
+    ZipfGenerator zipf(keys, 0.99);
+    std::vector<std::string> names;
+    for (int i = 0; i < keys; ++i) names.push_back("key" + std::to_string(i));
+
+    auto run = [&](Backend backend, bool near) {
+        KeyValueStore kv(backend);
+        for (const auto& name : names) kv.set(name, "value-" + name);
+        if (near) kv.set_near_cache(true);
+        std::atomic<uint64_t> hits{0}, lookups{0};
+        std::vector<std::thread> workers;
+        double ms = time_ms([&] {
+            for (int t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t] {
+                    std::mt19937 rng(static_cast<unsigned>(t));
+                    auto start = KeyValueStore::near_cache_stats();
+                    for (int i = 0; i < ops / threads; ++i) {
+                        const std::string& key = names[zipf(rng)];
+                        if (rng() % 100 == 0) kv.set(key, "updated");
+                        else kv.get(key);
+                    }
+                    auto end = KeyValueStore::near_cache_stats();
+                    hits += end.hits - start.hits;
+                    lookups += end.hits - start.hits + end.misses - start.misses;
+                });
+            }
+            for (auto& w : workers) w.join();
+        });
+        return std::make_pair(ops / ms / 1000.0, lookups ? 100.0 * hits / lookups : 0.0);
+    };
+    std::cout << "  backend    off Mops/s   on Mops/s   hit rate\n";
+    for (Backend backend : {Backend::Locked, Backend::LockFree, Backend::Cuckoo}) {
+        auto off = run(backend, false);
+        auto on = run(backend, true);
+        std::cout << "  " << std::left << std::setw(9) << backend_name(backend) << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(12) << off.first << std::setw(12) << on.first << std::setw(10)
+                  << std::setprecision(1) << on.second << "%\n";
+    }
+    Logger::set_quiet(false);
+}
+
+void bench_numa() {
+    NumaTopology topology = NumaTopology::detect();
+    if (topology.nodes.size() < 2) topology = NumaTopology::simulate(2);
+    const size_t nodes = topology.nodes.size();
+    std::cout << "\n[NUMA: shared store vs per-node partitions, " << nodes << (topology.simulated ? " simulated" : "")
+              << " nodes, 2 clients per node]\n";
+    Logger::set_quiet(true);
+    const int keys = 20000, ops = 50000;
+    const size_t clients = nodes * 2;
+    std::vector<std::string> names;
+    for (int i = 0; i < keys; ++i) names.push_back("key" + std::to_string(i));
+
+    // Runs body(client, node) on one thread per client, bound to its node
+    auto on_clients = [&](auto body) {
+        std::vector<std::thread> threads;
+        double ms = time_ms([&] {
+            for (size_t c = 0; c < clients; ++c) {
+                threads.emplace_back([&, c] {
+                    const NumaNode& node = topology.nodes[c % nodes];
+                    bind_current_thread_to_node(node, topology.simulated);
+                    body(c, node.id);
+                });
+            }
+            for (auto& t : threads) t.join();
+        });
+        return ms;
+    };
+
+    // Shared: whichever client inserts a key first decides where it lives
+    KeyValueStore shared;
+    std::vector<int> home(keys);
+    on_clients([&](size_t c, int node) {
+        for (int i = static_cast<int>(c); i < keys; i += static_cast<int>(clients)) {
+            shared.set(names[i], "value");
+            home[i] = node;
+        }
+    });
+    std::atomic<uint64_t> remote{0};
+    double shared_ms = on_clients([&](size_t c, int node) {
+        std::mt19937 rng(static_cast<unsigned>(c));
+        uint64_t mine = 0;
+        for (int i = 0; i < ops; ++i) {
+            int k = static_cast<int>(rng() % keys);
+            shared.get(names[k]);
+            mine += home[k] != node;
+        }
+        remote += mine;
+    });
+
+    // Partitioned: every access runs on the owning node
+    NumaStore partitioned(topology);
+    for (const auto& name : names) partitioned.set(name, "value");
+    auto before = partitioned.stats();
+    double numa_ms = on_clients([&](size_t c, int) {
+        std::mt19937 rng(static_cast<unsigned>(c));
+        for (int i = 0; i < ops; ++i) partitioned.get(names[rng() % keys]);
+    });
+    uint64_t handoffs = 0;
+    auto after = partitioned.stats();
+    for (size_t n = 0; n < nodes; ++n) handoffs += after[n].cross_node - before[n].cross_node;
+    Logger::set_quiet(false);
+
+    const double total = static_cast<double>(clients) * ops;
+    std::cout << "  mode           Mops/s   remote accesses   cross-node handoffs\n" << std::fixed << std::setprecision(2);
+    std::cout << "  shared   " << std::setw(12) << total / shared_ms / 1000.0 << std::setw(17) << std::setprecision(1)
+              << 100.0 * remote / total << "%" << std::setw(21) << "-" << "\n";
+    std::cout << "  per-node " << std::setw(12) << std::setprecision(2) << total / numa_ms / 1000.0 << std::setw(17)
+              << std::setprecision(1) << 0.0 << "%" << std::setw(20) << 100.0 * handoffs / total << "%\n";
+    std::cout << "  (remote = reads of memory first touched on another node; routed requests cost a queue handoff";
+    if (topology.simulated) std::cout << "; simulated nodes share memory, so only the accounting differs";
+    std::cout << ")\n";
+}
+
+void bench_epoch_reclamation() {
+    std::cout << "\n[Epoch reclamation costs]\n";
+    EpochReclaimer& ebr = EpochReclaimer::instance();
+    const int ops = 5000000;
+    volatile int sink = 0;
+    double empty_ms = time_ms([&] { for (int i = 0; i < ops; ++i) sink = i; });
+    double pin_ms = time_ms([&] {
+        for (int i = 0; i < ops; ++i) {
+            EpochReclaimer::Guard guard(ebr);
+            sink = i;
+        }
+    });
+    double nested_ms = time_ms([&] {
+        EpochReclaimer::Guard outer(ebr);
+        for (int i = 0; i < ops; ++i) {
+            EpochReclaimer::Guard guard(ebr);
+            sink = i;
+        }
+    });
+    const int retires = 1000000;
+    double retire_ms = time_ms([&] {
+        for (int i = 0; i < retires; ++i) ebr.retire(new int(i));
+        ebr.synchronize();
+    });
+
+    LockFreeHashMap map;
+    MutexTable locked;
+    for (int i = 0; i < 1000; ++i) {
+        map.insert_or_assign("key" + std::to_string(i), Value("v"));
+        locked.insert_or_assign("key" + std::to_string(i), Value("v"));
+    }
+    const int lookups = 1000000;
+    double lf_ms = time_ms([&] { for (int i = 0; i < lookups; ++i) map.find("key" + std::to_string(i % 1000)); });
+    double lk_ms = time_ms([&] { for (int i = 0; i < lookups; ++i) locked.find("key" + std::to_string(i % 1000)); });
+
+    auto line = [](const char* label, double ns) {
+        std::cout << "  " << std::left << std::setw(36) << label << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(7) << ns << " ns\n";
+    };
+    line("pin + unpin (read-side section)", (pin_ms - empty_ms) * 1e6 / ops);
+    line("nested pin + unpin", (nested_ms - empty_ms) * 1e6 / ops);
+    line("retire + free (amortized)", retire_ms * 1e6 / retires);
+    line("lockfree find (includes one pin)", lf_ms * 1e6 / lookups);
+    line("mutex + unordered_map find", lk_ms * 1e6 / lookups);
+}
+
+void run_benchmarks() {
+    bench_probabilistic_types();
+    bench_secondary_indexes();
+    bench_scripts();
+    bench_concurrent_tables();
+    bench_flat_combining();
+    bench_source();
+    bench_warm_restart();
+    bench_compressed_snapshots();
+    bench_cache_mode();
+    bench_lazy_free();
+    bench_bulk_delete();
+    bench_key_hashing();
+    bench_key_handles();
+    bench_prefix_backend();
+    bench_basic_store();
+    bench_store_locks();
+    bench_near_cache();
+    bench_numa();
+    bench_epoch_reclamation();
+}
+
+// ========== Main ==========
+int main(int argc, char* argv[]) {
+    bool bench = false;
+    std::string image, exec;
+    SchedulerOptions tasks;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string next = i + 1 < argc ? argv[i + 1] : "";
+        bool ok = true;
+        if (arg == "--bench") {
+            bench = true;
+            continue;
+        } else if (arg == "--exec") {
+            exec = next;
+            ok = !exec.empty();
+        } else if (arg == "--image") {
+            image = next;
+            ok = !image.empty();
+        } else if (arg == "--task-workers") {
+            auto n = parse_int(next);
+            ok = n && *n > 0;
+            if (ok) tasks.workers = static_cast<size_t>(*n);
+        } else if (arg == "--task-share") {
+            std::istringstream in(next);
+            ok = (in >> tasks.max_cpu_share) && tasks.max_cpu_share > 0 && tasks.max_cpu_share <= 1;
+        } else if (arg == "--task-cpus") {
+            std::istringstream in(next);
+            for (std::string cpu; ok && std::getline(in, cpu, ',');) {
+                auto n = parse_int(cpu);
+                ok = n && *n >= 0;
+                if (ok) tasks.cpus.push_back(static_cast<int>(*n));
+            }
+            ok = ok && !tasks.cpus.empty();
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            Logger::error("Bad option: " + arg + " " + next);
+            std::cerr << "Usage: kvstore [--bench] [--image file] [--exec file] [--task-workers N] [--task-share 0..1] [--task-cpus 0,1,...]\n";
+            return 1;
+        }
+        ++i;
+    }
+    configure_background_tasks(tasks);
+
+    if (bench) {
+        run_benchmarks();
+        return 0;
+    }
+
+    Logger::info("Running self-tests...");
+    run_tests();
+
+    Logger::info("Welcome to the Key-Value CLI Store");
+    Logger::info("Type 'exit' to quit");
+
+    NamespaceRegistry namespaces;
+    if (!image.empty()) namespaces.open(NamespaceRegistry::kDefault)->load_image(image); // warm restart
+    if (!exec.empty()) {
+        // Non-interactive: run the file, report, and exit non-zero on failures
+        CliSession session(namespaces);
+        auto summary = source_file(session, exec, SourceOptions());
+        if (!summary) return 1;
+        print_source_summary(std::cout, exec, *summary);
+        return summary->failed == 0 ? 0 : 1;
+    }
+    run_cli(namespaces);
     return 0;
 }
 